@@ -3,20 +3,27 @@
  *
  * A simple benchmarking program for the fbsplashrender library.
  *
+ * Usage: benchmark [theme]
+ *
+ * A theme with a large number of objects, suitable for measuring the
+ * per-paint cost of the renderer, can be generated with mkbenchtheme.sh.
+ *
  */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/time.h>
 #include <fbsplash.h>
 
 int main(int argc, char **argv)
 {
 	int tty = 0;
-	int i;
+	int i, cnt = 0;
 	struct fbspl_theme *theme;
+	struct timeval t1, t2;
 
 	fbsplash_lib_init(fbspl_bootup);
-	fbsplash_acc_theme_set("test");
+	fbsplash_acc_theme_set((argc > 1) ? argv[1] : "test");
 
 	fbsplashr_init(false);
 	theme = fbsplashr_theme_load();
@@ -34,14 +41,17 @@ int main(int argc, char **argv)
 	fbsplashr_tty_silent_update();
 	fbsplashr_render_screen(theme, true, false, FBSPL_EFF_NONE);
 
+	gettimeofday(&t1, NULL);
 	for (i = 0; i < 65536; i += 64) {
 		char a;
 		fbsplashr_progress_set(theme, i);
 		fbsplashr_render_screen(theme, false, false, FBSPL_EFF_NONE);
+		cnt++;
 		a = fbsplashr_input_getkey(false);
 		if (a == '\x1b')
 			break;
 	}
+	gettimeofday(&t2, NULL);
 
 	fbsplashr_tty_silent_cleanup();
 	fbsplashr_input_cleanup();
@@ -51,6 +61,9 @@ int main(int argc, char **argv)
 	fbsplashr_cleanup();
 	fbsplash_lib_cleanup();
 
+	printf("%d paints, %ld us/paint\n", cnt,
+		   ((t2.tv_sec - t1.tv_sec) * 1000000L + (t2.tv_usec - t1.tv_usec)) / cnt);
+
 	return 0;
 }
 
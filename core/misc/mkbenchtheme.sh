@@ -0,0 +1,49 @@
+#!/bin/bash
+#
+# mkbenchtheme.sh
+#
+# Generate a theme with a large number of icons, to be used with the
+# benchmark program for measuring the per-paint cost of the renderer.
+#
+# Usage: mkbenchtheme.sh <themedir> <xres>x<yres> <background> <icon.png> [count]
+#
+
+if [ $# -lt 4 ]; then
+	echo "Usage: $0 <themedir> <xres>x<yres> <background> <icon.png> [count]"
+	exit 1
+fi
+
+dir="$1"
+res="$2"
+bg="$3"
+ico="$4"
+cnt="${5:-500}"
+
+xres="${res%x*}"
+yres="${res#*x}"
+
+mkdir -p "${dir}/images" || exit 1
+cp "${bg}" "${dir}/images/background.${bg##*.}" || exit 1
+cp "${ico}" "${dir}/images/icon.png" || exit 1
+
+# Lay the icons out on a regular grid in the upper part of the screen,
+# leaving some space for the progress bar at the bottom.
+cols=25
+rows=$(( (cnt + cols - 1) / cols ))
+dx=$(( xres / (cols + 1) ))
+dy=$(( (yres * 3 / 4) / (rows + 1) ))
+
+{
+	echo "# Benchmark theme: ${cnt} icons, ${res}."
+	echo "pic=images/background.${bg##*.}"
+	echo "silentpic=images/background.${bg##*.}"
+	echo
+	echo "box silent inter 0 $(( yres * 7 / 8 )) 0 $(( yres * 7 / 8 + 15 )) #404080"
+	echo "box silent 0 $(( yres * 7 / 8 )) $(( xres - 1 )) $(( yres * 7 / 8 + 15 )) #8080ff"
+	echo
+
+	for i in `seq 0 $(( cnt - 1 ))`
+	do
+		echo "icon images/icon.png $(( (i % cols) * dx + dx / 2 )) $(( (i / cols) * dy + dy / 2 ))"
+	done
+} > "${dir}/${res}.cfg"
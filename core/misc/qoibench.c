@@ -0,0 +1,186 @@
+/*
+ * qoibench.c
+ *
+ * Compare the decoding speed of PNG (libpng) and QOI images.
+ *
+ * Usage: qoibench [-n rounds] image.png [...]
+ *
+ * Every PNG file is decoded to RGB(A) with libpng, encoded as QOI, and
+ * both versions are then decoded from memory 'rounds' times.  Theme
+ * images can be converted to QOI with splash_qoi.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <sys/time.h>
+#include <png.h>
+
+typedef unsigned char u8;
+#include "qoi.h"
+
+struct membuf {
+	u8 *data;
+	size_t len, pos;
+};
+
+static void png_mem_read(png_structp png_ptr, png_bytep out, png_size_t len)
+{
+	struct membuf *m = png_get_io_ptr(png_ptr);
+
+	if (m->pos + len > m->len)
+		png_error(png_ptr, "Read past the end of the file");
+
+	memcpy(out, m->data + m->pos, len);
+	m->pos += len;
+}
+
+/*
+ * Decode a PNG file from memory into RGBA.  Returns false if the file
+ * could not be decoded.
+ */
+static bool png_decode(struct membuf *m, u8 *out, unsigned int *w, unsigned int *h, bool *alpha)
+{
+	png_structp png_ptr;
+	png_infop info_ptr;
+	int i, type;
+
+	png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	info_ptr = png_create_info_struct(png_ptr);
+
+	if (setjmp(png_jmpbuf(png_ptr))) {
+		png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+		return false;
+	}
+
+	m->pos = 0;
+	png_set_read_fn(png_ptr, m, png_mem_read);
+	png_read_info(png_ptr, info_ptr);
+
+	type = png_get_color_type(png_ptr, info_ptr);
+	if (type == PNG_COLOR_TYPE_PALETTE)
+		png_set_palette_to_rgb(png_ptr);
+	if (type == PNG_COLOR_TYPE_GRAY || type == PNG_COLOR_TYPE_GRAY_ALPHA)
+		png_set_gray_to_rgb(png_ptr);
+	if (png_get_bit_depth(png_ptr, info_ptr) == 16)
+		png_set_strip_16(png_ptr);
+	if (png_get_valid(png_ptr, info_ptr, PNG_INFO_tRNS))
+		png_set_tRNS_to_alpha(png_ptr);
+	png_set_add_alpha(png_ptr, 0xff, PNG_FILLER_AFTER);
+	png_read_update_info(png_ptr, info_ptr);
+
+	*w = png_get_image_width(png_ptr, info_ptr);
+	*h = png_get_image_height(png_ptr, info_ptr);
+	*alpha = (type & PNG_COLOR_MASK_ALPHA) || png_get_valid(png_ptr, info_ptr, PNG_INFO_tRNS);
+
+	if (out) {
+		for (i = 0; i < *h; i++)
+			png_read_row(png_ptr, out + i * *w * 4, NULL);
+	}
+
+	png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+	return true;
+}
+
+static void qoi_decode(u8 *buf, size_t len, u8 *out, int bytespp)
+{
+	struct qoi_dec d;
+	int i;
+
+	if (qoi_dec_init(&d, buf, len))
+		return;
+
+	for (i = 0; i < d.h; i++)
+		qoi_dec_line(&d, out + i * d.w * bytespp, bytespp);
+}
+
+static double elapsed(struct timeval *t1, struct timeval *t2)
+{
+	return (t2->tv_sec - t1->tv_sec) + (t2->tv_usec - t1->tv_usec) / 1000000.0;
+}
+
+int main(int argc, char **argv)
+{
+	int rounds = 20, i, k;
+
+	if (argc > 2 && !strcmp(argv[1], "-n")) {
+		rounds = atoi(argv[2]);
+		argv += 2;
+		argc -= 2;
+	}
+
+	if (argc < 2 || rounds < 1) {
+		fprintf(stderr, "Usage: %s [-n rounds] image.png [...]\n", argv[0]);
+		return 1;
+	}
+
+	printf("%-24s %10s %10s %12s %12s %14s\n", "image", "PNG [kB]", "QOI [kB]",
+		   "PNG [MB/s]", "QOI [MB/s]", "QOI 3B [MB/s]");
+
+	for (k = 1; k < argc; k++) {
+		struct membuf m = { NULL, 0, 0 };
+		struct timeval t1, t2;
+		double tp, tq, tq3, mb;
+		unsigned int w, h;
+		u8 *img, *enc;
+		size_t len;
+		bool alpha;
+		FILE *fp;
+		long sz;
+
+		fp = fopen(argv[k], "r");
+		if (!fp || fseek(fp, 0, SEEK_END) || (sz = ftell(fp)) <= 0) {
+			fprintf(stderr, "Can't read %s.\n", argv[k]);
+			if (fp)
+				fclose(fp);
+			continue;
+		}
+
+		rewind(fp);
+		m.len = sz;
+		m.data = malloc(m.len);
+		if (!m.data || fread(m.data, 1, m.len, fp) != m.len ||
+			!png_decode(&m, NULL, &w, &h, &alpha)) {
+			fprintf(stderr, "Can't decode %s.\n", argv[k]);
+			fclose(fp);
+			free(m.data);
+			continue;
+		}
+		fclose(fp);
+
+		img = malloc(w * h * 4);
+		png_decode(&m, img, &w, &h, &alpha);
+
+		gettimeofday(&t1, NULL);
+		for (i = 0; i < rounds; i++)
+			png_decode(&m, img, &w, &h, &alpha);
+		gettimeofday(&t2, NULL);
+		tp = elapsed(&t1, &t2);
+
+		enc = qoi_encode(img, w, h, alpha, &len);
+
+		gettimeofday(&t1, NULL);
+		for (i = 0; i < rounds; i++)
+			qoi_decode(enc, len, img, 4);
+		gettimeofday(&t2, NULL);
+		tq = elapsed(&t1, &t2);
+
+		gettimeofday(&t1, NULL);
+		for (i = 0; i < rounds; i++)
+			qoi_decode(enc, len, img, 3);
+		gettimeofday(&t2, NULL);
+		tq3 = elapsed(&t1, &t2);
+
+		/* Throughput in megabytes of RGBA output per second. */
+		mb = (double)w * h * 4 * rounds / (1 << 20);
+		printf("%-24s %10zu %10zu %12.1f %12.1f %14.1f\n", argv[k], m.len >> 10, len >> 10,
+			   mb / tp, mb / tq, mb / tq3);
+
+		free(enc);
+		free(img);
+		free(m.data);
+	}
+
+	return 0;
+}
@@ -0,0 +1,101 @@
+/*
+ * arena.c - Scratch memory for the rendering code.
+ *
+ * Copyright (C) 2004-2008, Michal Januszewski <spock@gentoo.org>
+ *
+ * This file is subject to the terms and conditions of the GNU General Public
+ * License v2.  See the file COPYING in the main directory of this archive for
+ * more details.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "common.h"
+#include "render.h"
+
+/*
+ * An arena hands out memory that is only needed until the end of the
+ * current frame.  Requests are served from a single preallocated block.
+ * If that block is too small, the request is satisfied with a separate
+ * allocation and the block is enlarged at the next reset, so that the
+ * arena stops touching the heap once it has seen the largest frame.
+ */
+
+struct arena_chunk {
+	struct arena_chunk *next;
+};
+
+/* Keep all returned pointers suitably aligned for any type. */
+#define ARENA_ALIGN(n)	(((n) + sizeof(long) - 1) & ~(sizeof(long) - 1))
+
+/**
+ * Allocate memory from an arena.
+ *
+ * @param a The arena.
+ * @param size Number of bytes to allocate.
+ *
+ * @return A pointer to the allocated memory, valid until the next call
+ *         to arena_reset(), or NULL if there is not enough memory.
+ */
+void *arena_alloc(arena *a, size_t size)
+{
+	struct arena_chunk *c;
+	void *p;
+
+	size = ARENA_ALIGN(size);
+	a->used += size;
+
+	if (a->used <= a->size) {
+		p = a->buf + a->used - size;
+	} else {
+		c = malloc(sizeof(struct arena_chunk) + size);
+		if (!c)
+			return NULL;
+
+		c->next = a->extra;
+		a->extra = c;
+		p = c + 1;
+	}
+
+	if (a->used > a->peak)
+		a->peak = a->used;
+
+	return p;
+}
+
+/**
+ * Release all memory allocated from an arena since the last reset.
+ */
+void arena_reset(arena *a)
+{
+	struct arena_chunk *c;
+	u8 *t;
+
+	while (a->extra) {
+		c = a->extra;
+		a->extra = c->next;
+		free(c);
+	}
+
+	if (a->peak > a->size) {
+		t = realloc(a->buf, a->peak);
+		if (t) {
+			a->buf = t;
+			a->size = a->peak;
+		}
+	}
+
+	a->used = 0;
+}
+
+/**
+ * Free all memory used by an arena.
+ */
+void arena_free(arena *a)
+{
+	arena_reset(a);
+	free(a->buf);
+	memset(a, 0, sizeof(arena));
+}
@@ -0,0 +1,461 @@
+/*
+ * bundle.c - Precompiled theme bundles.
+ *
+ * Copyright (C) 2004-2008, Michal Januszewski <spock@gentoo.org>
+ *
+ * This file is subject to the terms and conditions of the GNU General Public
+ * License v2.  See the file COPYING in the main directory of this archive for
+ * more details.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "common.h"
+#include "render.h"
+
+/*
+ * A bundle contains the config file of a theme along with its background
+ * images and icons, already converted to the pixel format of a specific
+ * video mode.  When the bundle matches the current video mode, it is
+ * mapped into memory and the images are used directly from the mapping,
+ * so no JPEG or PNG decoding is necessary.
+ *
+ * The mapping is private and writable, so that the background images
+ * can be modified in place (e.g. by bake_static()) without affecting
+ * the file.
+ *
+ * Bundles are written by 'splash_util -c mkbundle' and are stored in the
+ * theme directory as <xres>x<yres>-<bpp>.bundle.  All values are stored
+ * in the byte order of the machine on which the bundle was created.
+ */
+
+#define BUNDLE_MAGIC		"FBSPLBDL"
+#define BUNDLE_VERSION		2
+#define BUNDLE_BYTEORDER	0x01020304
+#define BUNDLE_ALIGN		64
+#define BUNDLE_MAX_SIZE		16384	/* maximum width and height of an image */
+
+struct bundle_hdr {
+	char magic[8];
+	u32 version;
+	u32 byteorder;
+	u32 xres, yres;			/* resolution of the theme */
+	u32 cfg_xres, cfg_yres;	/* resolution of its config file */
+	u32 bpp, visual;		/* video mode the images were converted for */
+	u32 offset[3];			/* offsets of the red, green and blue channels */
+	u32 length[3];			/* lengths of the red, green and blue channels */
+	u32 cfg_off, cfg_len;	/* copy of the config file */
+	u32 img_off, img_num;	/* table of images */
+};
+
+struct bundle_img {
+	u32 type;				/* BUNDLE_VERBOSE, BUNDLE_SILENT or BUNDLE_ICON */
+	u32 w, h;
+	u32 name_off;			/* path of the source file */
+	u32 off, len;			/* pixel data */
+	u32 mtime, size;		/* of the source file when the bundle was created */
+};
+
+static void bundle_layout(struct bundle_hdr *hdr)
+{
+	hdr->bpp = fbd.var.bits_per_pixel;
+	hdr->visual = fbd.fix.visual;
+	hdr->offset[0] = fbd.var.red.offset;
+	hdr->offset[1] = fbd.var.green.offset;
+	hdr->offset[2] = fbd.var.blue.offset;
+	hdr->length[0] = fbd.var.red.length;
+	hdr->length[1] = fbd.var.green.length;
+	hdr->length[2] = fbd.var.blue.length;
+}
+
+/**
+ * Get the path of the bundle of the current theme for a given
+ * resolution and the current color depth.
+ */
+void bundle_path(char *buf, int len, int xres, int yres)
+{
+	snprintf(buf, len, FBSPL_THEME_DIR "/%s/%dx%d-%d.bundle", config.theme,
+			 xres, yres, fbd.var.bits_per_pixel);
+}
+
+static bool bundle_valid(stheme_t *theme, u8 *map, size_t len)
+{
+	struct bundle_hdr *hdr = (struct bundle_hdr*)map;
+	struct bundle_hdr want;
+	struct bundle_img *img;
+	int i;
+
+	if (len < sizeof(*hdr) || memcmp(hdr->magic, BUNDLE_MAGIC, 8) ||
+		hdr->version != BUNDLE_VERSION || hdr->byteorder != BUNDLE_BYTEORDER)
+		return false;
+
+	bundle_layout(&want);
+	if (hdr->xres != theme->xres || hdr->yres != theme->yres ||
+		hdr->bpp != want.bpp || hdr->visual != want.visual ||
+		memcmp(hdr->offset, want.offset, sizeof(want.offset)) ||
+		memcmp(hdr->length, want.length, sizeof(want.length)))
+		return false;
+
+	/* The resolution of the config file is only unknown if the theme
+	 * directory contains nothing but the bundle. */
+	if (theme->cfg_xres && (hdr->cfg_xres != theme->cfg_xres ||
+							hdr->cfg_yres != theme->cfg_yres))
+		return false;
+
+	if (hdr->cfg_off > len || hdr->cfg_len > len - hdr->cfg_off ||
+		hdr->img_off > len || hdr->img_num > (len - hdr->img_off) / sizeof(*img))
+		return false;
+
+	img = (struct bundle_img*)(map + hdr->img_off);
+	for (i = 0; i < hdr->img_num; i++, img++) {
+		if (img->off > len || img->len > len - img->off ||
+			img->name_off >= len || !memchr(map + img->name_off, 0, len - img->name_off))
+			return false;
+	}
+
+	return true;
+}
+
+/**
+ * Map a bundle into memory and attach it to a theme.
+ *
+ * @return 0 on success, -1 if the bundle cannot be used with the
+ *         current video mode and theme.
+ */
+int bundle_map(stheme_t *theme, const char *path)
+{
+	struct stat st;
+	u8 *map;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	if (fstat(fd, &st) || st.st_size < sizeof(struct bundle_hdr)) {
+		close(fd);
+		return -1;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (map == MAP_FAILED)
+		return -1;
+
+	if (!bundle_valid(theme, map, st.st_size)) {
+		iprint(MSG_WARN, "Theme bundle %s does not match the current video mode.\n", path);
+		munmap(map, st.st_size);
+		return -1;
+	}
+
+	theme->bundle = map;
+	theme->bundle_len = st.st_size;
+	theme->cfg_xres = ((struct bundle_hdr*)map)->cfg_xres;
+	theme->cfg_yres = ((struct bundle_hdr*)map)->cfg_yres;
+	return 0;
+}
+
+/**
+ * Attach the bundle of the current theme to a theme descriptor,
+ * if there is one for the current video mode.
+ */
+int bundle_open(stheme_t *theme)
+{
+	char buf[512];
+
+	bundle_path(buf, sizeof(buf), theme->xres, theme->yres);
+	return bundle_map(theme, buf);
+}
+
+void bundle_close(stheme_t *theme)
+{
+	if (theme->bundle)
+		munmap(theme->bundle, theme->bundle_len);
+
+	theme->bundle = NULL;
+	theme->bundle_len = 0;
+}
+
+/**
+ * Get the copy of the config file stored in the bundle of a theme.
+ *
+ * @return The contents of the file (not NUL-terminated), or NULL if
+ *         the theme has no bundle.
+ */
+const char *bundle_cfg(stheme_t *theme, size_t *len)
+{
+	struct bundle_hdr *hdr = (struct bundle_hdr*)theme->bundle;
+
+	if (!hdr || !hdr->cfg_len)
+		return NULL;
+
+	*len = hdr->cfg_len;
+	return (char*)theme->bundle + hdr->cfg_off;
+}
+
+/**
+ * Look up an image in the bundle of a theme.
+ *
+ * @param theme The theme.
+ * @param type BUNDLE_VERBOSE, BUNDLE_SILENT or BUNDLE_ICON.
+ * @param src Path of the source file of the image.  If the file exists
+ *            and has been modified since the bundle was created, the
+ *            image is not used.
+ * @param w Set to the width of the image.
+ * @param h Set to the height of the image.
+ *
+ * @return The pixel data: in the framebuffer format for backgrounds,
+ *         RGBA for icons.  NULL if the image is not in the bundle.
+ */
+u8 *bundle_get(stheme_t *theme, int type, const char *src, unsigned int *w, unsigned int *h)
+{
+	struct bundle_hdr *hdr = (struct bundle_hdr*)theme->bundle;
+	struct bundle_img *img;
+	struct stat st;
+	int i;
+
+	if (!hdr || !src)
+		return NULL;
+
+	img = (struct bundle_img*)(theme->bundle + hdr->img_off);
+	for (i = 0; i < hdr->img_num; i++, img++) {
+		if (img->type != type || strcmp((char*)theme->bundle + img->name_off, src))
+			continue;
+
+		if (!stat(src, &st) && (st.st_mtime != img->mtime || st.st_size != img->size)) {
+			iprint(MSG_WARN, "Image %s has changed since the theme bundle was created.\n", src);
+			return NULL;
+		}
+
+		if (!img->w || !img->h || img->w > BUNDLE_MAX_SIZE || img->h > BUNDLE_MAX_SIZE ||
+			img->len < (size_t)img->w * img->h * ((type == BUNDLE_ICON) ? 4 : fbd.bytespp))
+			return NULL;
+
+		/* Backgrounds have to cover exactly the whole theme.  If they
+		 * don't, they are loaded from the source file instead. */
+		if (type != BUNDLE_ICON && (img->w != theme->xres || img->h != theme->yres)) {
+			iprint(MSG_WARN, "Image size mismatch: %s.\n", src);
+			return NULL;
+		}
+
+		*w = img->w;
+		*h = img->h;
+		return theme->bundle + img->off;
+	}
+
+	return NULL;
+}
+
+/**
+ * Check whether a buffer is a part of the bundle of a theme.
+ */
+bool bundle_owns(stheme_t *theme, void *p)
+{
+	return (u8*)p >= theme->bundle && (u8*)p < theme->bundle + theme->bundle_len;
+}
+
+/**
+ * Free a buffer, unless it is a part of the bundle of a theme.  Images
+ * mapped from the image cache are unmapped.
+ */
+void bundle_release(stheme_t *theme, void *p)
+{
+	if (!bundle_owns(theme, p) && !cache_release(theme, p))
+		free(p);
+}
+
+/*
+ * Add an image to the table of images of a bundle being written.
+ */
+static void bundle_add(struct bundle_img *img, char **names, u8 **data, int *num,
+		int type, char *src, u8 *pixels, unsigned int w, unsigned int h, int bytespp)
+{
+	struct stat st;
+
+	if (!pixels || !src)
+		return;
+
+	memset(&img[*num], 0, sizeof(*img));
+	img[*num].type = type;
+	img[*num].w = w;
+	img[*num].h = h;
+	img[*num].len = w * h * bytespp;
+
+	if (!stat(src, &st)) {
+		img[*num].mtime = st.st_mtime;
+		img[*num].size = st.st_size;
+	}
+
+	names[*num] = src;
+	data[(*num)++] = pixels;
+}
+
+/**
+ * Write a bundle containing the images of a theme, in the pixel format
+ * of the current video mode.
+ *
+ * The theme has to be loaded without a bundle, and before any objects
+ * are rendered into its background images.
+ *
+ * @param theme The theme.
+ * @param path Where the bundle is to be written.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int bundle_write(stheme_t *theme, const char *path)
+{
+	struct bundle_hdr hdr;
+	struct bundle_img *img = NULL;
+	char **names = NULL;
+	u8 **data = NULL;
+	char *cfg = NULL, *tmp = NULL;
+	char buf[512];
+	FILE *fp = NULL;
+	struct stat st;
+	u32 off;
+	int i, num = 0, n = 2, err = -1;
+	item *it;
+
+	if (fbd.var.bits_per_pixel == 8) {
+		iprint(MSG_ERROR, "Theme bundles are not supported in 8bpp modes.\n");
+		return -1;
+	}
+
+	/* Keep a copy of the config file, for systems on which only
+	 * the bundle is available. */
+	snprintf(buf, sizeof(buf), FBSPL_THEME_DIR "/%s/%dx%d.cfg", config.theme, theme->cfg_xres, theme->cfg_yres);
+	fp = fopen(buf, "r");
+	if (!fp || fstat(fileno(fp), &st)) {
+		iprint(MSG_ERROR, "Can't open cfg file %s.\n", buf);
+		goto out;
+	}
+
+	cfg = malloc(st.st_size);
+	if (!cfg || fread(cfg, 1, st.st_size, fp) != st.st_size) {
+		iprint(MSG_ERROR, "Failed to read cfg file %s.\n", buf);
+		goto out;
+	}
+	fclose(fp);
+	fp = NULL;
+
+	for (it = theme->icons.head; it != NULL; it = it->next)
+		n++;
+
+	img = malloc(n * sizeof(*img));
+	names = malloc(n * sizeof(char*));
+	data = malloc(n * sizeof(u8*));
+	tmp = malloc(strlen(path) + 5);
+	if (!img || !names || !data || !tmp) {
+		iprint(MSG_ERROR, "Failed to allocate memory for the theme bundle.\n");
+		goto out;
+	}
+
+	bundle_add(img, names, data, &num, BUNDLE_VERBOSE, theme->pic, (u8*)theme->verbose_img.data,
+			   theme->xres, theme->yres, fbd.bytespp);
+	bundle_add(img, names, data, &num, BUNDLE_SILENT, theme->silentpic, (u8*)theme->silent_img.data,
+			   theme->xres, theme->yres, fbd.bytespp);
+
+	for (it = theme->icons.head; it != NULL; it = it->next) {
+		icon_img *ii = it->p;
+		bundle_add(img, names, data, &num, BUNDLE_ICON, ii->filename, ii->picbuf, ii->w, ii->h, 4);
+	}
+
+	/* Lay out the file: header, image table, names, config file,
+	 * and finally the aligned pixel data. */
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, BUNDLE_MAGIC, 8);
+	hdr.version = BUNDLE_VERSION;
+	hdr.byteorder = BUNDLE_BYTEORDER;
+	hdr.xres = theme->xres;
+	hdr.yres = theme->yres;
+	hdr.cfg_xres = theme->cfg_xres;
+	hdr.cfg_yres = theme->cfg_yres;
+	bundle_layout(&hdr);
+
+	off = sizeof(hdr);
+	hdr.img_off = off;
+	hdr.img_num = num;
+	off += num * sizeof(*img);
+
+	for (i = 0; i < num; i++) {
+		img[i].name_off = off;
+		off += strlen(names[i]) + 1;
+	}
+
+	hdr.cfg_off = off;
+	hdr.cfg_len = st.st_size;
+	off += st.st_size;
+
+	/* Icons sharing their pixel data in the icon atlas are only
+	 * stored once. */
+	for (i = 0; i < num; i++) {
+		int j;
+
+		for (j = 0; j < i && data[j] != data[i]; j++)
+			;
+
+		if (j < i) {
+			img[i].off = img[j].off;
+			continue;
+		}
+
+		off = (off + BUNDLE_ALIGN - 1) & ~(BUNDLE_ALIGN - 1);
+		img[i].off = off;
+		off += img[i].len;
+	}
+
+	/* Write to a temporary file first, so that a partially written
+	 * bundle is never used. */
+	sprintf(tmp, "%s.tmp", path);
+	fp = fopen(tmp, "w");
+	if (!fp) {
+		iprint(MSG_ERROR, "Can't open %s for writing.\n", tmp);
+		goto out;
+	}
+
+	fwrite(&hdr, sizeof(hdr), 1, fp);
+	fwrite(img, sizeof(*img), num, fp);
+	for (i = 0; i < num; i++)
+		fwrite(names[i], strlen(names[i]) + 1, 1, fp);
+	fwrite(cfg, st.st_size, 1, fp);
+
+	for (i = 0; i < num; i++) {
+		if (i > 0 && img[i].off <= img[i-1].off)
+			continue;
+
+		fseek(fp, img[i].off, SEEK_SET);
+		fwrite(data[i], img[i].len, 1, fp);
+	}
+
+	if (ferror(fp) | fclose(fp)) {
+		fp = NULL;
+		iprint(MSG_ERROR, "Failed to write %s.\n", tmp);
+		unlink(tmp);
+		goto out;
+	}
+	fp = NULL;
+
+	if (rename(tmp, path)) {
+		iprint(MSG_ERROR, "Failed to rename %s to %s.\n", tmp, path);
+		unlink(tmp);
+		goto out;
+	}
+
+	err = 0;
+out:
+	if (fp)
+		fclose(fp);
+	free(cfg);
+	free(img);
+	free(names);
+	free(data);
+	free(tmp);
+	return err;
+}
@@ -0,0 +1,353 @@
+/*
+ * cache.c - Cache of decoded images, shared by all splash processes.
+ *
+ * Copyright (C) 2004-2008, Michal Januszewski <spock@gentoo.org>
+ *
+ * This file is subject to the terms and conditions of the GNU General Public
+ * License v2.  See the file COPYING in the main directory of this archive for
+ * more details.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/vfs.h>
+#include "common.h"
+#include "render.h"
+
+/*
+ * The daemon, fbcondecor_ctl, splash_util and the kernel helper all load
+ * the same theme images, often for the same video mode.  Whenever one of
+ * them decodes a background image or an icon, the result is stored in
+ * CACHE_DIR, and the others then simply map it instead of decoding the
+ * image again.
+ *
+ * Every entry is a file named after a hash of its key: the path, mtime
+ * and size of the source image and everything that affects the decoded
+ * pixels (the pixel format of the video mode for background images, the
+ * resolution of the theme, scaling, the JPEG decoding profile).  The full
+ * key is also stored in the header of the entry and checked when the entry
+ * is used.  Entries are written to a temporary file which is then renamed,
+ * so that other processes never see an incomplete entry.
+ *
+ * Like the theme bundle, the entries are mapped privately, so the images
+ * can be modified in place without affecting the file.  Entries are only
+ * ever written to an in-memory filesystem, and they are never removed --
+ * the cache directory doesn't outlive the boot process.
+ */
+
+#define CACHE_DIR		FBSPLASH_CACHEDIR"/img"
+#define CACHE_PATH_LEN	(sizeof(CACHE_DIR) + 17)	/* CACHE_DIR/<16 hex digits> */
+#define CACHE_MAGIC		"FBSPLIMG"
+#define CACHE_VERSION	1
+#define CACHE_DATA_OFF	4096	/* header size; the pixel data is page-aligned */
+
+#ifndef TMPFS_MAGIC
+#define TMPFS_MAGIC		0x01021994
+#endif
+#ifndef RAMFS_MAGIC
+#define RAMFS_MAGIC		0x858458f6
+#endif
+
+struct cache_key {
+	u32 type;				/* BUNDLE_SILENT for backgrounds, BUNDLE_ICON */
+	u32 bpp, visual;		/* video mode (backgrounds only) */
+	u32 offset[3];
+	u32 length[3];
+	u32 xres, yres;			/* resolution of the theme */
+	u32 cfg_xres, cfg_yres;	/* resolution of its config file */
+	u32 scale;				/* scaling filter */
+	u32 fast;				/* fast JPEG decoding */
+	u32 pad;
+	u64 mtime, size;		/* source file */
+};
+
+struct cache_hdr {
+	char magic[8];
+	u32 version;
+	u32 w, h;
+	u32 path_len;
+	struct cache_key key;
+	char path[];			/* path of the source file */
+};
+
+struct cache_map {
+	u8 *p;
+	size_t len;
+};
+
+/*
+ * Fill in the key of an image.  Returns -1 if the source file doesn't
+ * exist or its path is too long to be stored.
+ */
+static int cache_key(stheme_t *theme, int type, const char *src, bool fast,
+					 struct cache_key *key)
+{
+	struct stat st;
+
+	if (!src || strlen(src) >= CACHE_DATA_OFF - sizeof(struct cache_hdr) ||
+		stat(src, &st))
+		return -1;
+
+	memset(key, 0, sizeof(*key));
+	key->mtime = st.st_mtime;
+	key->size = st.st_size;
+	key->xres = theme->xres;
+	key->yres = theme->yres;
+	key->cfg_xres = theme->cfg_xres;
+	key->cfg_yres = theme->cfg_yres;
+	key->scale = theme_scaled(theme) ? config.scale : 0;
+
+	/* Icons are stored as RGBA, whatever the video mode is. */
+	if (type == BUNDLE_ICON) {
+		key->type = BUNDLE_ICON;
+		return 0;
+	}
+
+	key->type = BUNDLE_SILENT;
+	key->fast = fast;
+	key->bpp = fbd.var.bits_per_pixel;
+	key->visual = fbd.fix.visual;
+	key->offset[0] = fbd.var.red.offset;
+	key->offset[1] = fbd.var.green.offset;
+	key->offset[2] = fbd.var.blue.offset;
+	key->length[0] = fbd.var.red.length;
+	key->length[1] = fbd.var.green.length;
+	key->length[2] = fbd.var.blue.length;
+	return 0;
+}
+
+static void cache_path(char *buf, int len, struct cache_key *key, const char *src)
+{
+	u64 h = 14695981039346656037ULL;
+	const u8 *p;
+	int i;
+
+	/* FNV-1a */
+	for (p = (u8*)key, i = 0; i < sizeof(*key); i++)
+		h = (h ^ p[i]) * 1099511628211ULL;
+	for (p = (u8*)src; *p; p++)
+		h = (h ^ *p) * 1099511628211ULL;
+
+	snprintf(buf, len, CACHE_DIR "/%016llx", (unsigned long long)h);
+}
+
+static int cache_add(stheme_t *theme, u8 *p, size_t len)
+{
+	struct cache_map *t;
+
+	pool_lock();
+	t = realloc(theme->cache, (theme->cache_num + 1) * sizeof(*t));
+	if (t) {
+		theme->cache = t;
+		t[theme->cache_num].p = p;
+		t[theme->cache_num].len = len;
+		theme->cache_num++;
+	}
+	pool_unlock();
+
+	return t ? 0 : -1;
+}
+
+/**
+ * Look up an image in the image cache.
+ *
+ * @param theme The theme.
+ * @param type BUNDLE_VERBOSE, BUNDLE_SILENT or BUNDLE_ICON.  Background
+ *             images are shared by both modes.
+ * @param src Path of the source file of the image.
+ * @param fast Set if a JPEG image is to be decoded with the fast profile.
+ * @param w Set to the width of the image.
+ * @param h Set to the height of the image.
+ *
+ * @return The pixel data: in the framebuffer format for backgrounds,
+ *         RGBA for icons.  NULL if the image is not in the cache.
+ */
+u8 *cache_get(stheme_t *theme, int type, const char *src, bool fast,
+			  unsigned int *w, unsigned int *h)
+{
+	struct cache_key key;
+	struct cache_hdr *hdr;
+	struct stat st;
+	char path[CACHE_PATH_LEN];
+	size_t len;
+	u8 *map;
+	int fd;
+
+	if (cache_key(theme, type, src, fast, &key))
+		return NULL;
+
+	cache_path(path, sizeof(path), &key, src);
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &st) || st.st_size < CACHE_DATA_OFF) {
+		close(fd);
+		return NULL;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (map == MAP_FAILED)
+		return NULL;
+
+	hdr = (struct cache_hdr*)map;
+	len = (size_t)hdr->w * hdr->h * ((type == BUNDLE_ICON) ? 4 : fbd.bytespp);
+
+	if (memcmp(hdr->magic, CACHE_MAGIC, 8) || hdr->version != CACHE_VERSION ||
+		memcmp(&hdr->key, &key, sizeof(key)) || hdr->path_len != strlen(src) ||
+		hdr->path_len >= CACHE_DATA_OFF - sizeof(*hdr) ||
+		memcmp(hdr->path, src, hdr->path_len) || st.st_size < CACHE_DATA_OFF + len ||
+		cache_add(theme, map, st.st_size)) {
+		munmap(map, st.st_size);
+		return NULL;
+	}
+
+	*w = hdr->w;
+	*h = hdr->h;
+	return map + CACHE_DATA_OFF;
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+	const u8 *p = buf;
+	ssize_t t;
+
+	while (len > 0) {
+		t = write(fd, p, len);
+		if (t <= 0)
+			return -1;
+		p += t;
+		len -= t;
+	}
+
+	return 0;
+}
+
+/**
+ * Store a decoded image in the image cache.  The parameters are the
+ * same as for cache_get().
+ *
+ * @return The copy of the image in the cache, which can be used in place
+ *         of 'data', or NULL if the image could not be stored.
+ */
+u8 *cache_put(stheme_t *theme, int type, const char *src, bool fast,
+			  const u8 *data, unsigned int w, unsigned int h)
+{
+	struct cache_key key;
+	struct cache_hdr *hdr;
+	struct statfs sfs;
+	char path[CACHE_PATH_LEN], tmp[CACHE_PATH_LEN + 7];
+	unsigned int cw, ch;
+	int fd, err;
+
+	if (!data || cache_key(theme, type, src, fast, &key))
+		return NULL;
+
+	/* Never leave the images on a disk. */
+	if (statfs(FBSPLASH_CACHEDIR, &sfs) ||
+		(sfs.f_type != TMPFS_MAGIC && sfs.f_type != RAMFS_MAGIC))
+		return NULL;
+
+	mkdir(CACHE_DIR, 0755);
+
+	cache_path(path, sizeof(path), &key, src);
+	snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+
+	hdr = calloc(1, CACHE_DATA_OFF);
+	if (!hdr)
+		return NULL;
+
+	fd = mkstemp(tmp);
+	if (fd < 0) {
+		free(hdr);
+		return NULL;
+	}
+
+	memcpy(hdr->magic, CACHE_MAGIC, 8);
+	hdr->version = CACHE_VERSION;
+	hdr->w = w;
+	hdr->h = h;
+	hdr->path_len = strlen(src);
+	hdr->key = key;
+	memcpy(hdr->path, src, hdr->path_len);
+
+	err = write_all(fd, hdr, CACHE_DATA_OFF) ||
+		  write_all(fd, data, (size_t)w * h * ((type == BUNDLE_ICON) ? 4 : fbd.bytespp)) ||
+		  fchmod(fd, 0644);
+	err = close(fd) || err;
+	free(hdr);
+
+	if (err || rename(tmp, path)) {
+		iprint(MSG_WARN, "Failed to store %s in the image cache.\n", src);
+		unlink(tmp);
+		return NULL;
+	}
+
+	return cache_get(theme, type, src, fast, &cw, &ch);
+}
+
+/**
+ * Check whether a buffer is an image mapped from the image cache.
+ */
+bool cache_owns(stheme_t *theme, void *p)
+{
+	bool ret = false;
+	int i;
+
+	pool_lock();
+	for (i = 0; i < theme->cache_num && !ret; i++)
+		ret = ((u8*)p >= theme->cache[i].p && (u8*)p < theme->cache[i].p + theme->cache[i].len);
+	pool_unlock();
+
+	return ret;
+}
+
+/**
+ * Unmap an image mapped from the image cache.
+ *
+ * @return true if the image was mapped from the cache, false otherwise.
+ */
+bool cache_release(stheme_t *theme, void *p)
+{
+	bool ret = false;
+	int i;
+
+	pool_lock();
+	for (i = 0; i < theme->cache_num; i++) {
+		struct cache_map *m = &theme->cache[i];
+
+		if ((u8*)p >= m->p && (u8*)p < m->p + m->len) {
+			munmap(m->p, m->len);
+			*m = theme->cache[--theme->cache_num];
+			ret = true;
+			break;
+		}
+	}
+	pool_unlock();
+
+	return ret;
+}
+
+/**
+ * Unmap all images of a theme mapped from the image cache.
+ */
+void cache_close(stheme_t *theme)
+{
+	int i;
+
+	for (i = 0; i < theme->cache_num; i++)
+		munmap(theme->cache[i].p, theme->cache[i].len);
+
+	free(theme->cache);
+	theme->cache = NULL;
+	theme->cache_num = 0;
+}
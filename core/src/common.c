@@ -85,16 +85,147 @@ tryopen:
 	return c;
 }
 
+/* The current mapping of the framebuffer memory. */
+static u8 *fb_map = NULL;
+static size_t fb_map_len = 0;
+
+/**
+ * Check whether page flipping has been requested and can be used with
+ * the current video mode.
+ *
+ * Two pages fit into the virtual screen if it is at least twice as high
+ * as the visible one, and the display can be panned between them if
+ * the device supports vertical panning in steps that divide yres.
+ */
+bool fb_flip_possible(void)
+{
+	return config.pageflip && fbd.var.yres_virtual >= 2 * fbd.var.yres &&
+		   fbd.fix.ypanstep && !(fbd.var.yres % fbd.fix.ypanstep);
+}
+
+/**
+ * Map the framebuffer memory.
+ *
+ * With page flipping, both pages are mapped.  Page 0 starts at the top
+ * of the virtual screen and page 1 right below it.
+ *
+ * @return A pointer to the currently displayed page, or NULL if the
+ *         mapping failed.
+ */
 void* fb_mmap(int fb)
 {
-	return mmap(NULL, fbd.fix.line_length * fbd.var.yres,
-			PROT_WRITE | PROT_READ, MAP_SHARED, fb,
+	size_t page = fbd.fix.line_length * fbd.var.yres;
+	void *t;
+
+	fbd.flip = fb_flip_possible();
+	if (fbd.flip) {
+		t = mmap(NULL, 2 * page, PROT_WRITE | PROT_READ, MAP_SHARED, fb, 0);
+		if (t != MAP_FAILED) {
+			fb_map = t;
+			fb_map_len = 2 * page;
+			shadow_init(fb_map, fb_map_len, page);
+			fbd.page = (fbd.var.yoffset == fbd.var.yres) ? 1 : 0;
+			return fb_map + fbd.page * page;
+		}
+
+		iprint(MSG_WARN, "Failed to map two pages of the framebuffer, page flipping disabled.\n");
+		fbd.flip = false;
+	}
+
+	t = mmap(NULL, page, PROT_WRITE | PROT_READ, MAP_SHARED, fb,
 			fbd.var.yoffset * fbd.fix.line_length);
+	if (t == MAP_FAILED)
+		return NULL;
+
+	fb_map = t;
+	fb_map_len = page;
+	fbd.page = 0;
+	shadow_init(fb_map, fb_map_len, page);
+	return fb_map;
 }
 
 void fb_unmap(u8 *fb)
 {
-	munmap(fb, fbd.fix.line_length * fbd.var.yres);
+	if (!fb_map)
+		return;
+
+	shadow_free();
+	munmap(fb_map, fb_map_len);
+	fb_map = NULL;
+	fb_map_len = 0;
+	fbd.flip = false;
+}
+
+/**
+ * Get the page which is currently not displayed.
+ *
+ * @return A pointer to the hidden page if page flipping is used,
+ *         fb_mem otherwise.
+ */
+u8 *fb_hidden(void)
+{
+	if (!fbd.flip)
+		return fb_mem;
+
+	return fb_map + (1 - fbd.page) * fbd.fix.line_length * fbd.var.yres;
+}
+
+/**
+ * Display the hidden page.
+ *
+ * On success, fb_mem is updated to point to the newly displayed page.
+ * If the device refuses to pan, page flipping is disabled and the
+ * display is left unchanged.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int fb_flip(int fb)
+{
+	struct fb_var_screeninfo var;
+
+	if (!fbd.flip)
+		return -1;
+
+	memcpy(&var, &fbd.var, sizeof(var));
+	var.xoffset = 0;
+	var.yoffset = (1 - fbd.page) * fbd.var.yres;
+
+	if (ioctl(fb, FBIOPAN_DISPLAY, &var) == -1) {
+		iprint(MSG_WARN, "Failed to pan the display (errno=%d), page flipping disabled.\n", errno);
+		fbd.flip = false;
+		return -1;
+	}
+
+	fbd.var.xoffset = var.xoffset;
+	fbd.var.yoffset = var.yoffset;
+	fb_mem = fb_hidden();
+	fbd.page = 1 - fbd.page;
+	return 0;
+}
+
+/**
+ * Get the duration of a single frame of the current video mode,
+ * in usecs.
+ */
+int fb_frame_interval(void)
+{
+	struct fb_var_screeninfo *v = &fbd.var;
+	unsigned long long t;
+
+	if (!v->pixclock)
+		return 1000000 / 60;
+
+	/* pixclock is the duration of a pixel in picoseconds. */
+	t = (unsigned long long)v->pixclock *
+		(v->xres + v->left_margin + v->right_margin + v->hsync_len) *
+		(v->yres + v->upper_margin + v->lower_margin + v->vsync_len);
+	t /= 1000000;
+
+	/* Reject anything outside of the 20-240 Hz range. */
+	if (t < 1000000 / 240 || t > 1000000 / 20)
+		return 1000000 / 60;
+
+	return t;
 }
 
 int fb_get_settings(int fb)
@@ -109,6 +240,15 @@ int fb_get_settings(int fb)
 		return 3;
 	}
 
+	fb_layout_init();
+	return 0;
+}
+
+/**
+ * Derive the pixel layout data in fbd from fbd.var and fbd.fix.visual.
+ */
+void fb_layout_init(void)
+{
 	fbd.bytespp = (fbd.var.bits_per_pixel + 7) >> 3;
 
 	/* Check if optimized code can be used. We use special optimizations for
@@ -138,7 +278,9 @@ int fb_get_settings(int fb)
 		}
 	}
 
-	return 0;
+	/* Pick the pixel kernels once, so that the renderer doesn't have to
+	 * check the pixel format for every pixel. */
+	pixfmt_select();
 }
 
 int cfg_check_sanity(stheme_t *theme, u8 mode)
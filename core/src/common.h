@@ -38,6 +38,7 @@
 typedef u_int8_t	u8;
 typedef u_int16_t	u16;
 typedef u_int32_t	u32;
+typedef u_int64_t	u64;
 typedef int8_t		s8;
 typedef int16_t		s16;
 typedef int32_t		s32;
@@ -79,8 +80,42 @@ typedef enum { little, big } sendian_t;
 } while (0);
 
 #define CLAMP(x)		((x) > 255 ? 255 : (x))
+
+/* Division by 255, exact for 0 <= x < 65535 (i.e. any product of two u8's). */
+#define DIV255(x)		(((x) + 1 + ((x) >> 8)) >> 8)
 #define DEBUG(x...)
 
+#ifdef CONFIG_DEBUG
+/*
+ * Count all heap allocations made by the library, so that we can
+ * verify that the steady-state rendering loop doesn't do any.  The
+ * counter is updated atomically, as themes are loaded by several threads.
+ */
+extern unsigned int fbspl_allocs;
+
+static inline void *fbspl_dbg_malloc(size_t size)
+{
+	__sync_fetch_and_add(&fbspl_allocs, 1);
+	return (malloc)(size);
+}
+
+static inline void *fbspl_dbg_calloc(size_t n, size_t size)
+{
+	__sync_fetch_and_add(&fbspl_allocs, 1);
+	return (calloc)(n, size);
+}
+
+static inline void *fbspl_dbg_realloc(void *p, size_t size)
+{
+	__sync_fetch_and_add(&fbspl_allocs, 1);
+	return (realloc)(p, size);
+}
+
+#define malloc(size)		fbspl_dbg_malloc(size)
+#define calloc(n, size)		fbspl_dbg_calloc(n, size)
+#define realloc(p, size)	fbspl_dbg_realloc(p, size)
+#endif
+
 #define WANT_TTF	((defined(CONFIG_TTF_KERNEL) && defined(TARGET_KERNEL)) || (defined(CONFIG_TTF) && !defined(TARGET_KERNEL)))
 #define WANT_MNG	(defined(CONFIG_MNG) && !defined(TARGET_KERNEL))
 
@@ -34,9 +34,16 @@ pthread_mutex_t mtx_tty = PTHREAD_MUTEX_INITIALIZER;
 pthread_mutex_t mtx_paint = PTHREAD_MUTEX_INITIALIZER;
 pthread_mutex_t mtx_anim = PTHREAD_MUTEX_INITIALIZER;
 pthread_cond_t  cnd_anim;
+pthread_cond_t  cnd_paint;
 pthread_condattr_t cnd_attr;
 
-pthread_t th_switchmon, th_sighandler, th_anim;
+pthread_t th_switchmon, th_sighandler, th_anim, th_paint;
+
+/* Frame scheduling for the 'paint' command */
+int frame_interval = -1;	/* in usecs; 0 to paint synchronously */
+bool paint_pending = false;
+static bool paint_quit = false;
+static struct timespec paint_last;
 
 int ctty = CTTY_VERBOSE;
 
@@ -222,6 +229,113 @@ next:	pthread_mutex_unlock(&mtx_paint);
 	}
 }
 
+/*
+ * Paint the updated parts of the screen right away.  Called with
+ * mtx_paint held.
+ */
+static void paint_now(void)
+{
+	paint_pending = false;
+
+	if (theme && ctty == CTTY_SILENT) {
+		/* Without the paint thread, there will be no later frame to
+		 * show the icons which are still being loaded. */
+		if (frame_interval <= 0)
+			fbsplashr_theme_loading_wait(theme);
+
+		fbsplashr_render_screen(theme, false, false, FBSPL_EFF_NONE);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &paint_last);
+
+	/* Keep painting until the icons which are to be shown are loaded. */
+	if (theme && frame_interval > 0 && fbsplashr_theme_loading(theme))
+		paint_pending = true;
+}
+
+/*
+ * Request an update of the screen.  Called with mtx_paint held.
+ *
+ * Requests are coalesced so that the screen is painted at most once
+ * per frame interval.  Whatever changes are made to the theme before
+ * the frame is painted end up in that frame.
+ */
+void paint_schedule(void)
+{
+	if (frame_interval <= 0) {
+		paint_now();
+		return;
+	}
+
+	if (!paint_pending) {
+		paint_pending = true;
+		pthread_cond_signal(&cnd_paint);
+	}
+}
+
+/*
+ * Paint a scheduled frame immediately.  Called with mtx_paint held.
+ */
+void paint_flush(void)
+{
+	if (paint_pending)
+		paint_now();
+}
+
+/*
+ * Stop the paint thread after painting the pending frame.
+ */
+void paint_stop(void)
+{
+	pthread_mutex_lock(&mtx_paint);
+	paint_flush();
+	paint_quit = true;
+	pthread_cond_signal(&cnd_paint);
+	pthread_mutex_unlock(&mtx_paint);
+
+	if (frame_interval > 0)
+		pthread_join(th_paint, NULL);
+}
+
+/*
+ * Paint the frames scheduled with paint_schedule(), no sooner than
+ * one frame interval after the previous one.
+ */
+void *thf_paint(void *unused)
+{
+	struct timespec ts, now;
+
+	pthread_mutex_lock(&mtx_paint);
+	while (!paint_quit) {
+		if (!paint_pending) {
+			pthread_cond_wait(&cnd_paint, &mtx_paint);
+			continue;
+		}
+
+		ts = paint_last;
+		ts.tv_sec  += frame_interval / 1000000;
+		ts.tv_nsec += (frame_interval % 1000000) * 1000;
+
+		/* Check for overflow of the nanoseconds field */
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (now.tv_sec < ts.tv_sec ||
+			(now.tv_sec == ts.tv_sec && now.tv_nsec < ts.tv_nsec)) {
+			pthread_cond_timedwait(&cnd_paint, &mtx_paint, &ts);
+			continue;
+		}
+
+		paint_now();
+	}
+	pthread_mutex_unlock(&mtx_paint);
+
+	return NULL;
+}
+
 /*
  * The following two functions are called with
  * mtx_tty held.
@@ -311,6 +425,10 @@ int process_switch_sig(int sig)
 	/* Switch from silent to verbose. */
 	if (sig == SIGUSR1) {
 		pthread_mutex_lock(&mtx_paint);
+
+		/* Leave the screen to the verbose tty right away. */
+		fbsplashr_effect_stop(false);
+
 		pthread_mutex_lock(&mtx_tty);
 		ioctl(fd_tty[config.tty_s], VT_RELDISP, 1);
 		pthread_mutex_unlock(&mtx_tty);
@@ -661,6 +779,7 @@ void daemon_start()
 	pthread_condattr_init(&cnd_attr);
 	pthread_condattr_setclock(&cnd_attr, CLOCK_MONOTONIC);
 	pthread_cond_init(&cnd_anim, &cnd_attr);
+	pthread_cond_init(&cnd_paint, &cnd_attr);
 
 	/* Make all our threads ignore these signals. SIGUSR1, SIGUSR2,
 	 * SIGTERM and SIGINT will be handled in the sighandler thread.
@@ -696,6 +815,12 @@ void daemon_start()
 	/* Start the animation thread */
 	pthread_create(&th_anim, NULL, &thf_anim, NULL);
 
+	/* Start the paint thread */
+	if (frame_interval > 0 && pthread_create(&th_paint, NULL, &thf_paint, NULL)) {
+		iprint(MSG_WARN, "Failed to start the paint thread, painting synchronously.\n");
+		frame_interval = 0;
+	}
+
 	pthread_mutex_lock(&mtx_tty);
 	switchmon_start(UPD_ALL, config.tty_s);
 	pthread_mutex_unlock(&mtx_tty);
@@ -716,6 +841,12 @@ static struct option options[] = {
 	{ "effects", required_argument, NULL, 0x106 },
 	{ "type", required_argument, NULL, 0x107 },
 	{ "textbox", no_argument, NULL, 0x108 },
+	{ "pageflip", no_argument, NULL, 0x109 },
+	{ "fps", required_argument, NULL, 0x10a },
+	{ "prefetch", required_argument, NULL, 0x10b },
+	{ "jpeg", required_argument, NULL, 0x10c },
+	{ "scale", required_argument, NULL, 0x10d },
+	{ "fadetime", required_argument, NULL, 0x10e },
 	{ "help",	no_argument, NULL, 'h'},
 	{ "verbose", no_argument, NULL, 'v'},
 	{ "quiet",  no_argument, NULL, 'q'},
@@ -740,8 +871,20 @@ static void usage()
 "      --minstances    allow multiple instances of the splash daemon\n"
 "	   --textbox       show the textbox by default\n"
 "      --effects=LIST  a comma-separated list of effects to use;\n"
-"                      supported effects: fadein, fadeout\n"
+"                      supported effects: fadein, fadeout, crossfade\n"
+"      --fadetime=MS   duration of the fade effects, in milliseconds\n"
 "      --type=TYPE     TYPE can be: bootup, reboot, shutdown, suspend, resume\n"
+"      --pageflip      use page flipping if the fb device supports it\n"
+"      --fps=NUM       paint at most NUM frames per second in response to\n"
+"                      the 'paint' command; 0 to paint on every command;\n"
+"                      defaults to the refresh rate of the video mode\n"
+"      --prefetch=POLICY  when to load icons of services and the verbose\n"
+"                      background: all (with the theme), idle (in the\n"
+"                      background), none (when needed)\n"
+"      --jpeg=PROFILE  decode JPEG images with the 'fast' or 'accurate'\n"
+"                      methods, overriding the theme's jpeg_fast setting\n"
+"      --scale=FILTER  scale themes without a config file for the current\n"
+"                      resolution with the 'bilinear' or 'lanczos' filter\n"
 );
 }
 
@@ -800,6 +943,8 @@ int fbsplashd_main(int argc, char **argv)
 					config.effects |= FBSPL_EFF_FADEIN;
 				else if (!strcmp(topt, "fadeout"))
 					config.effects |= FBSPL_EFF_FADEOUT;
+				else if (!strcmp(topt, "crossfade"))
+					config.effects |= FBSPL_EFF_CROSSFADE;
 			}
 			break;
 		}
@@ -821,6 +966,52 @@ int fbsplashd_main(int argc, char **argv)
 			config.textbox_visible = true;
 			break;
 
+		case 0x109:
+			config.pageflip = true;
+			break;
+
+		case 0x10a:
+		{
+			int fps = atoi(optarg);
+
+			frame_interval = (fps > 0) ? 1000000 / fps : 0;
+			break;
+		}
+
+		case 0x10b:
+			if (!strcmp(optarg, "idle"))
+				config.prefetch = FBSPL_PREFETCH_IDLE;
+			else if (!strcmp(optarg, "none"))
+				config.prefetch = FBSPL_PREFETCH_NONE;
+			else
+				config.prefetch = FBSPL_PREFETCH_ALL;
+			break;
+
+		case 0x10c:
+			if (!strcmp(optarg, "fast"))
+				config.jpeg = FBSPL_JPEG_FAST;
+			else if (!strcmp(optarg, "accurate"))
+				config.jpeg = FBSPL_JPEG_ACCURATE;
+			break;
+
+		case 0x10d:
+			if (!strcmp(optarg, "bilinear"))
+				config.scale = FBSPL_SCALE_BILINEAR;
+			else if (!strcmp(optarg, "lanczos"))
+				config.scale = FBSPL_SCALE_LANCZOS;
+			else
+				config.scale = FBSPL_SCALE_NONE;
+			break;
+
+		case 0x10e:
+		{
+			int ms = atoi(optarg);
+
+			if (ms >= 0)
+				config.fadetime = ms;
+			break;
+		}
+
 		/* Verbosity level adjustment. */
 		case 'q':
 			config.verbosity = FBSPL_VERB_QUIET;
@@ -835,6 +1026,13 @@ int fbsplashd_main(int argc, char **argv)
 	if (fbsplash_is_silent())
 		config.effects &= ~FBSPL_EFF_FADEIN;
 
+	/* The framebuffer was mapped before the options were parsed. */
+	if (config.pageflip)
+		fbsplashr_tty_silent_update();
+
+	if (frame_interval < 0)
+		frame_interval = fb_frame_interval();
+
 	theme = fbsplashr_theme_load();
 	if (!theme) {
 		iprint(MSG_ERROR, "Failed to load theme '%s'.\n", config.theme);
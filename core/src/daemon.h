@@ -56,10 +56,21 @@ extern int fd_gpm;
 /*
  * Threads
  */
-extern pthread_t th_switchmon, th_sighandler, th_anim;
+extern pthread_t th_switchmon, th_sighandler, th_anim, th_paint;
 extern pthread_mutex_t mtx_paint;
 extern pthread_mutex_t mtx_anim;
 extern pthread_cond_t  cnd_anim;
+extern pthread_cond_t  cnd_paint;
+
+/*
+ * Frame scheduling. Paint requests are coalesced and served at most
+ * once per frame_interval usecs by the paint thread.
+ */
+extern int frame_interval;
+extern bool paint_pending;
+void paint_schedule(void);
+void paint_flush(void);
+void paint_stop(void);
 
 
 /*
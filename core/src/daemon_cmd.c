@@ -32,19 +32,25 @@ int cmd_exit(void **args)
 	item *i, *j;
 
 	pthread_cancel(th_switchmon);
+
+	/* Make sure the last frame is displayed. */
+	paint_stop();
+
 	pthread_mutex_lock(&mtx_paint);
+	if (ctty == CTTY_SILENT && (config.effects & FBSPL_EFF_FADEOUT))
+		fbsplashr_render_screen(theme, true, true, FBSPL_EFF_FADEOUT);
+	pthread_mutex_unlock(&mtx_paint);
 
-	if (ctty == CTTY_SILENT) {
-		if (config.effects & FBSPL_EFF_FADEOUT)
-			fbsplashr_render_screen(theme, true, false, FBSPL_EFF_FADEOUT);
+	/* The fadeout is run in the background, so that switching to
+	 * the verbose mode in the meantime can cut it short. */
+	fbsplashr_effect_wait();
 
-		if (!args[0] || strcmp(args[0], "staysilent")) {
-			/* Switch to the verbose tty if we're in silent mode when the
-			 * 'exit' command is received. */
-			ioctl(fd_tty0, VT_ACTIVATE, config.tty_v);
-		}
+	pthread_mutex_lock(&mtx_paint);
+	if (ctty == CTTY_SILENT && (!args[0] || strcmp(args[0], "staysilent"))) {
+		/* Switch to the verbose tty if we're in silent mode when the
+		 * 'exit' command is received. */
+		ioctl(fd_tty0, VT_ACTIVATE, config.tty_v);
 	}
-
 	pthread_mutex_unlock(&mtx_paint);
 
 	pthread_kill(th_sighandler, SIGINT);
@@ -77,6 +83,10 @@ int cmd_set_theme(void **args)
 	fbsplash_acc_theme_set(args[0]);
 	pthread_mutex_lock(&mtx_paint);
 	reload_theme();
+
+	/* Blend the old theme into the new one. */
+	if (theme && ctty == CTTY_SILENT && (config.effects & FBSPL_EFF_CROSSFADE))
+		fbsplashr_render_screen(theme, true, true, FBSPL_EFF_CROSSFADE);
 	pthread_mutex_unlock(&mtx_paint);
 
 	return 0;
@@ -177,6 +187,8 @@ int cmd_set_effects(void **args)
 			config.effects |= FBSPL_EFF_FADEIN;
 		} else if (!strcmp(args[i], "fadeout")) {
 			config.effects |= FBSPL_EFF_FADEOUT;
+		} else if (!strcmp(args[i], "crossfade")) {
+			config.effects |= FBSPL_EFF_CROSSFADE;
 		}
 	}
 
@@ -259,7 +271,7 @@ int cmd_set_event_dev(void **args)
 /*
  * 'paint' command handler.
  *
- * Updates the picture displayed on the screen.
+ * Schedules an update of the picture displayed on the screen.
  */
 int cmd_paint(void **args)
 {
@@ -274,7 +286,7 @@ int cmd_paint(void **args)
 	if (ctty != CTTY_SILENT)
 		goto out;
 
-	fbsplashr_render_screen(theme, false, false, FBSPL_EFF_NONE);
+	paint_schedule();
 out:
 	pthread_mutex_unlock(&mtx_paint);
 	return ret;
@@ -298,9 +310,17 @@ int cmd_repaint(void **args)
 	if (ctty != CTTY_SILENT)
 		goto out;
 
+	/* The whole screen is painted, including any scheduled updates. */
+	paint_pending = false;
+
 	if (config.effects & FBSPL_EFF_FADEIN) {
 		config.effects &= ~FBSPL_EFF_FADEIN;
-		fbsplashr_render_screen(theme, true, false, FBSPL_EFF_FADEIN);
+
+		/* Paint requests received during the fadein are a part of
+		 * its remaining frames. */
+		fbsplashr_render_screen(theme, true, true, FBSPL_EFF_FADEIN);
+	} else if (config.effects & FBSPL_EFF_CROSSFADE) {
+		fbsplashr_render_screen(theme, true, true, FBSPL_EFF_CROSSFADE);
 	} else {
 		fbsplashr_render_screen(theme, true, false, FBSPL_EFF_NONE);
 	}
@@ -422,7 +442,8 @@ int cmd_paint_rect(void **args)
 	if (re.y2 >= theme->yres)
 		re.y2 = theme->yres-1;
 
-	paint_rect(theme, fb_mem, theme->bgbuf, re.x1, re.y1, re.x2, re.y2);
+	/* A background effect might be drawing the screen right now. */
+	present_rect(theme, &re);
 out:
 
 	pthread_mutex_unlock(&mtx_paint);
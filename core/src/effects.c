@@ -13,32 +13,110 @@
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
+#include <time.h>
+#include <sys/time.h>
 #include <sys/ioctl.h>
 #include "common.h"
 #include "render.h"
 
-#define FADEIN_STEPS	64
-#define FADEIN_STEPS_DC 256
+#if defined(__SSE2__)
+#define FADE_SSE2
+#include <emmintrin.h>
+#endif
+
+#ifndef TARGET_KERNEL
+#include <pthread.h>
+#endif
 
 /*
- * Copy the data from the background buffer to the framebuffer.
- * The bg buffer dimensions need not match those of the current
- * video mode.
+ * Effects are run either synchronously, or -- if the caller asks to be
+ * returned to right away -- by the effect executor, a thread which
+ * draws the frames of the effect while the caller carries on.
+ *
+ * The executor holds eff.mtx while it draws a frame, and the renderer
+ * holds it while a frame is rendered (see fbsplashr_render_screen()),
+ * so the two never use the background buffer and the framebuffer at
+ * the same time.  After every frame of the effect, the executor lets
+ * the renderers waiting for the lock go first.  While an effect is
+ * running, rendered frames are only stored in the background buffer,
+ * and the effect takes every one of its frames from there.  A running
+ * effect can be stopped, either by jumping to its last frame or by
+ * leaving the screen as it is.
+ *
+ * The kernel helper exits right after starting an effect, so there
+ * the effect is still run by a forked process.
  */
-void put_img(stheme_t *theme, u8 *dst, u8 *src)
+enum { EFF_RUN, EFF_FINISH, EFF_CANCEL };
+
+struct effect {
+	stheme_t *theme;
+	u8 *dst;
+	u8 *image;
+	struct fb_cmap cmap;	/* palette of the image in PSEUDOCOLOR modes */
+	int fd;
+	int duration;	/* in ms */
+	char type;		/* 0 (fadein), 1 (fadeout) or 2 (crossfade) */
+	bool async;		/* run by the executor? */
+	region *diff;	/* crossfade: the part of the screen being blended */
+};
+
+#ifndef TARGET_KERNEL
+static struct {
+	pthread_t th;
+	pid_t pid;				/* process in which the thread lives */
+	bool joinable;			/* the thread has been started, but not joined */
+	bool active;			/* an effect is being run */
+	int stop;				/* EFF_* */
+	int waiting;			/* threads waiting in effect_lock() */
+
+	pthread_mutex_t mtx;
+	pthread_cond_t cnd;
+	struct effect e;
+} eff = {
+	.mtx = PTHREAD_MUTEX_INITIALIZER,
+};
+#endif
+
+/*
+ * Copying to the framebuffer is done in horizontal bands, which can
+ * be processed in parallel.
+ */
+struct paint_job {
+	stheme_t *theme;
+	u8 *dst;
+	u8 *src;
+	region *r;
+};
+
+static void put_band(void *data, int y1, int y2)
 {
+	struct paint_job *job = data;
+	stheme_t *theme = job->theme;
 	int y, i;
-	u8 *to = dst;
+	u8 *to = job->dst;
 
-	to += theme->xmarg * fbd.bytespp + theme->ymarg * fbd.fix.line_length;
+	to += theme->xmarg * fbd.bytespp + (theme->ymarg + y1) * fbd.fix.line_length;
 	i = theme->xres * fbd.bytespp;
 
-	for (y = 0; y < theme->yres; y++) {
-		memcpy(to, src + i*y, i);
+	for (y = y1; y <= y2; y++) {
+		shadow_put(to, job->src + i*y, i);
 		to += fbd.fix.line_length;
 	}
 }
 
+/*
+ * Copy the data from the background buffer to the framebuffer.
+ * The bg buffer dimensions need not match those of the current
+ * video mode.
+ */
+void put_img(stheme_t *theme, u8 *dst, u8 *src)
+{
+	struct paint_job job = { theme, dst, src, NULL };
+
+	pool_run(put_band, &job, 0, theme->yres - 1, theme->xres * theme->yres);
+	shadow_validate(dst);
+}
+
 void paint_rect(stheme_t *theme, u8 *dst, u8 *src, int x1, int y1, int x2, int y2)
 {
 	u8 *to;
@@ -47,207 +125,1087 @@ void paint_rect(stheme_t *theme, u8 *dst, u8 *src, int x1, int y1, int x2, int y
 	j = (x2 - x1 + 1) * fbd.bytespp;
 	for (y = y1; y <= y2; y++) {
 		to = dst + (y + theme->ymarg) * fbd.fix.line_length + (x1 + theme->xmarg) * fbd.bytespp;
-		memcpy(to, src + (y * theme->xres + x1) * fbd.bytespp, j);
+		shadow_put(to, src + (y * theme->xres + x1) * fbd.bytespp, j);
+	}
+}
+
+static void paint_band(void *data, int y1, int y2)
+{
+	struct paint_job *job = data;
+	rect *re;
+	int i;
+
+	for (i = 0; i < job->r->num; i++) {
+		re = &job->r->rects[i];
+		if (re->y2 < y1 || re->y1 > y2)
+			continue;
+
+		paint_rect(job->theme, job->dst, job->src, re->x1, max(re->y1, y1),
+				   re->x2, min(re->y2, y2));
 	}
 }
 
+/*
+ * Copy the parts of the background buffer marked in a region
+ * to the framebuffer.
+ */
+static void paint_region(stheme_t *theme, u8 *dst, u8 *src, region *r)
+{
+	struct paint_job job = { theme, dst, src, r };
+	int i, pixels = 0;
+
+	if (region_empty(*r))
+		return;
+
+	for (i = 0; i < r->num; i++)
+		pixels += (r->rects[i].x2 - r->rects[i].x1 + 1) *
+				  (r->rects[i].y2 - r->rects[i].y1 + 1);
+
+	pool_run(paint_band, &job, r->rects[0].y1, r->rects[r->num - 1].y2, pixels);
+}
+
 void paint_img(stheme_t *theme, u8 *dst, u8 *src)
 {
-	item *i, *j;
+	paint_region(theme, dst, src, &theme->blit);
+	region_clear(theme->blit);
+}
 
-	for (i = theme->blit.head; i != NULL;) {
-		rect *re = i->p;
-		paint_rect(theme, dst, src, re->x1, re->y1, re->x2, re->y2);
+/*
+ * Mark the whole hidden page as out of date.
+ */
+static void stale_all(stheme_t *theme)
+{
+	rect re = { 0, theme->xres - 1, 0, theme->yres - 1 };
 
-		j = i->next;
-		free(i);
-		free(re);
-		i = j;
+	region_clear(theme->stale);
+	region_op_rect(&theme->stale, &re, REGION_UNION);
+}
+
+/*
+ * Display the whole background buffer.  With page flipping, the image
+ * is drawn into the hidden page, which is then displayed.
+ */
+void present_img(stheme_t *theme, u8 *src)
+{
+	u8 *dst = fb_hidden();
+
+	if (!fbd.flip) {
+		put_img(theme, fb_mem, src);
+		return;
+	}
+
+	/* Don't show whatever was left in the margins of the hidden page. */
+	if (theme->xmarg || theme->ymarg)
+		memset(dst, 0, fbd.var.yres * fbd.fix.line_length);
+
+	put_img(theme, dst, src);
+
+	if (fb_flip(fd_fb)) {
+		put_img(theme, fb_mem, src);
+		return;
 	}
 
-	list_init(theme->blit);
+	/* The margins are never touched by partial updates, so clear them
+	 * in the other page as well. */
+	if (theme->xmarg || theme->ymarg)
+		memset(fb_hidden(), 0, fbd.var.yres * fbd.fix.line_length);
+
+	stale_all(theme);
 }
 
 /*
- * @type = 0 (fadein) or 1 (fadeout)
+ * Display the parts of the background buffer marked in the blit region.
+ *
+ * With page flipping, the hidden page still shows the frame before the
+ * last one, so the areas updated in the last frame are copied along with
+ * the new ones before flipping the pages.
  */
-void fade_directcolor(stheme_t *theme, u8 *dst, u8 *image, int fd, char type)
+void present_rects(stheme_t *theme, u8 *src)
 {
-	int len, i, step;
-	struct fb_cmap cmap;
+	u8 *dst = fb_hidden();
 
-	len = min(min(fbd.var.red.length, fbd.var.green.length), fbd.var.blue.length);
+	if (!fbd.flip) {
+		paint_img(theme, fb_mem, src);
+		return;
+	}
 
-	cmap.start = 0;
-	cmap.len = (1 << len);
-	cmap.transp = NULL;
-	cmap.red = malloc(2 * 256 * 3);
-	if (!cmap.red)
+	if (region_empty(theme->blit))
 		return;
 
-	cmap.green = cmap.red + 256;
-	cmap.blue = cmap.green + 256;
+	if (region_op(&theme->stale, &theme->stale, &theme->blit, REGION_UNION)) {
+		paint_img(theme, fb_mem, src);
+		stale_all(theme);
+		return;
+	}
 
-	for (i = 0; i < cmap.len; i++) {
-		cmap.red[i] = cmap.green[i] = cmap.blue[i] = 0;
+	paint_region(theme, dst, src, &theme->stale);
+
+	if (fb_flip(fd_fb)) {
+		put_img(theme, fb_mem, src);
+		region_clear(theme->blit);
+		return;
 	}
 
-	ioctl(fd, FBIOPUTCMAP, &cmap);
-	put_img(theme, dst, image);
+	/* The new hidden page lacks exactly the areas updated just now. */
+	region_op(&theme->stale, &theme->blit, &theme->blit, REGION_UNION);
+	region_clear(theme->blit);
+}
 
-	for (step = 1; step < FADEIN_STEPS_DC+1; step++) {
-		for (i = 0; i < cmap.len; i++) {
-			if (type)
-				cmap.red[i] = cmap.green[i] = cmap.blue[i] = (0xffff * i * (FADEIN_STEPS_DC+1-step))/
-							((cmap.len-1)*FADEIN_STEPS_DC);
-			else
-				cmap.red[i] = cmap.green[i] = cmap.blue[i] = (0xffff * i * step)/((cmap.len-1)*FADEIN_STEPS_DC);
+/*
+ * Display a rect of the background buffer, or -- if an effect is
+ * running -- make it a part of the remaining frames of the effect.
+ */
+void present_rect(stheme_t *theme, rect *re)
+{
+	effect_lock();
+	blit_add(theme, re);
+
+	/* Effects of other themes are completed first, as in
+	 * fbsplashr_render_screen(). */
+	if (!effect_active(theme))
+		effect_stop(true);
+
+	if (effect_active(theme))
+		effect_update(theme);
+	else
+		present_rects(theme, theme->bgbuf);
+
+	effect_unlock();
+}
+
+/* Microseconds on a monotonic clock. */
+static u64 fade_clock(void)
+{
+#ifdef TARGET_KERNEL
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (u64)tv.tv_sec * 1000000 + tv.tv_usec;
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+/*
+ * Wait until the time 'until' (as returned by fade_clock()).  The
+ * executor releases eff.mtx while waiting, so that frames can be
+ * rendered in the meantime, and it wakes up early if the effect is
+ * stopped.
+ *
+ * @return EFF_RUN, or how the effect is to be stopped.
+ */
+static int effect_sleep(struct effect *e, u64 until)
+{
+	u64 now = fade_clock();
+
+#ifndef TARGET_KERNEL
+	if (e->async) {
+		struct timespec ts;
+
+		ts.tv_sec = until / 1000000;
+		ts.tv_nsec = (until % 1000000) * 1000;
+
+		while (eff.stop == EFF_RUN && now < until) {
+			pthread_cond_timedwait(&eff.cnd, &eff.mtx, &ts);
+			now = fade_clock();
 		}
-		ioctl(fd, FBIOPUTCMAP, &cmap);
-		usleep(7500);
+		return eff.stop;
 	}
+#endif
+	if (now < until)
+		usleep(until - now);
+
+	return EFF_RUN;
 }
 
 /*
- * @type = 0 (fadein) or 1 (fadeout)
+ * Check whether the effect has been stopped, without waiting.
  */
-void fade_truecolor(stheme_t *theme, u8 *dst, u8 *image, char type)
+static int effect_state(struct effect *e)
 {
-	int rlen, glen, blen;
-	int i, step, h, x, y;
-	u8 *t, *p, *pic;
-	int r, g, b, rt, gt, bt;
-	int rl8, gl8, bl8;
-	int clut[256][FADEIN_STEPS];
+#ifndef TARGET_KERNEL
+	if (e->async)
+		return eff.stop;
+#endif
+	return EFF_RUN;
+}
 
-	rlen = fbd.var.red.length;
-	glen = fbd.var.green.length;
-	blen = fbd.var.blue.length;
+/*
+ * Let the threads waiting for the executor lock, i.e. renderers, have
+ * it before the next frame of the effect is drawn.  Just unlocking the
+ * mutex is not enough, as the executor would usually get it right back.
+ *
+ * @return EFF_RUN, or how the effect is to be stopped.
+ */
+static int effect_yield(struct effect *e)
+{
+#ifndef TARGET_KERNEL
+	if (e->async) {
+		while (eff.stop == EFF_RUN && __sync_fetch_and_add(&eff.waiting, 0))
+			pthread_cond_wait(&eff.cnd, &eff.mtx);
+		return eff.stop;
+	}
+#endif
+	return EFF_RUN;
+}
+
+/*
+ * Wait for the vertical retrace.  The executor doesn't block the
+ * renderer in the meantime.
+ *
+ * @return 0 on success, -1 if the device can't wait for the retrace.
+ */
+static int effect_vsync(struct effect *e)
+{
+#ifdef FBIO_WAITFORVSYNC
+	u32 crtc = 0;
+	int err;
+
+#ifndef TARGET_KERNEL
+	if (e->async)
+		pthread_mutex_unlock(&eff.mtx);
+#endif
+	err = ioctl(e->fd, FBIO_WAITFORVSYNC, &crtc);
+#ifndef TARGET_KERNEL
+	if (e->async)
+		pthread_mutex_lock(&eff.mtx);
+#endif
+	return err ? -1 : 0;
+#else
+	return -1;
+#endif
+}
+
+/*
+ * Set 'dst' to the colors of 'src' scaled by k/256.
+ */
+static void fade_cmap(struct fb_cmap *dst, struct fb_cmap *src, int k)
+{
+	int i;
+
+	for (i = 0; i < src->len; i++) {
+		dst->red[i] = (src->red[i] * k) >> 8;
+		dst->green[i] = (src->green[i] * k) >> 8;
+		dst->blue[i] = (src->blue[i] * k) >> 8;
+	}
+}
+
+/*
+ * Palette fades leave the image on the screen alone and scale the
+ * palette instead: the palette of the image in PSEUDOCOLOR modes, and
+ * the linear ramp set by fb_cmap_directcolor_set() in DIRECTCOLOR modes.
+ * This costs next to nothing, so a new palette is loaded for every
+ * frame of the video mode: right after the vertical retrace if the
+ * device can wait for it, or once per frame interval otherwise.
+ */
+static void fade_palette(struct effect *e)
+{
+	struct fb_cmap cmap, ramp, *target = &e->cmap;
+	u64 start, now, next, len = (u64)e->duration * 1000;
+	int i, k, last = -1, state = EFF_RUN, interval = fb_frame_interval();
+	bool vsync = true;
+
+	memset(&ramp, 0, sizeof(ramp));
+
+	if (!e->cmap.red) {
+		ramp.len = 1 << min(min(fbd.var.red.length, fbd.var.green.length), fbd.var.blue.length);
+		ramp.red = malloc(ramp.len * sizeof(*ramp.red));
+		if (!ramp.red)
+			return;
+
+		for (i = 0; i < ramp.len; i++)
+			ramp.red[i] = (0xffff * i) / (ramp.len - 1);
+
+		ramp.green = ramp.blue = ramp.red;
+		target = &ramp;
+	}
+
+	cmap = *target;
+	cmap.transp = NULL;
+	cmap.red = malloc(cmap.len * 3 * sizeof(*cmap.red));
+	if (!cmap.red) {
+		free(ramp.red);
+		return;
+	}
+
+	cmap.green = cmap.red + cmap.len;
+	cmap.blue = cmap.green + cmap.len;
+
+	fade_cmap(&cmap, target, e->type ? 256 : 0);
+	ioctl(e->fd, FBIOPUTCMAP, &cmap);
+	put_img(e->theme, e->dst, e->image);
+
+	start = fade_clock();
+
+	for (;;) {
+		if (state == EFF_RUN)
+			state = effect_state(e);
+		if (state == EFF_CANCEL)
+			break;
+
+		now = fade_clock() - start;
+		k = (now >= len || state == EFF_FINISH) ? 256 : now * 256 / len;
+
+		if (k != last) {
+			fade_cmap(&cmap, target, e->type ? 256 - k : k);
+			ioctl(e->fd, FBIOPUTCMAP, &cmap);
+			last = k;
+		}
+
+		if (k == 256)
+			break;
+
+		if (!vsync || effect_vsync(e)) {
+			vsync = false;
+			next = (now / interval + 1) * interval;
+			state = effect_sleep(e, start + next);
+		}
+	}
+
+	free(cmap.red);
+	free(ramp.red);
+}
 
-	rl8 = 8 - rlen;
-	gl8 = 8 - glen;
-	bl8 = 8 - blen;
+/*
+ * Truecolor fades scale every color channel of the image by k/256, with
+ * k going from 0 to 256 (or back) over config.fadetime milliseconds.
+ * The image is scaled directly in the pixel format of the framebuffer.
+ * Every frame is drawn for the current time, so on a slow machine the
+ * fade simply consists of fewer frames.
+ */
+enum { FADE_BYTES, FADE_RGB16, FADE_GENERIC };
+
+struct fade_job {
+	stheme_t *theme;
+	u8 *dst;
+	u8 *src;
+	int k;			/* scale factor of the color channels, 0..256 */
+	int kind;		/* FADE_* */
+	u16 mul[8];		/* FADE_BYTES: factor for every byte of 8 bytes of a line */
+	bool color[8];	/* FADE_BYTES: does the byte hold a color channel? */
+	u32 mask[3];	/* masks of the red, green and blue channels */
+	u8 *old;		/* crossfade: the frame being faded out */
+	region *diff;	/* crossfade: the part of the screen being blended */
+};
+
+/*
+ * All channels are 8 bits wide and byte-aligned (24 and 32 bpp), so
+ * every byte can be scaled separately.  Bytes which don't hold a color
+ * channel are scaled by 256/256, i.e. left as they are.
+ */
+static void fade_line_bytes(struct fade_job *job, u8 *dst, u8 *src, int len)
+{
+	int i = 0;
+
+#ifdef FADE_SSE2
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i mul = _mm_loadu_si128((__m128i*)job->mul);
+	__m128i s, lo, hi;
+
+	for (; i + 16 <= len; i += 16) {
+		s = _mm_loadu_si128((__m128i*)(src + i));
+		lo = _mm_srli_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(s, zero), mul), 8);
+		hi = _mm_srli_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(s, zero), mul), 8);
+		_mm_storeu_si128((__m128i*)(dst + i), _mm_packus_epi16(lo, hi));
+	}
+#endif
+	for (; i < len; i++)
+		dst[i] = (src[i] * job->mul[i & 7]) >> 8;
+}
 
-	t = malloc(theme->xres * theme->yres * 3);
-	if (!t) {
-		put_img(theme, dst, image);
+/*
+ * 16bpp: (c << offset) * k / 256 is (c * k / 256) << offset plus some
+ * bits below the channel, which are masked out.
+ */
+static void fade_line_16(struct fade_job *job, u16 *dst, u16 *src, int len)
+{
+	u32 mr = job->mask[0], mg = job->mask[1], mb = job->mask[2];
+	u32 k = job->k, p;
+	int i = 0;
+
+	if (k >= 256) {
+		memcpy(dst, src, len * 2);
 		return;
 	}
 
-	pic = image;
+#ifdef FADE_SSE2
+	{
+		const __m128i vk = _mm_set1_epi16(k << 8);
+		const __m128i vr = _mm_set1_epi16(mr), vg = _mm_set1_epi16(mg), vb = _mm_set1_epi16(mb);
+		const __m128i vx = _mm_set1_epi16(~(mr | mg | mb));
+		__m128i s, r, g, b;
+
+		for (; i + 8 <= len; i += 8) {
+			s = _mm_loadu_si128((__m128i*)(src + i));
+			r = _mm_and_si128(_mm_mulhi_epu16(_mm_and_si128(s, vr), vk), vr);
+			g = _mm_and_si128(_mm_mulhi_epu16(_mm_and_si128(s, vg), vk), vg);
+			b = _mm_and_si128(_mm_mulhi_epu16(_mm_and_si128(s, vb), vk), vb);
+			s = _mm_or_si128(_mm_or_si128(r, g), _mm_or_si128(b, _mm_and_si128(s, vx)));
+			_mm_storeu_si128((__m128i*)(dst + i), s);
+		}
+	}
+#endif
+	for (; i < len; i++) {
+		p = src[i];
+		dst[i] = (((p & mr) * k >> 8) & mr) | (((p & mg) * k >> 8) & mg) |
+				 (((p & mb) * k >> 8) & mb) | (p & ~(mr | mg | mb));
+	}
+}
+
+/*
+ * Any other layout of the channels in 24 and 32 bpp modes.
+ */
+static void fade_line_generic(struct fade_job *job, u8 *dst, u8 *src, int len)
+{
+	u32 mr = job->mask[0], mg = job->mask[1], mb = job->mask[2];
+	u64 k = job->k;
+	u32 h;
+	int i;
+
+	for (i = 0; i < len; i++, src += fbd.bytespp, dst += fbd.bytespp) {
+		if (fbd.bytespp == 4)
+			h = *(u32*)src;
+		else if (endianess == little)
+			h = src[0] | (src[1] << 8) | (src[2] << 16);
+		else
+			h = (src[0] << 16) | (src[1] << 8) | src[2];
 
-	/* Decode the image into a table where each color component
-	 * takes exatly one byte */
-	for (i = 0; i < theme->xres * theme->yres; i++) {
+		h = (((h & mr) * k >> 8) & mr) | (((h & mg) * k >> 8) & mg) |
+			(((h & mb) * k >> 8) & mb) | (h & ~(mr | mg | mb));
 
-		if (fbd.bytespp == 2) {
-			h = *(u16*)pic;
-		} else if (fbd.bytespp == 3) {
-			h = *(u32*)pic & 0xffffff;
+		if (fbd.bytespp == 4) {
+			*(u32*)dst = h;
+		} else if (endianess == little) {
+			dst[0] = h;
+			dst[1] = h >> 8;
+			dst[2] = h >> 16;
 		} else {
-			h = *(u32*)pic;
+			dst[0] = h >> 16;
+			dst[1] = h >> 8;
+			dst[2] = h;
 		}
+	}
+}
+
+static void fade_band(void *data, int y1, int y2)
+{
+	struct fade_job *job = data;
+	stheme_t *theme = job->theme;
+	int y, len = theme->xres * fbd.bytespp;
+	u8 *to = job->dst + theme->xmarg * fbd.bytespp + (theme->ymarg + y1) * fbd.fix.line_length;
+	u8 *from = job->src + y1 * len;
 
-		pic += fbd.bytespp;
+	for (y = y1; y <= y2; y++, to += fbd.fix.line_length, from += len) {
+		if (job->kind == FADE_BYTES)
+			fade_line_bytes(job, to, from, len);
+		else if (job->kind == FADE_RGB16)
+			fade_line_16(job, (u16*)to, (u16*)from, theme->xres);
+		else
+			fade_line_generic(job, to, from, theme->xres);
+	}
+}
+
+static void fade_frame(struct fade_job *job, int k)
+{
+	int i;
+
+	job->k = k;
+	for (i = 0; i < 8; i++)
+		job->mul[i] = job->color[i] ? k : 256;
 
-		r = ((h >> fbd.var.red.offset & ((1 << rlen)-1)) << rl8);
-		g = ((h >> fbd.var.green.offset & ((1 << glen)-1)) << gl8);
-		b = ((h >> fbd.var.blue.offset & ((1 << blen)-1)) << bl8);
+	pool_run(fade_band, job, 0, job->theme->yres - 1, job->theme->xres * job->theme->yres);
+}
 
-		t[i*3] = r;
-		t[i*3+1] = g;
-		t[i*3+2] = b;
+/*
+ * Set up the scaling of the channels for the current pixel format.
+ */
+static void fade_init(struct fade_job *job)
+{
+	struct fb_bitfield *c[3] = { &fbd.var.red, &fbd.var.green, &fbd.var.blue };
+	bool bytes = (fbd.bytespp >= 3);
+	int i, j;
+
+	for (i = 0; i < 3; i++) {
+		job->mask[i] = ((1 << c[i]->length) - 1) << c[i]->offset;
+		if (c[i]->length != 8 || c[i]->offset % 8)
+			bytes = false;
+	}
+
+	if (fbd.bytespp == 2) {
+		job->kind = FADE_RGB16;
+	} else if (bytes) {
+		job->kind = FADE_BYTES;
+
+		/* In 24bpp modes, every byte holds a color channel. */
+		for (j = 0; j < 8; j++)
+			job->color[j] = (fbd.bytespp == 3);
+
+		if (fbd.bytespp == 4) {
+			for (i = 0; i < 3; i++) {
+				j = c[i]->offset / 8;
+				if (endianess == big)
+					j = 3 - j;
+				job->color[j] = job->color[j + 4] = true;
+			}
+		}
+	} else {
+		job->kind = FADE_GENERIC;
 	}
+}
+
+/*
+ * Draw the frames of a truecolor fade or a crossfade, with k going from
+ * 0 to 256 over the duration of the effect.  Every frame is drawn for
+ * the current time, so on a slow machine the effect simply consists of
+ * fewer frames.
+ *
+ * The last frame is always drawn, once the time is up.  With page
+ * flipping, one more copy of it is drawn if necessary, so that the
+ * final image ends up on the page that was displayed when the effect
+ * started.
+ */
+static void effect_frames(struct effect *e, struct fade_job *job,
+						  void (*frame)(struct fade_job *job, int k))
+{
+	u64 start, now, len = (u64)e->duration * 1000;
+	int k, last = -1, frames = 0, state = EFF_RUN;
+
+	start = fade_clock();
+
+	for (;;) {
+		if (state == EFF_RUN)
+			state = effect_state(e);
+		if (state == EFF_CANCEL)
+			break;
+
+		now = fade_clock() - start;
+		k = (now >= len || state == EFF_FINISH) ? 256 : now * 256 / len;
+
+		/* Nothing would change yet. */
+		if (k == last && k < 256) {
+			state = effect_sleep(e, start + (k + 1) * len / 256);
+			continue;
+		}
+
+		if (fbd.flip)
+			job->dst = fb_hidden();
 
-	/* Compute the color look-up table */
-	for (step = 0; step < FADEIN_STEPS; step++) {
-		for (i = 0; i < 256; i++) {
-			if (type)
-				clut[i][step] = (FADEIN_STEPS-1-step) * i / FADEIN_STEPS;
+		frame(job, (e->type == 1) ? 256 - k : k);
+		last = k;
+
+		if (fbd.flip) {
+			if (fb_flip(fd_fb))
+				job->dst = fb_mem;
 			else
-				clut[i][step] = (step+1) * i / FADEIN_STEPS;
+				frames++;
 		}
+
+		if (k == 256 && (!fbd.flip || !(frames & 1)))
+			break;
+
+		/* Frames rendered in the meantime make it into the next
+		 * frame of the effect. */
+		if (state == EFF_RUN)
+			state = effect_yield(e);
 	}
+}
 
-	if (type == 0)
-		memset(dst, 0, fbd.var.yres * fbd.fix.line_length);
+static void fade_truecolor(struct effect *e)
+{
+	struct fade_job job = { e->theme, e->dst, e->image };
 
-	for (step = 0; step < FADEIN_STEPS; step++) {
-
-		pic = dst + fbd.fix.line_length * theme->ymarg + theme->xmarg * fbd.bytespp;
-		p = t;
-
-		for (y = 0; y < theme->yres; y++) {
-
-			for (x = 0; x < theme->xres; x++) {
-
-				r = *p; p++;
-				g = *p; p++;
-				b = *p; p++;
-
-				rt = clut[r][step];
-				gt = clut[g][step];
-				bt = clut[b][step];
-
-				if (fbd.bytespp == 2) {
-					rt >>= rl8;
-					gt >>= gl8;
-					bt >>= bl8;
-				}
-
-				h = (rt << fbd.var.red.offset) |
-				    (gt << fbd.var.green.offset) |
-				    (bt << fbd.var.blue.offset);
-
-				if (fbd.bytespp == 2) {
-					*(u16*)pic = h;
-					pic += 2;
-				} else if (fbd.bytespp == 3) {
-					if (endianess == little) {
-						*(u16*)pic = h & 0xffff;
-						pic[2] = (h >> 16) & 0xff;
-					} else {
-						*(u16*)pic = (h >> 8) & 0xffff;
-						pic[2] = h & 0xff;
-					}
-					pic += 3;
-				} else if (fbd.bytespp == 4) {
-					*(u32*)pic = h;
-					pic += 4;
-				}
+	fade_init(&job);
+
+	if (e->type == 0) {
+		memset(e->dst, 0, fbd.var.yres * fbd.fix.line_length);
+		if (fbd.flip)
+			memset(fb_hidden(), 0, fbd.var.yres * fbd.fix.line_length);
+	}
+
+	effect_frames(e, &job, fade_frame);
+}
+
+/*
+ * Crossfades blend the frame on the screen into the new one: every
+ * color channel becomes (old * (256 - k) + new * k) / 256, again in the
+ * pixel format of the framebuffer.  The frames are compared in tiles
+ * first, and only the tiles which differ are blended.  Parts of the
+ * new frame rendered while the crossfade is running are added to the
+ * blended area (see effect_update()).
+ */
+#define XFADE_TILE_W	64
+#define XFADE_TILE_H	16
+
+static void xfade_line_bytes(struct fade_job *job, u8 *dst, u8 *old, u8 *src, int len)
+{
+	int i = 0;
+
+#ifdef FADE_SSE2
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i mul = _mm_loadu_si128((__m128i*)job->mul);
+	const __m128i mulo = _mm_sub_epi16(_mm_set1_epi16(256), mul);
+	__m128i s, o, lo, hi;
+
+	for (; i + 16 <= len; i += 16) {
+		s = _mm_loadu_si128((__m128i*)(src + i));
+		o = _mm_loadu_si128((__m128i*)(old + i));
+		lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(s, zero), mul),
+						   _mm_mullo_epi16(_mm_unpacklo_epi8(o, zero), mulo));
+		hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(s, zero), mul),
+						   _mm_mullo_epi16(_mm_unpackhi_epi8(o, zero), mulo));
+		lo = _mm_srli_epi16(lo, 8);
+		hi = _mm_srli_epi16(hi, 8);
+		_mm_storeu_si128((__m128i*)(dst + i), _mm_packus_epi16(lo, hi));
+	}
+#endif
+	for (; i < len; i++)
+		dst[i] = (src[i] * job->mul[i & 7] + old[i] * (256 - job->mul[i & 7])) >> 8;
+}
+
+/*
+ * Both terms are rounded down separately, so that the channels
+ * can be processed in 16 bits; the sum never exceeds the mask.
+ */
+static void xfade_line_16(struct fade_job *job, u16 *dst, u16 *old, u16 *src, int len)
+{
+	u32 mr = job->mask[0], mg = job->mask[1], mb = job->mask[2];
+	u32 k = job->k, ko = 256 - k, p, q;
+	int i = 0;
+
+	if (k >= 256) {
+		memcpy(dst, src, len * 2);
+		return;
+	}
+
+	if (k == 0) {
+		memcpy(dst, old, len * 2);
+		return;
+	}
+
+#ifdef FADE_SSE2
+	{
+		const __m128i vk = _mm_set1_epi16(k << 8), vko = _mm_set1_epi16(ko << 8);
+		const __m128i vm[3] = { _mm_set1_epi16(mr), _mm_set1_epi16(mg), _mm_set1_epi16(mb) };
+		__m128i s, o, d, c;
+		int j;
+
+		for (; i + 8 <= len; i += 8) {
+			s = _mm_loadu_si128((__m128i*)(src + i));
+			o = _mm_loadu_si128((__m128i*)(old + i));
+			d = _mm_andnot_si128(_mm_or_si128(_mm_or_si128(vm[0], vm[1]), vm[2]), s);
+
+			for (j = 0; j < 3; j++) {
+				c = _mm_add_epi16(_mm_mulhi_epu16(_mm_and_si128(s, vm[j]), vk),
+								  _mm_mulhi_epu16(_mm_and_si128(o, vm[j]), vko));
+				d = _mm_or_si128(d, _mm_and_si128(c, vm[j]));
 			}
+			_mm_storeu_si128((__m128i*)(dst + i), d);
+		}
+	}
+#endif
+	for (; i < len; i++) {
+		p = src[i];
+		q = old[i];
+		dst[i] = ((((p & mr) * k >> 8) + ((q & mr) * ko >> 8)) & mr) |
+				 ((((p & mg) * k >> 8) + ((q & mg) * ko >> 8)) & mg) |
+				 ((((p & mb) * k >> 8) + ((q & mb) * ko >> 8)) & mb) |
+				 (p & ~(mr | mg | mb));
+	}
+}
+
+static inline u32 xfade_get(u8 *p)
+{
+	if (fbd.bytespp == 4)
+		return *(u32*)p;
+	else if (endianess == little)
+		return p[0] | (p[1] << 8) | (p[2] << 16);
+	else
+		return (p[0] << 16) | (p[1] << 8) | p[2];
+}
+
+static void xfade_line_generic(struct fade_job *job, u8 *dst, u8 *old, u8 *src, int len)
+{
+	u32 mr = job->mask[0], mg = job->mask[1], mb = job->mask[2];
+	u64 k = job->k, ko = 256 - k, p, q;
+	u32 h;
+	int i;
 
-			pic += fbd.fix.line_length - theme->xres * fbd.bytespp;
+	for (i = 0; i < len; i++, src += fbd.bytespp, old += fbd.bytespp, dst += fbd.bytespp) {
+		p = xfade_get(src);
+		q = xfade_get(old);
+
+		h = ((((p & mr) * k >> 8) + ((q & mr) * ko >> 8)) & mr) |
+			((((p & mg) * k >> 8) + ((q & mg) * ko >> 8)) & mg) |
+			((((p & mb) * k >> 8) + ((q & mb) * ko >> 8)) & mb) |
+			(p & ~(mr | mg | mb));
+
+		if (fbd.bytespp == 4) {
+			*(u32*)dst = h;
+		} else if (endianess == little) {
+			dst[0] = h;
+			dst[1] = h >> 8;
+			dst[2] = h >> 16;
+		} else {
+			dst[0] = h >> 16;
+			dst[1] = h >> 8;
+			dst[2] = h;
 		}
 	}
+}
 
-	free(t);
+static void xfade_band(void *data, int y1, int y2)
+{
+	struct fade_job *job = data;
+	stheme_t *theme = job->theme;
+	region *r = job->diff;
+	int i, y, off, w;
+	u8 *to;
+	rect *re;
+
+	for (i = 0; i < r->num; i++) {
+		re = &r->rects[i];
+		if (re->y2 < y1 || re->y1 > y2)
+			continue;
+
+		w = re->x2 - re->x1 + 1;
+		for (y = max(re->y1, y1); y <= min(re->y2, y2); y++) {
+			off = (y * theme->xres + re->x1) * fbd.bytespp;
+			to = job->dst + (y + theme->ymarg) * fbd.fix.line_length +
+				 (re->x1 + theme->xmarg) * fbd.bytespp;
+
+			if (job->kind == FADE_BYTES)
+				xfade_line_bytes(job, to, job->old + off, job->src + off, w * fbd.bytespp);
+			else if (job->kind == FADE_RGB16)
+				xfade_line_16(job, (u16*)to, (u16*)(job->old + off), (u16*)(job->src + off), w);
+			else
+				xfade_line_generic(job, to, job->old + off, job->src + off, w);
+		}
+	}
 }
 
-void fade(stheme_t *theme, u8 *dst, u8 *image, struct fb_cmap cmap, u8 bgnd, int fd, char type)
+static void xfade_frame(struct fade_job *job, int k)
 {
-	if (bgnd) {
-		if (fork())
-			return;
+	region *r = job->diff;
+	int i, pixels = 0;
+
+	if (region_empty(*r))
+		return;
+
+	job->k = k;
+	for (i = 0; i < 8; i++)
+		job->mul[i] = job->color[i] ? k : 256;
+
+	for (i = 0; i < r->num; i++)
+		pixels += (r->rects[i].x2 - r->rects[i].x1 + 1) *
+				  (r->rects[i].y2 - r->rects[i].y1 + 1);
+
+	pool_run(xfade_band, job, r->rects[0].y1, r->rects[r->num - 1].y2, pixels);
+}
+
+/*
+ * Find the tiles in which two frames differ.
+ */
+static int xfade_diff(stheme_t *theme, u8 *a, u8 *b, region *r)
+{
+	int x, y, i, w, stride = theme->xres * fbd.bytespp;
+	rect re;
+
+	for (y = 0; y < theme->yres; y += XFADE_TILE_H) {
+		for (x = 0; x < theme->xres; x += XFADE_TILE_W) {
+			re.x1 = x;
+			re.x2 = min(x + XFADE_TILE_W, theme->xres) - 1;
+			re.y1 = y;
+			re.y2 = min(y + XFADE_TILE_H, theme->yres) - 1;
+			w = (re.x2 - re.x1 + 1) * fbd.bytespp;
+
+			for (i = re.y1; i <= re.y2; i++) {
+				if (memcmp(a + i * stride + x * fbd.bytespp, b + i * stride + x * fbd.bytespp, w))
+					break;
+			}
+
+			if (i <= re.y2 && region_op_rect(r, &re, REGION_UNION))
+				return -1;
+		}
 	}
 
-	/* FIXME: We need to handle 8bpp modes */
-	if (cmap.red) {
-		put_img(theme, dst, image);
+	return 0;
+}
+
+static void crossfade_run(struct effect *e)
+{
+	stheme_t *theme = e->theme;
+	struct fade_job job = { theme, e->dst, e->image };
+	int y, stride = theme->xres * fbd.bytespp;
+	region diff;
+
+	region_init(diff);
+	fade_init(&job);
+
+	/* The old frame is whatever is on the screen now. */
+	job.old = malloc(theme->yres * stride);
+	if (!job.old) {
+		put_img(theme, e->dst, e->image);
 		return;
 	}
 
-	if (fbd.fix.visual == FB_VISUAL_DIRECTCOLOR) {
-		fade_directcolor(theme, dst, image, fd, type);
-	} else {
-		fade_truecolor(theme, dst, image, type);
+	for (y = 0; y < theme->yres; y++)
+		memcpy(job.old + y * stride, e->dst + (y + theme->ymarg) * fbd.fix.line_length +
+			   theme->xmarg * fbd.bytespp, stride);
+
+	if (xfade_diff(theme, job.old, e->image, &diff)) {
+		put_img(theme, e->dst, e->image);
+		goto out;
 	}
 
+	job.diff = &diff;
+	e->diff = &diff;
+
+	/* The tiles which don't differ have to be on the hidden page, too. */
+	if (fbd.flip)
+		put_img(theme, fb_hidden(), job.old);
+
+	effect_frames(e, &job, xfade_frame);
+
+	e->diff = NULL;
+out:
+	/* Whatever put_img() left in the shadow is out of date now. */
+	shadow_invalidate();
+	region_free(&diff);
+	free(job.old);
+}
+
+static void effect_run(struct effect *e)
+{
+	if (e->type == 2)
+		crossfade_run(e);
+	else if (e->cmap.red || fbd.fix.visual == FB_VISUAL_DIRECTCOLOR)
+		fade_palette(e);
+	else
+		fade_truecolor(e);
+}
+
+#ifndef TARGET_KERNEL
+static void *effect_thread(void *unused)
+{
+	pthread_mutex_lock(&eff.mtx);
+	effect_run(&eff.e);
+	eff.active = false;
+	pthread_cond_broadcast(&eff.cnd);
+	pthread_mutex_unlock(&eff.mtx);
+
+	return NULL;
+}
+
+/*
+ * Start an effect in the executor thread.  Has to be called with
+ * eff.mtx held.
+ *
+ * @return 0 on success, -1 if the thread could not be started.
+ */
+static int effect_start(struct effect *e)
+{
+	pthread_condattr_t attr;
+
+	/* The thread is not inherited by child processes. */
+	if (eff.pid != getpid()) {
+		pthread_condattr_init(&attr);
+		pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+		pthread_cond_init(&eff.cnd, &attr);
+		pthread_condattr_destroy(&attr);
+
+		eff.pid = getpid();
+		eff.joinable = false;
+		eff.active = false;
+	}
+
+	if (eff.joinable) {
+		pthread_join(eff.th, NULL);
+		eff.joinable = false;
+	}
+
+	eff.e = *e;
+	eff.e.async = true;
+	eff.stop = EFF_RUN;
+	eff.active = true;
+
+	if (pthread_create(&eff.th, NULL, effect_thread, NULL)) {
+		iprint(MSG_WARN, "Failed to start the effect thread.\n");
+		eff.active = false;
+		return -1;
+	}
+
+	eff.joinable = true;
+	return 0;
+}
+
+/**
+ * Check whether an effect is being run by the executor.  Has to be
+ * called with the executor locked (effect_lock()).
+ *
+ * @param theme If not NULL, only effects displaying this theme count.
+ */
+bool effect_active(stheme_t *theme)
+{
+	return eff.pid == getpid() && eff.active && (!theme || eff.e.theme == theme);
+}
+
+/**
+ * Stop the effect being run by the executor, if any, and wait until
+ * it is done.  Has to be called with the executor locked.
+ *
+ * @param finish Display the last frame of the effect if true, leave
+ *               the screen as it is otherwise.
+ */
+void effect_stop(bool finish)
+{
+	if (!effect_active(NULL))
+		return;
+
+	eff.stop = finish ? EFF_FINISH : EFF_CANCEL;
+	pthread_cond_broadcast(&eff.cnd);
+
+	while (eff.active)
+		pthread_cond_wait(&eff.cnd, &eff.mtx);
+}
+
+/**
+ * Bring a frame rendered into the background buffer to the screen
+ * while an effect is running.  Has to be called with the executor
+ * locked.
+ */
+void effect_update(stheme_t *theme)
+{
+	/* DirectColor fades only change the palette, so the image on the
+	 * screen has to be updated right away.  Otherwise, the next frame
+	 * of the effect will contain the changes. */
+	if (eff.e.diff)
+		region_op(eff.e.diff, eff.e.diff, &theme->blit, REGION_UNION);
+
+	if (fbd.fix.visual == FB_VISUAL_DIRECTCOLOR && eff.e.type != 2)
+		paint_img(theme, eff.e.dst, theme->bgbuf);
+	else
+		region_clear(theme->blit);
+}
+
+void effect_lock(void)
+{
+	/* The executor gives way to the threads counted here after every
+	 * frame of an effect (see effect_yield()). */
+	__sync_fetch_and_add(&eff.waiting, 1);
+	pthread_mutex_lock(&eff.mtx);
+	__sync_fetch_and_sub(&eff.waiting, 1);
+}
+
+void effect_unlock(void)
+{
+	if (eff.active)
+		pthread_cond_broadcast(&eff.cnd);
+	pthread_mutex_unlock(&eff.mtx);
+}
+
+/**
+ * Stop the effect being run in the background, if any.
+ *
+ * @param finish Display the last frame of the effect right away if true,
+ *               leave the screen as it is otherwise.
+ */
+void fbsplashr_effect_stop(bool finish)
+{
+	effect_lock();
+	effect_stop(finish);
+	effect_unlock();
+}
+
+/**
+ * Wait until the effect being run in the background, if any, is done.
+ */
+void fbsplashr_effect_wait(void)
+{
+	effect_lock();
+	while (effect_active(NULL))
+		pthread_cond_wait(&eff.cnd, &eff.mtx);
+	effect_unlock();
+}
+
+/**
+ * Stop the executor thread.
+ */
+void effect_free(void)
+{
+	fbsplashr_effect_stop(false);
+
+	if (eff.joinable && eff.pid == getpid()) {
+		pthread_join(eff.th, NULL);
+		eff.joinable = false;
+	}
+}
+
+#else /* TARGET_KERNEL */
+
+bool effect_active(stheme_t *theme) { return false; }
+void effect_stop(bool finish) { }
+void effect_update(stheme_t *theme) { }
+void effect_lock(void) { }
+void effect_unlock(void) { }
+void effect_free(void) { }
+
+#endif /* TARGET_KERNEL */
+
+/*
+ * Run an effect, in the background if bgnd is set.  Has to be called
+ * with the executor locked.
+ */
+static void effect_launch(struct effect *e, u8 bgnd)
+{
+	effect_stop(true);
+
+	/* Intermediate frames of the effect are left in the hidden page. */
+	stale_all(e->theme);
+
+	/* The effect draws directly to the screen, bypassing the shadow. */
+	shadow_invalidate();
+
+#ifndef TARGET_KERNEL
+	if (bgnd && !effect_start(e))
+		return;
+#else
 	if (bgnd) {
-		exit(0);
+		if (fork())
+			return;
 	}
+#endif
+
+	effect_run(e);
 
-	return;
+#ifdef TARGET_KERNEL
+	if (bgnd)
+		exit(0);
+#endif
 }
 
+/*
+ * Display an image with a fade effect.  Has to be called with the
+ * executor locked.
+ *
+ * @type = 0 (fadein) or 1 (fadeout)
+ */
+void fade(stheme_t *theme, u8 *dst, u8 *image, struct fb_cmap cmap, u8 bgnd, int fd, char type)
+{
+	struct effect e = { theme, dst, image, cmap, fd, config.fadetime, type, false };
+
+	effect_launch(&e, bgnd);
+}
 
+/*
+ * Blend the frame on the screen into a new image.  Has to be called
+ * with the executor locked.
+ */
+void crossfade(stheme_t *theme, u8 *dst, u8 *image, u8 bgnd)
+{
+	struct effect e = { theme, dst, image, { 0 }, fd_fb, config.fadetime, 2, false };
+
+	effect_launch(&e, bgnd);
+}
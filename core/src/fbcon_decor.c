@@ -88,6 +88,10 @@ int fbcon_decor_setpic(unsigned char origin, int vc, stheme_t *theme)
 	if (!(theme->modes & FBSPL_MODE_VERBOSE))
 		return -1;
 
+	/* The background might not have been loaded with the theme. */
+	if (!theme->verbose_img.data && load_bg_images(theme, 'v'))
+		return -1;
+
 	invalidate_all(theme);
 	render_objs(theme, (u8*)theme->verbose_img.data, FBSPL_MODE_VERBOSE, true);
 
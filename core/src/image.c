@@ -1,5 +1,5 @@
 /*
- * image.c - Functions to load & unpack PNGs and JPEGs
+ * image.c - Functions to load & unpack PNGs, JPEGs and QOI images
  *
  * Copyright (C) 2004-2005, Michal Januszewski <spock@gentoo.org>
  *
@@ -11,6 +11,11 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 
 #include "config.h"
 
@@ -24,16 +29,33 @@
 
 #ifdef TARGET_KERNEL
   #include "jpeglib.h"
+  #include "jpegint.h"
+  #define JPEG_FB_DECODE
 #else
   #include <jpeglib.h>
+  #ifdef HAVE_JPEGINT_H
+    #include <jpegint.h>
+    #define JPEG_FB_DECODE
+  #endif
 #endif
 
 #include "common.h"
 #include "render.h"
+#include "qoi.h"
+
+/*
+ * Display lines y1..y2 of the silent background image while the rest
+ * of it is still being decoded (see theme->stream).
+ */
+static void bg_stream(stheme_t *theme, u8 *data, int y1, int y2)
+{
+	if (y1 <= y2)
+		paint_rect(theme, fb_mem, data, 0, y1, theme->xres - 1, y2);
+}
 
 #ifdef CONFIG_PNG
 #define PALETTE_COLORS 240
-static int load_png(stheme_t *theme, char *filename, u8 **data, struct fb_cmap *cmap, unsigned int *width, unsigned int *height, u8 want_alpha)
+static int load_png(stheme_t *theme, char *filename, u8 **data, struct fb_cmap *cmap, unsigned int *width, unsigned int *height, u8 want_alpha, bool stream)
 {
 	png_structp	png_ptr;
 	png_infop	info_ptr;
@@ -101,7 +123,12 @@ static int load_png(stheme_t *theme, char *filename, u8 **data, struct fb_cmap *
 		*height = png_get_image_height(png_ptr, info_ptr);
 	}
 
-	*data = malloc(theme->xres * theme->yres * fbd.bytespp);
+	/* Palette images use one byte per pixel and icons four, whatever
+	 * the depth of the video mode is. */
+	if (cmap)
+		bytespp = 1;
+
+	*data = malloc(*width * *height * bytespp);
 	if (!*data) {
 		iprint(MSG_CRITICAL, "Failed to allocate memory for image: %s.\n", filename);
 		return -4;
@@ -141,6 +168,8 @@ static int load_png(stheme_t *theme, char *filename, u8 **data, struct fb_cmap *
 		} else if (!want_alpha) {
 			u8 *tmp = *data + png_get_image_width(png_ptr, info_ptr) * bytespp * i;
 			rgba2fb((rgbacolor*)buf, tmp, tmp, png_get_image_width(png_ptr, info_ptr), i, 0, 0xff);
+			if (stream)
+				bg_stream(theme, *data, i, i);
 		}
 	}
 
@@ -175,66 +204,641 @@ static int is_png(char *filename)
 }
 #endif /* PNG */
 
-static int load_jpeg(char *filename, u8 **data, unsigned int *width, unsigned int *height)
+static int is_qoi(char *filename)
+{
+	char header[4];
+	FILE *fp = fopen(filename,"r");
+	int ret;
+
+	if (!fp)
+		return 0;
+
+	ret = (fread(header, 1, 4, fp) == 4 && !memcmp(header, QOI_MAGIC, 4));
+	fclose(fp);
+
+	return ret;
+}
+
+/*
+ * Load a QOI image.  The file is mapped into memory and decoded one
+ * line at a time, directly into the format of the framebuffer, or
+ * into RGBA if 'want_alpha' is set.
+ */
+static int load_qoi(stheme_t *theme, char *filename, u8 **data, unsigned int *width,
+					unsigned int *height, bool want_alpha, bool stream)
+{
+	struct qoi_dec dec;
+	struct stat st;
+	u8 *map, *buf = NULL;
+	int fd, i, err = -1, bytespp = want_alpha ? 4 : fbd.bytespp;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		iprint(MSG_ERROR, "Can't open file %s!\n", filename);
+		return -1;
+	}
+
+	if (fstat(fd, &st)) {
+		close(fd);
+		return -1;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (map == MAP_FAILED)
+		return -1;
+
+	if (qoi_dec_init(&dec, map, st.st_size)) {
+		iprint(MSG_ERROR, "Invalid QOI image: %s.\n", filename);
+		goto out;
+	}
+
+	if ((width && *width && dec.w != *width) || (height && *height && dec.h != *height)) {
+		iprint(MSG_ERROR, "Image size mismatch: %s.\n", filename);
+		err = -2;
+		goto out;
+	}
+
+	*width = dec.w;
+	*height = dec.h;
+
+	/* Allocated first, so that *data is only set on success. */
+	if (!want_alpha) {
+		buf = malloc(dec.w * sizeof(rgbcolor));
+		if (!buf) {
+			iprint(MSG_CRITICAL, "Failed to allocate memory for image line buffer.\n");
+			err = -4;
+			goto out;
+		}
+	}
+
+	*data = malloc(dec.w * dec.h * bytespp);
+	if (!*data) {
+		iprint(MSG_CRITICAL, "Failed to allocate memory for image: %s.\n", filename);
+		free(buf);
+		err = -4;
+		goto out;
+	}
+
+	for (i = 0; i < dec.h; i++) {
+		u8 *dst = *data + i * dec.w * bytespp;
+
+		if (want_alpha) {
+			qoi_dec_line(&dec, dst, 4);
+		} else {
+			qoi_dec_line(&dec, buf, 3);
+			rgba2fb((rgbacolor*)buf, dst, dst, dec.w, i, 0, 0xff);
+			if (stream)
+				bg_stream(theme, *data, i, i);
+		}
+	}
+
+	free(buf);
+	err = 0;
+out:
+	munmap(map, st.st_size);
+	return err;
+}
+
+#ifdef JPEG_FB_DECODE
+/*
+ * Decoding of JPEGs straight into the framebuffer pixel format.
+ *
+ * The color deconverter of libjpeg (see jdcolor.c) is replaced with one
+ * that turns YCbCr (or grayscale) rows into rows of pixels in the format
+ * of the framebuffer.  libjpeg then writes the decoded scanlines directly
+ * into the final image, without an intermediate RGB buffer.  The results
+ * are identical to those of converting libjpeg's RGB output with the
+ * pixel kernels, including the dithering in 15/16bpp modes.
+ */
+struct jpeg_fb;
+
+typedef void (*jpeg_row_fn)(struct jpeg_fb *jf, u8 *dst, JSAMPROW y,
+		JSAMPROW cb, JSAMPROW cr, int len, int add);
+
+struct jpeg_fb {
+	struct jpeg_decompress_struct cinfo;	/* has to be the first member */
+	u8 *data;				/* the decoded image */
+	int stride;
+	jpeg_row_fn row;
+	rgbcolor *buf;			/* for the generic pixel formats */
+
+	/* YCbCr->RGB conversion tables, as built by libjpeg. */
+	int cr_r[256];
+	int cb_b[256];
+	int cr_g[256];
+	int cb_g[256];
+};
+
+#define JPEG_SCALEBITS	16
+#define JPEG_FIX(x)		((int)((x) * (1L << JPEG_SCALEBITS) + 0.5))
+
+static void jpeg_fb_tables(struct jpeg_fb *jf)
+{
+	int i, x;
+
+	for (i = 0, x = -128; i < 256; i++, x++) {
+		jf->cr_r[i] = (JPEG_FIX(1.40200) * x + (1 << (JPEG_SCALEBITS - 1))) >> JPEG_SCALEBITS;
+		jf->cb_b[i] = (JPEG_FIX(1.77200) * x + (1 << (JPEG_SCALEBITS - 1))) >> JPEG_SCALEBITS;
+		jf->cr_g[i] = -JPEG_FIX(0.71414) * x;
+		jf->cb_g[i] = -JPEG_FIX(0.34414) * x + (1 << (JPEG_SCALEBITS - 1));
+	}
+}
+
+/*
+ * Compute the RGB value of the i-th pixel of a row.  'cb' is NULL for
+ * grayscale images.  'range' is libjpeg's sample range limiting table.
+ */
+static inline void jpeg_pixel(struct jpeg_fb *jf, JSAMPLE *range, JSAMPROW y,
+		JSAMPROW cb, JSAMPROW cr, int i, u8 *r, u8 *g, u8 *b)
+{
+	int l = GETJSAMPLE(y[i]);
+
+	if (!cb) {
+		*r = *g = *b = l;
+	} else {
+		int u = GETJSAMPLE(cb[i]), v = GETJSAMPLE(cr[i]);
+
+		*r = range[l + jf->cr_r[v]];
+		*g = range[l + ((jf->cb_g[u] + jf->cr_g[v]) >> JPEG_SCALEBITS)];
+		*b = range[l + jf->cb_b[u]];
+	}
+}
+
+/*
+ * Generic row loop.  PX is an expression which stores the pixel with
+ * color 'r', 'g', 'b' at 'dst'.  The loop is instantiated separately
+ * for color and grayscale images.
+ */
+#define JPEG_ROW(PX, BPP)												\
+	JSAMPLE *range = jf->cinfo.sample_range_limit;						\
+	int i;																\
+	u8 r, g, b;															\
+																		\
+	if (cb) {															\
+		for (i = 0; i < len; i++, dst += BPP, add ^= 3) {				\
+			jpeg_pixel(jf, range, y, cb, cr, i, &r, &g, &b);			\
+			PX;															\
+		}																\
+	} else {															\
+		for (i = 0; i < len; i++, dst += BPP, add ^= 3) {				\
+			jpeg_pixel(jf, range, y, NULL, NULL, i, &r, &g, &b);		\
+			PX;															\
+		}																\
+	}
+
+/*
+ * 24/32bpp modes with 8-bit color components.  In 32bpp modes with a
+ * known layout, the padding byte is cleared.
+ */
+#define PX888(ro, go, bo, pad)											\
+	dst[ro] = r;														\
+	dst[go] = g;														\
+	dst[bo] = b;														\
+	if (pad >= 0)														\
+		dst[pad] = 0;
+
+/*
+ * 15/16bpp modes, with the same dithering as in px16().
+ */
+#define PX16(roff, rlen, goff, glen, boff, blen)						\
+	*(u16*)dst = ((CLAMP(r + add*2 + 1) >> (8 - rlen)) << roff) |		\
+				 ((CLAMP(g + add) >> (8 - glen)) << goff) |				\
+				 ((CLAMP(b + add*2 + 1) >> (8 - blen)) << boff);
+
+#define DEFINE_JPEG_ROW(name, bpp, PX)									\
+static void jpeg_row_##name(struct jpeg_fb *jf, u8 *dst, JSAMPROW y,	\
+		JSAMPROW cb, JSAMPROW cr, int len, int add)						\
+{																		\
+	JPEG_ROW(PX, bpp)													\
+}
+
+DEFINE_JPEG_ROW(xrgb8888, 4, PX888(2, 1, 0, 3))
+DEFINE_JPEG_ROW(xbgr8888, 4, PX888(0, 1, 2, 3))
+DEFINE_JPEG_ROW(rgb888,   3, PX888(2, 1, 0, -1))
+DEFINE_JPEG_ROW(bgr888,   3, PX888(0, 1, 2, -1))
+DEFINE_JPEG_ROW(any888,   fbd.bytespp, PX888(fbd.ro, fbd.go, fbd.bo, -1))
+DEFINE_JPEG_ROW(rgb565,   2, PX16(11, 5, 5, 6, 0, 5))
+DEFINE_JPEG_ROW(rgb555,   2, PX16(10, 5, 5, 5, 0, 5))
+
+/*
+ * Anything else is converted to RGB first, and then passed to the pixel
+ * kernels of the current mode.
+ */
+static void jpeg_row_generic(struct jpeg_fb *jf, u8 *dst, JSAMPROW y,
+		JSAMPROW cb, JSAMPROW cr, int len, int add)
+{
+	JSAMPLE *range = jf->cinfo.sample_range_limit;
+	int i;
+
+	for (i = 0; i < len; i++)
+		jpeg_pixel(jf, range, y, cb, cr, i, &jf->buf[i].r, &jf->buf[i].g, &jf->buf[i].b);
+
+	fbd.pf->convert(dst, dst, jf->buf, len, add, 0xff);
+}
+
+/*
+ * The replacement for the color_convert method of libjpeg's color
+ * deconverter.  'output_buf' points to rows of the final image.
+ */
+static void jpeg_fb_convert(j_decompress_ptr cinfo, JSAMPIMAGE input_buf,
+		JDIMENSION input_row, JSAMPARRAY output_buf, int num_rows)
+{
+	struct jpeg_fb *jf = (struct jpeg_fb*)cinfo;
+	JSAMPROW cb = NULL, cr = NULL;
+	u8 *out;
+
+	for (; num_rows > 0; num_rows--, input_row++) {
+		out = *output_buf++;
+
+		if (cinfo->num_components == 3) {
+			cb = input_buf[1][input_row];
+			cr = input_buf[2][input_row];
+		}
+
+		jf->row(jf, out, input_buf[0][input_row], cb, cr, cinfo->output_width,
+				(((out - jf->data) / jf->stride) & 1) ? 1 : 3);
+	}
+}
+
+static jpeg_row_fn jpeg_fb_row(void)
+{
+	if (fbd.pf->fill == pixfmt_xrgb8888.fill)
+		return jpeg_row_xrgb8888;
+	else if (fbd.pf->fill == pixfmt_xbgr8888.fill)
+		return jpeg_row_xbgr8888;
+	else if (fbd.pf->fill == pixfmt_rgb888.fill)
+		return jpeg_row_rgb888;
+	else if (fbd.pf->fill == pixfmt_bgr888.fill)
+		return jpeg_row_bgr888;
+	else if (fbd.opt)
+		return jpeg_row_any888;
+	else if (fbd.pf->fill == pixfmt_rgb565.fill)
+		return jpeg_row_rgb565;
+	else if (fbd.pf->fill == pixfmt_rgb555.fill)
+		return jpeg_row_rgb555;
+	else
+		return jpeg_row_generic;
+}
+
+/*
+ * Check whether the color deconverter of libjpeg will be used for the
+ * image, and whether it is one that can be replaced.  The merged
+ * upsampler (used when fancy upsampling is disabled) does its own
+ * color conversion.
+ */
+static bool jpeg_fb_usable(j_decompress_ptr cinfo)
+{
+	if (cinfo->quantize_colors || !cinfo->do_fancy_upsampling)
+		return false;
+
+	return (cinfo->jpeg_color_space == JCS_YCbCr && cinfo->num_components == 3 &&
+			cinfo->out_color_space == JCS_RGB) ||
+		   (cinfo->jpeg_color_space == JCS_GRAYSCALE && cinfo->num_components == 1 &&
+			cinfo->out_color_space == JCS_GRAYSCALE);
+}
+#endif /* JPEG_FB_DECODE */
+
+#ifdef JCS_EXTENSIONS
+/*
+ * libjpeg-turbo can produce some of the 24/32bpp layouts (and RGBA) by
+ * itself, using its vectorized color conversion routines.  Returns the
+ * color space to use for the current video mode, or JCS_UNKNOWN.
+ */
+static J_COLOR_SPACE jpeg_fb_native(j_decompress_ptr cinfo, bool rgba)
+{
+	if (cinfo->quantize_colors || (cinfo->jpeg_color_space != JCS_YCbCr &&
+								   cinfo->jpeg_color_space != JCS_GRAYSCALE))
+		return JCS_UNKNOWN;
+
+	if (rgba)
+#ifdef JCS_ALPHA_EXTENSIONS
+		return JCS_EXT_RGBA;
+#else
+		return JCS_UNKNOWN;
+#endif
+	else if (fbd.pf->fill == pixfmt_xrgb8888.fill)
+		return JCS_EXT_BGRX;
+	else if (fbd.pf->fill == pixfmt_xbgr8888.fill)
+		return JCS_EXT_RGBX;
+	else if (fbd.pf->fill == pixfmt_rgb888.fill)
+		return JCS_EXT_BGR;
+	else if (fbd.pf->fill == pixfmt_bgr888.fill)
+		return JCS_EXT_RGB;
+	else
+		return JCS_UNKNOWN;
+}
+#endif /* JCS_EXTENSIONS */
+
+/*
+ * Run an output pass of the JPEG decompressor, storing the image in 'data'.
+ * 'rows' points to the lines of 'data' if they can be decoded directly,
+ * otherwise the lines are decoded into 'buf' and converted.
+ */
+static void jpeg_read_pass(stheme_t *theme, j_decompress_ptr cinfo, JSAMPROW *rows, u8 *buf,
+						   u8 *data, int bytespp, bool rgba, bool stream)
+{
+	int i, j, y;
+
+	if (rows) {
+		/* Let libjpeg decode as many scanlines at a time as it can. */
+		while (cinfo->output_scanline < cinfo->output_height) {
+			y = cinfo->output_scanline;
+			jpeg_read_scanlines(cinfo, rows + cinfo->output_scanline,
+								cinfo->output_height - cinfo->output_scanline);
+			if (stream)
+				bg_stream(theme, data, y, cinfo->output_scanline - 1);
+		}
+		return;
+	}
+
+	for (i = 0; i < cinfo->output_height; i++) {
+		u8 *tmp;
+		jpeg_read_scanlines(cinfo, (JSAMPARRAY) &buf, 1);
+
+		if (cinfo->output_components == 1) {
+			for (j = cinfo->output_width - 1; j >= 0; j--)
+				buf[j*3] = buf[j*3+1] = buf[j*3+2] = buf[j];
+		}
+
+		tmp = data + cinfo->output_width * bytespp * i;
+		if (rgba) {
+			for (j = 0; j < cinfo->output_width; j++) {
+				tmp[j*4] = buf[j*3];
+				tmp[j*4+1] = buf[j*3+1];
+				tmp[j*4+2] = buf[j*3+2];
+				tmp[j*4+3] = 0xff;
+			}
+		} else {
+			rgba2fb((rgbacolor*)buf, tmp, tmp, cinfo->output_width, i, 0, 0xff);
+			if (stream)
+				bg_stream(theme, data, i, i);
+		}
+	}
+}
+
+/*
+ * Load a JPEG image, in the framebuffer pixel format.  If 'width' and
+ * 'height' are specified, the image has to be of that size, or 2, 4 or 8
+ * times larger, in which case it is scaled down while being decoded.
+ * 'fast' selects the fast (less accurate) decoding profile.
+ *
+ * With 'rgba' set, the image is loaded as RGBA instead, and it can be of
+ * any size.  'width' and 'height' are then the size the image is going to
+ * be scaled to, and the image is only scaled down while being decoded as
+ * long as it doesn't get smaller than that.
+ *
+ * With 'stream' set, the image is displayed while it is being decoded.
+ * Progressive JPEGs are then decoded twice: first only from their first
+ * scan, which gives a quick low quality version, and then completely.
+ */
+static int load_jpeg(stheme_t *theme, char *filename, u8 **data, unsigned int *width,
+					 unsigned int *height, bool fast, bool rgba, bool stream)
 {
-	struct jpeg_decompress_struct cinfo;
+#ifdef JPEG_FB_DECODE
+	struct jpeg_fb jf;
+	struct jpeg_decompress_struct *cinfo = &jf.cinfo;
+	bool hook = false;
+#else
+	struct jpeg_decompress_struct _cinfo;
+	struct jpeg_decompress_struct *cinfo = &_cinfo;
+#endif
 	struct jpeg_error_mgr jerr;
 	FILE* injpeg;
 
+	JSAMPROW *rows = NULL;
 	u8 *buf = NULL;
-	int i;
-
-	cinfo.err = jpeg_std_error(&jerr);
-	jpeg_create_decompress(&cinfo);
+	int i, err = -1, bytespp = rgba ? 4 : fbd.bytespp;
 
 	if ((injpeg = fopen(filename,"r")) == NULL) {
 		iprint(MSG_ERROR, "Can't open file %s!\n", filename);
 		return -1;
 	}
 
-	jpeg_stdio_src(&cinfo, injpeg);
-	jpeg_read_header(&cinfo, TRUE);
-	jpeg_start_decompress(&cinfo);
+	cinfo->err = jpeg_std_error(&jerr);
+	jpeg_create_decompress(cinfo);
+
+	jpeg_stdio_src(cinfo, injpeg);
+	jpeg_read_header(cinfo, TRUE);
+
+	/* Larger images are scaled down in the DCT domain, i.e. only the
+	 * low-frequency coefficients are used in the IDCT. */
+	if (width && height && *width && *height) {
+		for (i = 8; i > 1; i >>= 1) {
+			cinfo->scale_denom = i;
+			jpeg_calc_output_dimensions(cinfo);
+			if (rgba ? (cinfo->output_width >= *width && cinfo->output_height >= *height) :
+					   (cinfo->output_width == *width && cinfo->output_height == *height))
+				break;
+		}
+
+		cinfo->scale_denom = i;
+	}
+
+	if (fast) {
+		cinfo->dct_method = JDCT_IFAST;
+		cinfo->do_fancy_upsampling = FALSE;
+	}
+
+	/* Decode straight into the final image if either libjpeg itself or
+	 * our color deconverter can produce the pixel format of the
+	 * framebuffer. */
+	jpeg_calc_output_dimensions(cinfo);
+	rows = malloc(cinfo->output_height * sizeof(JSAMPROW));
+	if (rows) {
+#ifdef JCS_EXTENSIONS
+		J_COLOR_SPACE cs = jpeg_fb_native(cinfo, rgba);
+
+		if (cs != JCS_UNKNOWN)
+			cinfo->out_color_space = cs;
+		else
+#endif
+#ifdef JPEG_FB_DECODE
+		if (!rgba && jpeg_fb_usable(cinfo))
+			hook = true;
+		else
+#endif
+		{
+			free(rows);
+			rows = NULL;
+		}
+	}
+
+	if (stream && jpeg_has_multiple_scans(cinfo))
+		cinfo->buffered_image = TRUE;
+
+	jpeg_start_decompress(cinfo);
 
-	if ((width && cinfo.output_width != *width) || (height && cinfo.output_height != *height)) {
+	if (!rgba && ((width && cinfo->output_width != *width) ||
+				  (height && cinfo->output_height != *height))) {
 		iprint(MSG_ERROR, "Image size mismatch: %s.\n", filename);
-		return -2;
+		err = -2;
+		goto out;
 	} else {
-		*width = cinfo.output_width;
-		*height = cinfo.output_height;
+		*width = cinfo->output_width;
+		*height = cinfo->output_height;
 	}
 
-	buf = malloc(cinfo.output_width * cinfo.output_components * sizeof(char));
+	/* Always room for RGB, so that grayscale rows can be expanded. */
+	buf = malloc(cinfo->output_width * 3);
 	if (!buf) {
 		iprint(MSG_ERROR, "Failed to allocate JPEG decompression buffer.\n");
-		return -1;
+		goto out;
 	}
 
-	*data = malloc(cinfo.output_width * cinfo.output_height * fbd.bytespp);
+	*data = malloc(cinfo->output_width * cinfo->output_height * bytespp);
 	if (!*data) {
 		iprint(MSG_ERROR, "Failed to allocate memory for image: %s.\n", filename);
-		return -4;
+		err = -4;
+		goto out;
 	}
 
-	for (i = 0; i < cinfo.output_height; i++) {
-		u8 *tmp;
-		jpeg_read_scanlines(&cinfo, (JSAMPARRAY) &buf, 1);
-		tmp = *data + cinfo.output_width * fbd.bytespp * i;
-		rgba2fb((rgbacolor*)buf, tmp, tmp, cinfo.output_width, i, 0, 0xff);
+	if (rows) {
+#ifdef JPEG_FB_DECODE
+		if (hook) {
+			jf.data = *data;
+			jf.stride = cinfo->output_width * fbd.bytespp;
+			jf.row = jpeg_fb_row();
+			jf.buf = (rgbcolor*)buf;
+			jpeg_fb_tables(&jf);
+			cinfo->cconvert->color_convert = jpeg_fb_convert;
+		}
+#endif
+		for (i = 0; i < cinfo->output_height; i++)
+			rows[i] = *data + i * cinfo->output_width * bytespp;
+	}
+
+	if (cinfo->buffered_image) {
+		/* Show what the first scan alone gives, then read the rest of
+		 * the file and decode the final image over it. */
+		jpeg_start_output(cinfo, 1);
+		jpeg_read_pass(theme, cinfo, rows, buf, *data, bytespp, rgba, stream);
+		jpeg_finish_output(cinfo);
+
+		while ((i = jpeg_consume_input(cinfo)) != JPEG_REACHED_EOI && i != JPEG_SUSPENDED)
+			;
+
+		jpeg_start_output(cinfo, cinfo->input_scan_number);
+		jpeg_read_pass(theme, cinfo, rows, buf, *data, bytespp, rgba, stream);
+		jpeg_finish_output(cinfo);
+	} else {
+		jpeg_read_pass(theme, cinfo, rows, buf, *data, bytespp, rgba, stream);
 	}
 
-	jpeg_finish_decompress(&cinfo);
-	jpeg_destroy_decompress(&cinfo);
+	jpeg_finish_decompress(cinfo);
+	err = 0;
+out:
+	free(rows);
+	free(buf);
+	jpeg_destroy_decompress(cinfo);
 	fclose(injpeg);
+	return err;
+}
+
+#ifndef TARGET_KERNEL
+/*
+ * Load a background image of a scaled theme.  The image is decoded as
+ * RGBA, scaled to the resolution of the theme, and converted to the
+ * format of the framebuffer in place.
+ */
+static int load_bg_scaled(stheme_t *theme, char *pic, u8 **data, bool fast)
+{
+	unsigned int w = theme->xres, h = theme->yres;
+	rgbcolor *buf;
+	u8 *img, *out;
+	int i, j, err;
+
+	if (is_qoi(pic)) {
+		w = h = 0;
+		err = load_qoi(theme, pic, &img, &w, &h, true, false);
+	} else
+#ifdef CONFIG_PNG
+	if (is_png(pic)) {
+		w = h = 0;
+		err = load_png(theme, pic, &img, NULL, &w, &h, 1, false);
+	} else
+#endif
+		err = load_jpeg(theme, pic, &img, &w, &h, fast, true, false);
+
+	if (err)
+		return err;
+
+	if (w != theme->xres || h != theme->yres) {
+		out = malloc(theme->xres * theme->yres * 4);
+		if (!out || scale_rgba(img, w, h, out, theme->xres, theme->yres, false)) {
+			iprint(MSG_ERROR, "Failed to scale image %s.\n", pic);
+			free(out);
+			free(img);
+			return -4;
+		}
+		free(img);
+		img = out;
+	}
+
+	buf = malloc(theme->xres * sizeof(rgbcolor));
+	if (!buf) {
+		iprint(MSG_CRITICAL, "Failed to allocate memory for image line buffer.\n");
+		free(img);
+		return -4;
+	}
+
+	/* A converted line never extends past the RGBA line it was
+	 * converted from, so the conversion can be done in place. */
+	for (i = 0; i < theme->yres; i++) {
+		rgbacolor *src = (rgbacolor*)(img + i * theme->xres * 4);
+		u8 *dst = img + i * theme->xres * fbd.bytespp;
+
+		for (j = 0; j < theme->xres; j++) {
+			buf[j].r = src[j].r;
+			buf[j].g = src[j].g;
+			buf[j].b = src[j].b;
+		}
+
+		rgba2fb((rgbacolor*)buf, dst, dst, theme->xres, i, 0, 0xff);
+	}
 
 	free(buf);
+	*data = img;
 	return 0;
 }
+#endif
+
+#ifndef TARGET_KERNEL
+/**
+ * Load an image in any of the supported formats as RGBA.
+ *
+ * @return 0 on success, a negative value otherwise.
+ */
+int image_load_rgba(char *filename, u8 **data, unsigned int *width, unsigned int *height)
+{
+	*width = *height = 0;
+
+	if (is_qoi(filename))
+		return load_qoi(NULL, filename, data, width, height, true, false);
+#ifdef CONFIG_PNG
+	if (is_png(filename))
+		return load_png(NULL, filename, data, NULL, width, height, 1, false);
+#endif
+	return load_jpeg(NULL, filename, data, width, height, false, true, false);
+}
+#endif
 
-static int load_bg_images(stheme_t *theme, char mode)
+/**
+ * Load the background image of a splash mode.
+ *
+ * @param theme The theme.
+ * @param mode 'v' for the verbose mode, 's' for the silent mode.
+ *
+ * @return 0 on success, a negative value otherwise.
+ */
+int load_bg_images(stheme_t *theme, char mode)
 {
 	struct fb_image *img = (mode == 'v') ? &theme->verbose_img : &theme->silent_img;
+	bool stream = (mode == 's') && theme->stream;
 	char *pic;
+	u8 *data;
+	bool fast;
 	int i;
 
 	img->width = theme->xres;
@@ -277,7 +881,7 @@ static int load_bg_images(stheme_t *theme, char mode)
 		img->cmap.blue = img->cmap.green + i;
 		img->cmap.len = i;
 
-		if (load_png(theme, pic, (u8**)&img->data, &img->cmap, &img->width, &img->height, 0)) {
+		if (load_png(theme, pic, (u8**)&img->data, &img->cmap, &img->width, &img->height, 0, false)) {
 			iprint(MSG_ERROR, "Failed to load PNG file %s.\n", pic);
 			return -1;
 		}
@@ -292,52 +896,495 @@ static int load_bg_images(stheme_t *theme, char mode)
 		if (!pic)
 			return -2;
 
+		img->data = (char*)bundle_get(theme, (mode == 'v') ? BUNDLE_VERBOSE : BUNDLE_SILENT,
+									  pic, &img->width, &img->height);
+		if (img->data)
+			return 0;
+
+		fast = (config.jpeg == FBSPL_JPEG_FAST) ||
+			   (config.jpeg == FBSPL_JPEG_THEME && theme->jpeg_fast);
+
+		img->data = (char*)cache_get(theme, BUNDLE_SILENT, pic, fast, &img->width, &img->height);
+		if (img->data)
+			return 0;
+
+#ifndef TARGET_KERNEL
+		if (theme_scaled(theme)) {
+			i = load_bg_scaled(theme, pic, (u8**)&img->data, fast);
+		} else
+#endif
+		if (is_qoi(pic)) {
+			i = load_qoi(theme, pic, (u8**)&img->data, &img->width, &img->height, false, stream);
+		} else
 #ifdef CONFIG_PNG
 		if (is_png(pic)) {
-			i = load_png(theme, pic, (u8**)&img->data, NULL, &img->width, &img->height, 0);
+			i = load_png(theme, pic, (u8**)&img->data, NULL, &img->width, &img->height, 0, stream);
 		} else
 #endif
 		{
-			i = load_jpeg(pic, (u8**)&img->data, &img->width, &img->height);
+			i = load_jpeg(theme, pic, (u8**)&img->data, &img->width, &img->height, fast, false, stream);
 		}
 
 		if (i) {
 			iprint(MSG_ERROR, "Failed to load image %s.\n", pic);
 			return -1;
 		}
+
+		/* Share the decoded image with other splash processes. */
+		data = cache_put(theme, BUNDLE_SILENT, pic, fast, (u8*)img->data, img->width, img->height);
+		if (data) {
+			free((u8*)img->data);
+			img->data = (char*)data;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Load an icon.  The icon is left empty if it cannot be loaded.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int load_icon(stheme_t *theme, icon_img *ii)
+{
+	u8 *data;
+	int err;
+
+	ii->w = ii->h = 0;
+
+	ii->picbuf = bundle_get(theme, BUNDLE_ICON, ii->filename, &ii->w, &ii->h);
+	if (ii->picbuf)
+		return 0;
+
+	ii->picbuf = cache_get(theme, BUNDLE_ICON, ii->filename, false, &ii->w, &ii->h);
+	if (ii->picbuf)
+		return 0;
+
+	if (is_qoi(ii->filename)) {
+		err = load_qoi(theme, ii->filename, &ii->picbuf, &ii->w, &ii->h, true, false);
+	} else
+#ifdef CONFIG_PNG
+	if (is_png(ii->filename)) {
+		err = load_png(theme, ii->filename, &ii->picbuf, NULL, &ii->w, &ii->h, 1, false);
+	} else
+#endif
+	{
+		iprint(MSG_ERROR, "Icon %s is neither a PNG nor a QOI file.\n", ii->filename);
+		return -1;
+	}
+
+	if (err) {
+		iprint(MSG_ERROR, "Failed to load icon %s.\n", ii->filename);
+		ii->picbuf = NULL;
+		ii->w = ii->h = 0;
+		return -1;
+	}
+
+#ifndef TARGET_KERNEL
+	/* Icons of scaled themes are scaled along with the rest of the theme.
+	 * Icons from the bundle have been scaled when it was created. */
+	if (theme_scaled(theme)) {
+		unsigned int w = scale_len(theme, ii->w, false);
+		unsigned int h = scale_len(theme, ii->h, true);
+		u8 *buf = malloc(w * h * 4);
+
+		if (buf && !scale_rgba(ii->picbuf, ii->w, ii->h, buf, w, h, true)) {
+			free(ii->picbuf);
+			ii->picbuf = buf;
+			ii->w = w;
+			ii->h = h;
+		} else {
+			iprint(MSG_WARN, "Failed to scale icon %s.\n", ii->filename);
+			free(buf);
+			return 0;
+		}
+	}
+#endif
+
+	/* Share the decoded icon with other splash processes. */
+	data = cache_put(theme, BUNDLE_ICON, ii->filename, false, ii->picbuf, ii->w, ii->h);
+	if (data) {
+		free(ii->picbuf);
+		ii->picbuf = data;
 	}
 
 	return 0;
 }
 
-int load_images(stheme_t *theme, char mode)
+/*
+ * Icons are packed into a single buffer (the icon atlas), one after
+ * another, with every icon starting on a cache line boundary.  Icons
+ * with identical contents are only stored once, even if they were loaded
+ * from different files.  Icons mapped from the theme bundle or from the
+ * image cache are left where they are, so that their pages stay shared.
+ */
+#define ATLAS_ALIGN(n)	(((n) + 63) & ~63)
+
+static u32 icon_hash(icon_img *ii)
+{
+	u32 h = 2166136261u;
+	int i, len = ii->w * ii->h * 4;
+
+	/* FNV-1a */
+	for (i = 0; i < len; i++)
+		h = (h ^ ii->picbuf[i]) * 16777619u;
+
+	return h ^ (ii->w * 31 + ii->h);
+}
+
+static bool icon_in_atlas(stheme_t *theme, u8 *p)
+{
+	return p >= theme->icon_atlas && p < theme->icon_atlas + theme->icon_atlas_len;
+}
+
+/**
+ * Free the pixel data of an icon, unless it is a part of the icon atlas
+ * or of the theme bundle.
+ */
+void icon_release(stheme_t *theme, icon_img *ii)
+{
+	if (ii->picbuf && !icon_in_atlas(theme, ii->picbuf))
+		bundle_release(theme, ii->picbuf);
+
+	ii->picbuf = NULL;
+	ii->w = ii->h = 0;
+}
+
+static int icons_pack(stheme_t *theme)
+{
+	icon_img **icons;
+	u32 *hash;
+	size_t len = 0;
+	int i, j, n = 0;
+	item *it;
+
+	for (it = theme->icons.head; it != NULL; it = it->next) {
+		icon_img *ii = it->p;
+		if (ii->picbuf && !bundle_owns(theme, ii->picbuf) && !cache_owns(theme, ii->picbuf))
+			n++;
+	}
+
+	if (!n)
+		return 0;
+
+	icons = malloc(n * (sizeof(*icons) + sizeof(*hash)));
+	if (!icons)
+		return -1;
+	hash = (u32*)(icons + n);
+
+	/* Find the unique icons and the size of the atlas. */
+	n = 0;
+	for (it = theme->icons.head; it != NULL; it = it->next) {
+		icon_img *ii = it->p;
+
+		if (!ii->picbuf || bundle_owns(theme, ii->picbuf) || cache_owns(theme, ii->picbuf))
+			continue;
+
+		hash[n] = icon_hash(ii);
+		for (j = 0; j < n; j++) {
+			if (hash[j] == hash[n] && icons[j]->w == ii->w && icons[j]->h == ii->h &&
+				!memcmp(icons[j]->picbuf, ii->picbuf, ii->w * ii->h * 4))
+				break;
+		}
+
+		if (j == n)
+			len += ATLAS_ALIGN(ii->w * ii->h * 4);
+
+		icons[n++] = ii;
+	}
+
+	if (posix_memalign((void**)&theme->icon_atlas, 64, len)) {
+		theme->icon_atlas = NULL;
+		free(icons);
+		return -1;
+	}
+	theme->icon_atlas_len = len;
+
+	/* Move the icons into the atlas.  Duplicates share the copy of the
+	 * first icon with the same contents. */
+	len = 0;
+	for (i = 0; i < n; i++) {
+		icon_img *ii = icons[i];
+		u8 *p = NULL;
+
+		for (j = 0; j < i; j++) {
+			if (hash[j] == hash[i] && icons[j]->w == ii->w && icons[j]->h == ii->h &&
+				!memcmp(icons[j]->picbuf, ii->picbuf, ii->w * ii->h * 4)) {
+				p = icons[j]->picbuf;
+				break;
+			}
+		}
+
+		if (!p) {
+			p = theme->icon_atlas + len;
+			memcpy(p, ii->picbuf, ii->w * ii->h * 4);
+			len += ATLAS_ALIGN(ii->w * ii->h * 4);
+		}
+
+		bundle_release(theme, ii->picbuf);
+		ii->picbuf = p;
+	}
+
+	free(icons);
+	return 0;
+}
+
+/*
+ * The images, animations and fonts of a theme don't depend on each other,
+ * so every one of them is loaded by a separate task, and the tasks are
+ * run in parallel.
+ */
+enum asset_type { ASSET_BG, ASSET_ICON, ASSET_ANIM, ASSET_FONT };
+
+struct asset {
+	enum asset_type type;
+	void *p;		/* icon_img, anim or font_e */
+	char mode;		/* 'v' or 's' for background images */
+	int err;
+};
+
+struct asset_job {
+	stheme_t *theme;
+	struct asset *assets;
+};
+
+static void load_asset(void *data, int k, int unused)
+{
+	struct asset_job *job = data;
+	struct asset *a = &job->assets[k];
+
+	switch (a->type) {
+	case ASSET_BG:
+		a->err = load_bg_images(job->theme, a->mode);
+		break;
+	case ASSET_ICON:
+		a->err = load_icon(job->theme, a->p);
+		break;
+#if WANT_MNG
+	case ASSET_ANIM:
+		a->err = load_anim(a->p);
+		break;
+#endif
+#if WANT_TTF
+	case ASSET_FONT:
+		a->err = load_font(a->p);
+		break;
+#endif
+	default:
+		break;
+	}
+}
+
+/*
+ * Check whether an icon can be loaded later, when it is first needed.
+ * This is the case for icons only shown for specific states of services.
+ */
+static bool icon_is_lazy(stheme_t *theme, icon_img *ii)
 {
 	item *i;
 
-	if (load_bg_images(theme, mode))
+	if (config.prefetch == FBSPL_PREFETCH_ALL)
+		return false;
+
+	for (i = theme->objs.head; i != NULL; i = i->next) {
+		obj *o = i->p;
+
+		if (o->type == o_icon && ((icon*)o->p)->img == ii && !((icon*)o->p)->svc)
+			return false;
+	}
+
+	return true;
+}
+
+/**
+ * Load the background images, icons, animations and fonts of a theme.
+ *
+ * Unless config.prefetch is FBSPL_PREFETCH_ALL, the background image of
+ * the verbose mode is not loaded (see load_bg_images()), and neither are
+ * icons which depend on the state of services (see loader.c).
+ *
+ * @param theme The theme.
+ * @param verbose Load the background image of the verbose mode?
+ * @param silent Load the background image and the icons of the silent mode?
+ *
+ * @return 0 on success, -1 if memory allocation failed.  Failures to load
+ *         individual assets are reported, but not considered to be errors.
+ */
+int load_assets(stheme_t *theme, bool verbose, bool silent)
+{
+	struct asset_job job;
+	struct asset *a;
+	icon_img **lazy;
+	item *i;
+	int n = 2, k = 0, bg_s = -1;
+
+	for (i = theme->icons.head; i != NULL; i = i->next)
+		n++;
+	for (i = theme->anims.head; i != NULL; i = i->next)
+		n++;
+	for (i = theme->fonts.head; i != NULL; i = i->next)
+		n++;
+
+	a = calloc(n, sizeof(*a));
+	if (!a) {
+		iprint(MSG_ERROR, "Failed to allocate memory for loading the theme.\n");
 		return -1;
+	}
 
-	if (mode == 's') {
-#ifdef CONFIG_PNG
-		for (i = theme->icons.head; i != NULL; i = i->next) {
-			icon_img *ii = (icon_img*) i->p;
-			ii->w = ii->h = 0;
+	/* The background images take the longest to load, so they go first. */
+	if (verbose && config.prefetch == FBSPL_PREFETCH_ALL) {
+		a[k].type = ASSET_BG;
+		a[k++].mode = 'v';
+	}
+
+	if (silent) {
+		bg_s = k;
+		a[k].type = ASSET_BG;
+		a[k++].mode = 's';
 
-			if (!is_png(ii->filename)) {
-				iprint(MSG_ERROR, "Icon %s is not a PNG file.\n", ii->filename);
+		for (i = theme->icons.head; i != NULL; i = i->next) {
+			if (icon_is_lazy(theme, i->p))
 				continue;
-			}
+			a[k].type = ASSET_ICON;
+			a[k++].p = i->p;
+		}
+	}
+
+#if WANT_MNG
+	for (i = theme->anims.head; i != NULL; i = i->next) {
+		a[k].type = ASSET_ANIM;
+		a[k++].p = i->p;
+	}
+#endif
+
+#if WANT_TTF
+	for (i = theme->fonts.head; i != NULL; i = i->next) {
+		if (((font_e*)i->p)->font)
+			continue;
+		a[k].type = ASSET_FONT;
+		a[k++].p = i->p;
+	}
+#endif
 
-			if (load_png(theme, ii->filename, &ii->picbuf, NULL, &ii->w, &ii->h, 1)) {
-				iprint(MSG_ERROR, "Failed to load icon %s.\n", ii->filename);
-				ii->picbuf = NULL;
-				ii->w = ii->h = 0;
+	job.theme = theme;
+	job.assets = a;
+	pool_tasks(load_asset, &job, k);
+
+	/* Icons are not used without the silent background. */
+	if (bg_s >= 0 && a[bg_s].err) {
+		for (i = theme->icons.head; i != NULL; i = i->next)
+			icon_release(theme, i->p);
+	} else if (bg_s >= 0) {
+		if (icons_pack(theme))
+			iprint(MSG_WARN, "Failed to allocate memory for the icon atlas.\n");
+
+		/* Load the remaining icons in the background, or right away
+		 * if that's not possible. */
+		lazy = malloc(n * sizeof(*lazy));
+		for (i = theme->icons.head, k = 0; i != NULL; i = i->next) {
+			if (!icon_is_lazy(theme, i->p))
 				continue;
+			if (lazy)
+				lazy[k] = i->p;
+			k++;
+		}
+
+		if (k && (!lazy || loader_init(theme, lazy, k))) {
+			for (i = theme->icons.head; i != NULL; i = i->next) {
+				if (icon_is_lazy(theme, i->p))
+					load_icon(theme, i->p);
 			}
 		}
-#endif
+		free(lazy);
 	}
 
+	free(a);
 	return 0;
 }
 
+/**
+ * Get the amount of memory used by a loaded theme, per class of data.
+ */
+void theme_mem_usage(stheme_t *theme, theme_mem *m)
+{
+	size_t bg = theme->xres * theme->yres * fbd.bytespp;
+	item *i;
+	int k;
+
+	memset(m, 0, sizeof(*m));
+
+	if (theme->verbose_img.data) {
+		m->bg += bg;
+		if (bundle_owns(theme, (u8*)theme->verbose_img.data) ||
+			cache_owns(theme, (u8*)theme->verbose_img.data))
+			m->mapped += bg;
+	}
+
+	if (theme->silent_img.data) {
+		m->bg += bg;
+		if (bundle_owns(theme, (u8*)theme->silent_img.data) ||
+			cache_owns(theme, (u8*)theme->silent_img.data))
+			m->mapped += bg;
+	}
+
+	m->icons = theme->icon_atlas_len;
+	for (i = theme->icons.head; i != NULL; i = i->next) {
+		icon_img *ii = i->p;
+		item *j;
+
+		if (!ii->picbuf)
+			continue;
+
+		m->icons_num++;
+
+		/* Icons with identical contents share their pixel data. */
+		for (j = theme->icons.head; j != i; j = j->next) {
+			if (((icon_img*)j->p)->picbuf == ii->picbuf)
+				break;
+		}
+
+		if (j != i)
+			continue;
+
+		m->icons_stored++;
+		if (icon_in_atlas(theme, ii->picbuf))
+			continue;
+
+		/* Mapped from the bundle or the image cache, or stored
+		 * separately because the atlas couldn't be allocated. */
+		m->icons += ii->w * ii->h * 4;
+		if (bundle_owns(theme, ii->picbuf) || cache_owns(theme, ii->picbuf))
+			m->mapped += ii->w * ii->h * 4;
+	}
+
+#if WANT_MNG
+	for (i = theme->anims.head; i != NULL; i = i->next) {
+		anim *a = i->p;
+		mng_anim *mng;
+
+		if (!a->mng)
+			continue;
+
+		mng = mng_get_userdata(a->mng);
+		m->anims += mng->len;
+		if (mng->canvas)
+			m->anims += mng->canvas_w * mng->canvas_h * mng->canvas_bytes_pp;
+	}
+#endif
+
+#if WANT_TTF
+	m->fonts = fonts_mem_usage(theme);
+	m->glyph_hits = theme->glyphs.hits;
+	m->glyph_misses = theme->glyphs.misses;
+#endif
+
+	if (theme->bgbuf)
+		m->render += bg;
+
+	m->render += theme->grid.cols * theme->grid.rows * sizeof(objcell);
+	for (k = 0; k < theme->grid.cols * theme->grid.rows; k++)
+		m->render += theme->grid.cells[k].size * sizeof(obj*);
+	m->render += theme->grid.res_size * sizeof(obj*);
+	m->render += theme->scratch.size;
+}
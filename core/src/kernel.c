@@ -43,10 +43,33 @@ void prep_io()
 	}
 }
 
-int handle_init(bool update)
+/*
+ * Switch to the silent tty.
+ */
+static void silent_activate(void)
 {
 	char buf[8];
+
+	fd_tty0 = open("/dev/console", O_RDWR);
+
+	fbsplash_set_silent();
+	fbsplashr_tty_silent_init(true);
+	fbsplashr_tty_silent_update();
+
+	/* Redirect all kernel messages to tty1 so that they don't get
+	 * printed over our silent splash image. */
+	buf[0] = TIOCL_SETKMSGREDIRECT;
+	buf[1] = 1;
+	ioctl(fd_tty[config.tty_s], TIOCLINUX, buf);
+
+	if (config.kdmode == KD_GRAPHICS)
+		ioctl(fd_tty[config.tty_s], KDSETMODE, KD_GRAPHICS);
+}
+
+int handle_init(bool update)
+{
 	int h;
+	bool silent = false;
 	stheme_t *theme;
 #ifdef CONFIG_FBCON_DECOR
 	bool fbcon_decor = true;
@@ -78,9 +101,21 @@ int handle_init(bool update)
 #endif
 	}
 
+	/* With the progressive first paint, the silent splash is displayed
+	 * right away, and the theme is drawn on it while it is being loaded.
+	 * Fading in from black would hide that. */
+	if (config.progressive && !update && config.reqmode != FBSPL_MODE_VERBOSE) {
+		config.effects &= ~FBSPL_EFF_FADEIN;
+		silent_activate();
+		silent = true;
+	}
+
 	theme = fbsplashr_theme_load();
-	if (!theme)
+	if (!theme) {
+		if (silent)
+			fbsplash_set_verbose(0);
 		return -1;
+	}
 
 #ifdef CONFIG_FBCON_DECOR
 	fd_fbcondecor = fbcon_decor_open(true);
@@ -122,23 +157,14 @@ noverbose:
 #endif
 	}
 
-	if (!(theme->modes & FBSPL_MODE_SILENT))
+	if (!(theme->modes & FBSPL_MODE_SILENT)) {
+		if (silent)
+			fbsplash_set_verbose(0);
 		return -1;
+	}
 
-	fd_tty0 = open("/dev/console", O_RDWR);
-
-	fbsplash_set_silent();
-	fbsplashr_tty_silent_init(true);
-	fbsplashr_tty_silent_update();
-
-	/* Redirect all kernel messages to tty1 so that they don't get
-	 * printed over our silent splash image. */
-	buf[0] = TIOCL_SETKMSGREDIRECT;
-	buf[1] = 1;
-	ioctl(fd_tty[config.tty_s], TIOCLINUX, buf);
-
-	if (config.kdmode == KD_GRAPHICS)
-		ioctl(fd_tty[config.tty_s], KDSETMODE, KD_GRAPHICS);
+	if (!silent)
+		silent_activate();
 
 	fbsplashr_render_screen(theme, true, true, config.effects);
 
@@ -37,6 +37,10 @@ static FILE *fp_fifo = NULL;
 int fd_tty0 = -1;
 fbspl_cfg_t config;
 
+#ifdef CONFIG_DEBUG
+unsigned int fbspl_allocs = 0;
+#endif
+
 /**
  * Initialize the config structure with default values.
  *
@@ -57,6 +61,13 @@ static int init_config(fbspl_type_t type)
 	config.minstances = false;
 	config.progress = 0;
 	config.autoverbose = 0;
+	config.pageflip = false;
+	config.progressive = false;
+	config.threads = 1;
+	config.prefetch = FBSPL_PREFETCH_ALL;
+	config.jpeg = FBSPL_JPEG_THEME;
+	config.scale = FBSPL_SCALE_NONE;
+	config.fadetime = 500;
 	config.effects = FBSPL_EFF_NONE;
 	config.verbosity = FBSPL_VERB_NORMAL;
 	config.type = type;
@@ -237,6 +248,12 @@ int fbsplash_parse_kcmdline(bool sysmsg)
 				config.effects |= FBSPL_EFF_FADEIN;
 			} else if (!strcmp(opt, "fadeout")) {
 				config.effects |= FBSPL_EFF_FADEOUT;
+			} else if (!strcmp(opt, "crossfade")) {
+				config.effects |= FBSPL_EFF_CROSSFADE;
+			} else if (!strncmp(opt, "fadetime:", 9)) {
+				int n = strtol(opt+9, NULL, 0);
+				if (n >= 0)
+					config.fadetime = n;
 			} else if (!strcmp(opt, "verbose")) {
 				config.reqmode = FBSPL_MODE_VERBOSE;
 			} else if (!strcmp(opt, "silent")) {
@@ -253,6 +270,30 @@ int fbsplash_parse_kcmdline(bool sysmsg)
 				config.kdmode = KD_GRAPHICS;
 			} else if (!strcmp(opt, "profile")) {
 				config.profile = true;
+			} else if (!strcmp(opt, "pageflip")) {
+				config.pageflip = true;
+			} else if (!strcmp(opt, "progressive")) {
+				config.progressive = true;
+			} else if (!strncmp(opt, "threads:", 8)) {
+				int n = strtol(opt+8, NULL, 0);
+				if (n >= 0)
+					config.threads = n;
+			} else if (!strcmp(opt, "prefetch:all")) {
+				config.prefetch = FBSPL_PREFETCH_ALL;
+			} else if (!strcmp(opt, "prefetch:idle")) {
+				config.prefetch = FBSPL_PREFETCH_IDLE;
+			} else if (!strcmp(opt, "prefetch:none")) {
+				config.prefetch = FBSPL_PREFETCH_NONE;
+			} else if (!strcmp(opt, "jpeg:accurate")) {
+				config.jpeg = FBSPL_JPEG_ACCURATE;
+			} else if (!strcmp(opt, "jpeg:fast")) {
+				config.jpeg = FBSPL_JPEG_FAST;
+			} else if (!strcmp(opt, "scale:none")) {
+				config.scale = FBSPL_SCALE_NONE;
+			} else if (!strcmp(opt, "scale:bilinear")) {
+				config.scale = FBSPL_SCALE_BILINEAR;
+			} else if (!strcmp(opt, "scale:lanczos")) {
+				config.scale = FBSPL_SCALE_LANCZOS;
 			}
 		}
 	}
@@ -325,6 +366,7 @@ void fbsplash_get_res(const char *theme, int *xres, int *yres)
 	fp = fopen(buf, "r");
 	if (!fp) {
 		unsigned int t, tx, ty, mdist = 0xffffffff;
+		int n;
 		struct dirent *dent;
 		DIR *tdir;
 
@@ -337,7 +379,9 @@ void fbsplash_get_res(const char *theme, int *xres, int *yres)
 		}
 
 		while ((dent = readdir(tdir))) {
-			if (sscanf(dent->d_name, "%dx%d.cfg", &tx, &ty) != 2)
+			/* Skip anything that is not a config file, e.g. theme bundles. */
+			n = 0;
+			if (sscanf(dent->d_name, "%dx%d.cfg%n", &tx, &ty, &n) != 2 || !n || dent->d_name[n])
 				continue;
 
 			/* We only want configs for resolutions smaller than the current one,
@@ -32,7 +32,7 @@ static int fb = -1;
 int fd_fb = -1;
 u8 *fb_mem = NULL;
 int fd_tty[MAX_NR_CONSOLES];
-struct fb_data fbd;
+struct fb_data fbd = { .pf = &pixfmt_generic };
 sendian_t endianess;
 
 static void obj_free(obj *o)
@@ -40,9 +40,6 @@ static void obj_free(obj *o)
 	if (!o)
 		return;
 
-	if (o->bgcache)
-		free(o->bgcache);
-
 	if (o->type == o_box) {
 		box *b = o->p;
 		if (b->inter)
@@ -326,6 +323,8 @@ void fbsplashr_cleanup()
 	TTF_Quit();
 #endif
 
+	effect_free();
+	pool_free();
 	fb_unmap(fb_mem);
 
 	for (i = 0; i < MAX_NR_CONSOLES; i++) {
@@ -360,6 +359,9 @@ int fbsplashr_render_buf(struct fbspl_theme *theme, void *buffer, bool repaint)
 	if (!(theme->modes & FBSPL_MODE_SILENT))
 		return -1;
 
+	/* Pick up any icons loaded in the background since the last frame. */
+	loader_poll(theme);
+
 	if (repaint) {
 		memcpy(buffer, theme->silent_img.data, theme->xres * theme->yres * fbd.bytespp);
 		invalidate_all(theme);
@@ -369,27 +371,54 @@ int fbsplashr_render_buf(struct fbspl_theme *theme, void *buffer, bool repaint)
 	return 0;
 }
 
-/**
- * Render the splash directly to the screen.
- *
- * @param theme Theme for which the screen is to be rendered.
- * @param repaint The whole screeen is rendered if true, only updated parts otherwise.
- * @param bgnd Return immediately if true, wait for all effects to be rendered otherwise.
- *             Effects such as fadein/fadeout take some time to be fully displayed. If this
- *             parameter is set to true, they will be rendered from a separate, forked process.
- * @param effects Indicates which effects are to be used to display the image.  Valid values
- *                are constants prefixed with SPL_EFF_.
- *
- * @return 0 on success, a negative value otherwise.
+/*
+ * Objects are not rendered in 8bpp modes, so only the background image
+ * is displayed there, with its own palette.
  */
-int fbsplashr_render_screen(struct fbspl_theme *theme, bool repaint, bool bgnd, char effects)
+static int render_screen_8bpp(stheme_t *theme, bool repaint, bool bgnd, char effects)
 {
+	u8 *img = (u8*)theme->silent_img.data;
+
+	if (!(theme->modes & FBSPL_MODE_SILENT) || !img)
+		return -1;
+
+	if (!repaint)
+		return 0;
+
+	if (effects & FBSPL_EFF_FADEIN) {
+		fade(theme, fb_mem, img, theme->silent_img.cmap, bgnd ? 1 : 0, fd_fb, 0);
+	} else if (effects & FBSPL_EFF_FADEOUT) {
+		fade(theme, fb_mem, img, theme->silent_img.cmap, bgnd ? 1 : 0, fd_fb, 1);
+	} else {
+		ioctl(fd_fb, FBIOPUTCMAP, &theme->silent_img.cmap);
+		present_img(theme, img);
+	}
+
+	region_clear(theme->blit);
+	return 0;
+}
+
+/*
+ * Render the splash to the screen while no effect is running.  Has to
+ * be called with the effect executor locked.
+ */
+static int render_screen(struct fbspl_theme *theme, bool repaint, bool bgnd, char effects)
+{
+#ifdef CONFIG_DEBUG
+	unsigned int allocs = fbspl_allocs;
+#endif
+
+	if (fbd.var.bits_per_pixel == 8)
+		return render_screen_8bpp(theme, repaint, bgnd, effects);
+
 	if (!fbsplashr_render_buf(theme, theme->bgbuf, repaint)) {
 		if (repaint) {
 			if (effects & FBSPL_EFF_FADEIN) {
 				fade(theme, fb_mem, theme->bgbuf, theme->silent_img.cmap, bgnd ? 1 : 0, fd_fb, 0);
 			} else if (effects & FBSPL_EFF_FADEOUT) {
 				fade(theme, fb_mem, theme->bgbuf, theme->silent_img.cmap, bgnd ? 1 : 0, fd_fb, 1);
+			} else if (effects & FBSPL_EFF_CROSSFADE) {
+				crossfade(theme, fb_mem, theme->bgbuf, bgnd ? 1 : 0);
 			} else {
 				if (theme->silent_img.cmap.red)
 					ioctl(fd_fb, FBIOPUTCMAP, &theme->silent_img.cmap);
@@ -398,11 +427,21 @@ int fbsplashr_render_screen(struct fbspl_theme *theme, bool repaint, bool bgnd,
 				if (fbd.fix.visual == FB_VISUAL_DIRECTCOLOR)
 					fb_cmap_directcolor_set(fd_fb);
 
-				put_img(theme, fb_mem, theme->bgbuf);
+				present_img(theme, theme->bgbuf);
 			}
+
+			/* The whole screen has just been updated. */
+			region_clear(theme->blit);
 		} else {
-			paint_img(theme, fb_mem, theme->bgbuf);
+			present_rects(theme, theme->bgbuf);
 		}
+
+#ifdef CONFIG_DEBUG
+		/* Incremental updates are expected not to touch the heap once
+		 * all buffers have been sized for the theme. */
+		if (!repaint && fbspl_allocs != allocs)
+			iprint(MSG_INFO, "Frame update made %u heap allocations.\n", fbspl_allocs - allocs);
+#endif
 		return 0;
 	} else {
 		return -1;
@@ -410,17 +449,113 @@ int fbsplashr_render_screen(struct fbspl_theme *theme, bool repaint, bool bgnd,
 }
 
 /**
- * Load a splash theme specified by config.theme.
+ * Render the splash directly to the screen.
  *
- * @return A pointer to a theme descriptor, which is then passed to any
- *         libfbsplashrender functions.
+ * @param theme Theme for which the screen is to be rendered.
+ * @param repaint The whole screeen is rendered if true, only updated parts otherwise.
+ * @param bgnd Return immediately if true, wait for all effects to be rendered otherwise.
+ *             Effects such as fadein/fadeout take some time to be fully displayed. If this
+ *             parameter is set to true, they will be rendered in the background (see
+ *             fbsplashr_effect_stop() and fbsplashr_effect_wait()).  Frames rendered
+ *             while an effect is running become a part of the remaining frames of the
+ *             effect.  Requesting another effect completes the running one first.
+ * @param effects Indicates which effects are to be used to display the image.  Valid values
+ *                are constants prefixed with SPL_EFF_.
+ *
+ * @return 0 on success, a negative value otherwise.
  */
-struct fbspl_theme *fbsplashr_theme_load()
+int fbsplashr_render_screen(struct fbspl_theme *theme, bool repaint, bool bgnd, char effects)
+{
+	int err;
+
+	effect_lock();
+
+	if (effect_active(NULL)) {
+		if (!effect_active(theme) || (repaint && (effects & (FBSPL_EFF_FADEIN | FBSPL_EFF_FADEOUT | FBSPL_EFF_CROSSFADE)))) {
+			effect_stop(true);
+		} else if (fbd.var.bits_per_pixel == 8) {
+			/* The image of a palette fade doesn't change. */
+			effect_unlock();
+			return 0;
+		} else {
+			err = fbsplashr_render_buf(theme, theme->bgbuf, repaint);
+			if (!err)
+				effect_update(theme);
+			effect_unlock();
+			return err ? -1 : 0;
+		}
+	}
+
+	err = render_screen(theme, repaint, bgnd, effects);
+	effect_unlock();
+	return err;
+}
+
+/*
+ * The default console palette, used to find the color behind the
+ * bgcolor of a theme.
+ */
+static const u8 con_palette[16][3] = {
+	{ 0x00, 0x00, 0x00 }, { 0xaa, 0x00, 0x00 }, { 0x00, 0xaa, 0x00 }, { 0xaa, 0x55, 0x00 },
+	{ 0x00, 0x00, 0xaa }, { 0xaa, 0x00, 0xaa }, { 0x00, 0xaa, 0xaa }, { 0xaa, 0xaa, 0xaa },
+	{ 0x55, 0x55, 0x55 }, { 0xff, 0x55, 0x55 }, { 0x55, 0xff, 0x55 }, { 0xff, 0xff, 0x55 },
+	{ 0x55, 0x55, 0xff }, { 0xff, 0x55, 0xff }, { 0x55, 0xff, 0xff }, { 0xff, 0xff, 0xff },
+};
+
+/*
+ * Prepare the screen for the progressive first paint: fill it with the
+ * background color of the theme, which is then gradually covered by
+ * the background image as it is being decoded.
+ */
+static void stream_begin(stheme_t *theme)
+{
+	const u8 *c = con_palette[theme->bg_color & 15];
+	rgbcolor *buf;
+	u8 *line[2];
+	int i;
+
+	buf = malloc(fbd.var.xres * (sizeof(rgbcolor) + 2 * fbd.bytespp));
+	if (!buf) {
+		theme->stream = false;
+		return;
+	}
+
+	for (i = 0; i < fbd.var.xres; i++) {
+		buf[i].r = c[0];
+		buf[i].g = c[1];
+		buf[i].b = c[2];
+	}
+
+	/* Dithering in 15/16bpp modes differs between even and odd lines. */
+	for (i = 0; i < 2; i++) {
+		line[i] = (u8*)(buf + fbd.var.xres) + i * fbd.var.xres * fbd.bytespp;
+		rgba2fb((rgbacolor*)buf, line[i], line[i], fbd.var.xres, i, 0, 0xff);
+	}
+
+	for (i = 0; i < fbd.var.yres; i++)
+		memcpy(fb_mem + i * fbd.fix.line_length, line[(i + theme->ymarg) & 1],
+			   fbd.var.xres * fbd.bytespp);
+
+	shadow_invalidate();
+	free(buf);
+}
+
+/**
+ * Load the config file and the assets of the theme specified by
+ * config.theme, without preparing it for rendering.
+ *
+ * @param use_bundle Use the precompiled bundle of the theme, if there
+ *                   is one matching the current video mode.
+ *
+ * @return A pointer to a theme descriptor, or NULL on failure.
+ */
+stheme_t *theme_load(bool use_bundle)
 {
 	char buf[512];
+	const char *cfg;
+	size_t len;
 	stheme_t *st;
-	item *i;
-	int j;
+	rect full;
 
 	if (!config.theme)
 		return NULL;
@@ -436,16 +571,27 @@ struct fbspl_theme *fbsplashr_theme_load()
 	st->log_cols = 80;
 	st->log_cnt = 0;
 
-	fbsplash_get_res(config.theme, &st->xres, &st->yres);
-	if (st->xres == 0 || st->yres == 0)
-		return NULL;
+#ifndef TARGET_KERNEL
+	/* With scaling enabled, the theme always covers the whole screen,
+	 * and is scaled from the config file for the nearest resolution. */
+	if (config.scale != FBSPL_SCALE_NONE) {
+		theme_scale_res(st);
+	} else
+#endif
+	{
+		fbsplash_get_res(config.theme, &st->xres, &st->yres);
+		if (st->xres == 0 || st->yres == 0)
+			return NULL;
 
-	snprintf(buf, 512, FBSPL_THEME_DIR "/%s/%dx%d.cfg", config.theme, st->xres, st->yres);
+		st->cfg_xres = st->xres;
+		st->cfg_yres = st->yres;
+	}
 
 	st->xmarg = (fbd.var.xres - st->xres) / 2;
 	st->ymarg = (fbd.var.yres - st->yres) / 2;
 
-	list_init(st->blit);
+	region_init(st->blit);
+	region_init(st->stale);
 	list_init(st->objs);
 	list_init(st->fxobjs);
 	list_init(st->textbox);
@@ -453,27 +599,83 @@ struct fbspl_theme *fbsplashr_theme_load()
 	list_init(st->icons);
 	list_init(st->fonts);
 	list_init(st->rects);
+	list_init(st->msglog);
+
+	/* The new theme might cover parts of the screen that have never
+	 * been written to. */
+	shadow_invalidate();
 
-	/* Parse the config file. */
-	parse_cfg(buf, st);
+	/* Nothing is known about the contents of the hidden page yet. */
+	full.x1 = full.y1 = 0;
+	full.x2 = st->xres - 1;
+	full.y2 = st->yres - 1;
+	region_op_rect(&st->stale, &full, REGION_UNION);
 
-	/* Check for config file sanity for the given splash mode and
-	 * load background images and icons. */
+	/* A bundle of a scaled theme also records the resolution of the
+	 * config file it was created from. */
+	if (use_bundle)
+		bundle_open(st);
+
+	if (st->cfg_xres == 0 || st->cfg_yres == 0) {
+		bundle_close(st);
+		free(st);
+		return NULL;
+	}
+
+	snprintf(buf, 512, FBSPL_THEME_DIR "/%s/%dx%d.cfg", config.theme, st->cfg_xres, st->cfg_yres);
+
+	/* Parse the config file.  If it is not available (e.g. in an initramfs
+	 * which only contains the bundle), use the copy from the bundle. */
+	if (access(buf, R_OK) && (cfg = bundle_cfg(st, &len)))
+		parse_cfg_buf(buf, cfg, len, st);
+	else
+		parse_cfg(buf, st);
+
+#ifndef TARGET_KERNEL
+	if (theme_scaled(st))
+		theme_scale(st);
+#endif
+
+	/* Check for config file sanity for the given splash mode. */
 	if ((config.reqmode & FBSPL_MODE_VERBOSE) &&
 		cfg_check_sanity(st, 'v'))
 		st->modes &= ~FBSPL_MODE_VERBOSE;
-	else
-		load_images(st, 'v');
 
 	if ((config.reqmode & FBSPL_MODE_SILENT) &&
 		cfg_check_sanity(st, 's'))
 		st->modes &= ~FBSPL_MODE_SILENT;
-	else
-		load_images(st, 's');
 
-#if WANT_MNG
-	load_anims(st);
+	/* Show the silent background while it is being decoded, if the
+	 * silent splash is already in the foreground. */
+	st->stream = config.progressive && fb_mem && fbd.var.bits_per_pixel != 8 &&
+				 (st->modes & FBSPL_MODE_SILENT) && !theme_scaled(st) &&
+				 fbsplash_is_silent();
+	if (st->stream)
+		stream_begin(st);
+
+	/* Load background images, icons, animations and fonts. */
+	load_assets(st, st->modes & FBSPL_MODE_VERBOSE, st->modes & FBSPL_MODE_SILENT);
+	st->stream = false;
 
+	return st;
+}
+
+/**
+ * Load a splash theme specified by config.theme.
+ *
+ * @return A pointer to a theme descriptor, which is then passed to any
+ *         libfbsplashrender functions.
+ */
+struct fbspl_theme *fbsplashr_theme_load()
+{
+	stheme_t *st;
+	item *i;
+
+	st = theme_load(true);
+	if (!st)
+		return NULL;
+
+#if WANT_MNG
 	/* Initialize the first frame of all animations. */
 	for (i = st->anims.head; i != NULL; i = i->next) {
 		mng_anim *mng;
@@ -490,18 +692,14 @@ struct fbspl_theme *fbsplashr_theme_load()
 	}
 #endif
 
-#if WANT_TTF
-	load_fonts(st);
-#endif
-
 	invalidate_all(st);
 	st->bgbuf = malloc(st->xres * st->yres * fbd.bytespp);
 
 	/* Initialize the bouding rectangles. */
 	bnd_init(st);
 
-	/* Initialize the message log. */
-	list_init(st->msglog);
+	/* Render everything that never changes into the background. */
+	bake_static(st);
 
 	for (i = st->objs.head; i != NULL; i = i->next) {
 		obj *co = i->p;
@@ -527,6 +725,12 @@ void fbsplashr_theme_free(struct fbspl_theme *theme)
 	if (!theme)
 		return;
 
+	effect_lock();
+	if (effect_active(theme))
+		effect_stop(true);
+	effect_unlock();
+
+	loader_free(theme);
 	free(theme->bgbuf);
 
 	if (theme->pic)
@@ -554,27 +758,31 @@ void fbsplashr_theme_free(struct fbspl_theme *theme)
 		j = i->next;
 		if (ii->filename)
 			free(ii->filename);
-		if (ii->picbuf)
-			free(ii->picbuf);
+		icon_release(theme, ii);
 		free(ii);
 		free(i);
 		i = j;
 	}
 
+	free(theme->icon_atlas);
+
 	list_free(theme->fxobjs, false);
 	list_free(theme->textbox, false);
 	list_free(theme->anims, false);
 	list_free(theme->rects, true);
-	list_free(theme->blit, true);
+	region_free(&theme->blit);
+	region_free(&theme->stale);
+	objgrid_free(theme);
+	arena_free(&theme->scratch);
 
 	/* Free background pictures */
 	if (theme->verbose_img.data)
-		free((u8*)theme->verbose_img.data);
+		bundle_release(theme, (u8*)theme->verbose_img.data);
 	if (theme->verbose_img.cmap.red)
 		free(theme->verbose_img.cmap.red);
 
 	if (theme->silent_img.data)
-		free((u8*)theme->silent_img.data);
+		bundle_release(theme, (u8*)theme->silent_img.data);
 	if (theme->silent_img.cmap.red)
 		free(theme->silent_img.cmap.red);
 
@@ -585,9 +793,35 @@ void fbsplashr_theme_free(struct fbspl_theme *theme)
 	/* Free the message log. */
 	list_free(theme->msglog, true);
 
+	cache_close(theme);
+	bundle_close(theme);
 	free(theme);
 }
 
+/**
+ * Check whether icons which are to be shown are still being loaded in
+ * the background.  If so, the screen should be rendered again a bit
+ * later, so that the icons are shown once they are loaded.
+ *
+ * @param theme Theme descriptor.
+ */
+bool fbsplashr_theme_loading(struct fbspl_theme *theme)
+{
+	return loader_pending(theme);
+}
+
+/**
+ * Wait until the icons which are to be shown have been loaded in the
+ * background.  Useful when the screen is rendered only on request, so
+ * that a frame rendered afterwards shows the icons.
+ *
+ * @param theme Theme descriptor.
+ */
+void fbsplashr_theme_loading_wait(struct fbspl_theme *theme)
+{
+	loader_wait(theme);
+}
+
 static void vt_cursor_disable(int fd)
 {
 	write(fd, "\e[?25l\e[?1c", 11);
@@ -704,11 +938,20 @@ int fbsplashr_tty_silent_update()
 	if (memcmp(&fbd.fix, &old_fix, sizeof(struct fb_fix_screeninfo)) ||
 	    memcmp(&fbd.var, &old_var, sizeof(struct fb_var_screeninfo))) {
 
-		munmap(fb_mem, old_fix.line_length * old_var.yres);
+		fb_unmap(fb_mem);
 		fb_mem = fb_mmap(fd_fb);
 		ret = 1;
+	} else if (fbd.flip != fb_flip_possible()) {
+		/* Page flipping has been requested after the framebuffer
+		 * was mapped. */
+		fb_unmap(fb_mem);
+		fb_mem = fb_mmap(fd_fb);
 	}
 
+	/* Whatever was displayed on the other tty might still be in the
+	 * framebuffer. */
+	shadow_invalidate();
+
 	/* Update CMAP if we're in a DIRECTCOLOR mode. */
 	if (fbd.fix.visual == FB_VISUAL_DIRECTCOLOR)
 		fb_cmap_directcolor_set(fd_fb);
@@ -0,0 +1,347 @@
+/*
+ * loader.c - Loading of theme assets in the background.
+ *
+ * Copyright (C) 2004-2008, Michal Januszewski <spock@gentoo.org>
+ *
+ * This file is subject to the terms and conditions of the GNU General Public
+ * License v2.  See the file COPYING in the main directory of this archive for
+ * more details.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "common.h"
+#include "render.h"
+
+/*
+ * Icons which are only shown for specific states of services might never
+ * be needed during a boot, so with a prefetch policy other than
+ * FBSPL_PREFETCH_ALL, they are not loaded along with the theme.  Instead,
+ * they are loaded by a background thread:
+ *
+ *  - FBSPL_PREFETCH_IDLE: all of them, in the order in which they appear
+ *    in the config file, starting when the first frame is rendered,
+ *  - FBSPL_PREFETCH_NONE: only when they are about to be shown.
+ *
+ * Icons which are about to be shown are always loaded first.  A loaded
+ * icon is installed into the theme by the rendering thread, at the
+ * beginning of a frame.  Until then, objects using the icon are not
+ * rendered.  Without a paint thread to render the frames later, the
+ * renderer waits for the icons to be loaded instead (see loader_wait()).
+ *
+ * l->cnd is waited on both by the loader thread and by loader_wait(),
+ * so it is always broadcast.
+ */
+
+#ifndef TARGET_KERNEL
+#include <pthread.h>
+
+enum req_state { REQ_QUEUED, REQ_LOADING, REQ_DONE, REQ_INSTALLED };
+
+struct load_req {
+	icon_img *ii;			/* icon in the theme */
+	icon_img res;			/* the loaded icon, until it is installed */
+	enum req_state state;
+	bool urgent;			/* the icon is to be shown */
+};
+
+struct loader {
+	pthread_t th;
+	pid_t pid;				/* process in which the thread lives */
+	bool running;
+	bool prefetch;			/* load the icons which are not requested? */
+
+	pthread_mutex_t mtx;
+	pthread_cond_t cnd;
+	bool quit;
+	int done;				/* requests loaded, but not installed yet */
+	int urgent;				/* urgent requests not installed yet */
+	int loading;			/* urgent requests not loaded yet */
+
+	stheme_t *theme;
+	int num;
+	struct load_req req[];
+};
+
+/*
+ * Find the next icon to be loaded.  Has to be called with l->mtx held.
+ */
+static struct load_req *loader_next(struct loader *l)
+{
+	int i;
+
+	for (i = 0; i < l->num; i++) {
+		if (l->req[i].state == REQ_QUEUED && l->req[i].urgent)
+			return &l->req[i];
+	}
+
+	if (!l->prefetch)
+		return NULL;
+
+	for (i = 0; i < l->num; i++) {
+		if (l->req[i].state == REQ_QUEUED)
+			return &l->req[i];
+	}
+
+	return NULL;
+}
+
+static void *loader_thread(void *data)
+{
+	struct loader *l = data;
+	struct load_req *r;
+
+	pthread_mutex_lock(&l->mtx);
+	while (!l->quit) {
+		r = loader_next(l);
+		if (!r) {
+			pthread_cond_wait(&l->cnd, &l->mtx);
+			continue;
+		}
+
+		r->state = REQ_LOADING;
+		r->res = *r->ii;
+		pthread_mutex_unlock(&l->mtx);
+
+		load_icon(l->theme, &r->res);
+
+		pthread_mutex_lock(&l->mtx);
+		r->state = REQ_DONE;
+		l->done++;
+
+		if (r->urgent) {
+			l->loading--;
+			pthread_cond_broadcast(&l->cnd);
+		}
+	}
+	pthread_mutex_unlock(&l->mtx);
+
+	return NULL;
+}
+
+/*
+ * Make sure the loader thread is running in the current process.
+ */
+static void loader_run(struct loader *l)
+{
+	int i;
+
+	if (l->running && l->pid == getpid())
+		return;
+
+	/* Threads are not inherited by child processes (e.g. the daemon
+	 * after going into background), so the thread has to be started
+	 * again, and whatever it was doing has to be redone. */
+	if (l->running) {
+		pthread_mutex_init(&l->mtx, NULL);
+		pthread_cond_init(&l->cnd, NULL);
+		for (i = 0; i < l->num; i++) {
+			if (l->req[i].state == REQ_LOADING)
+				l->req[i].state = REQ_QUEUED;
+		}
+	}
+
+	l->pid = getpid();
+	l->running = !pthread_create(&l->th, NULL, loader_thread, l);
+
+	/* Without the thread, load everything that has been requested
+	 * right away. */
+	if (!l->running) {
+		for (i = 0; i < l->num; i++) {
+			struct load_req *r = &l->req[i];
+
+			if (r->state != REQ_QUEUED || !r->urgent)
+				continue;
+
+			r->res = *r->ii;
+			load_icon(l->theme, &r->res);
+			r->state = REQ_DONE;
+			l->done++;
+			l->loading--;
+		}
+	}
+}
+
+/**
+ * Set up the loading of icons of a theme in the background.
+ *
+ * @param theme The theme.
+ * @param icons The icons to be loaded.
+ * @param num Number of the icons.
+ *
+ * @return 0 on success, -1 on failure, in which case the icons should be
+ *         loaded right away.
+ */
+int loader_init(stheme_t *theme, icon_img **icons, int num)
+{
+	struct loader *l;
+	int i;
+
+	l = calloc(1, sizeof(*l) + num * sizeof(struct load_req));
+	if (!l)
+		return -1;
+
+	pthread_mutex_init(&l->mtx, NULL);
+	pthread_cond_init(&l->cnd, NULL);
+	l->theme = theme;
+	l->prefetch = (config.prefetch == FBSPL_PREFETCH_IDLE);
+	l->num = num;
+
+	for (i = 0; i < num; i++)
+		l->req[i].ii = icons[i];
+
+	theme->loader = l;
+	return 0;
+}
+
+/**
+ * Request an icon to be loaded as soon as possible, because it is about
+ * to be shown.
+ */
+void loader_request(stheme_t *theme, icon_img *ii)
+{
+	struct loader *l = theme->loader;
+	int i;
+
+	if (!l)
+		return;
+
+	pthread_mutex_lock(&l->mtx);
+	for (i = 0; i < l->num; i++) {
+		struct load_req *r = &l->req[i];
+
+		if (r->ii != ii)
+			continue;
+
+		if (!r->urgent && r->state != REQ_INSTALLED) {
+			r->urgent = true;
+			l->urgent++;
+			if (r->state != REQ_DONE)
+				l->loading++;
+			pthread_cond_broadcast(&l->cnd);
+		}
+		break;
+	}
+	pthread_mutex_unlock(&l->mtx);
+
+	loader_run(l);
+}
+
+/**
+ * Install the icons which have been loaded since the last call into the
+ * theme.  Called by the rendering thread before rendering a frame.
+ */
+void loader_poll(stheme_t *theme)
+{
+	struct loader *l = theme->loader;
+	int i;
+
+	if (!l)
+		return;
+
+	loader_run(l);
+
+	pthread_mutex_lock(&l->mtx);
+	for (i = 0; i < l->num && l->done; i++) {
+		struct load_req *r = &l->req[i];
+
+		if (r->state != REQ_DONE)
+			continue;
+
+		r->ii->picbuf = r->res.picbuf;
+		r->ii->w = r->res.w;
+		r->ii->h = r->res.h;
+		r->state = REQ_INSTALLED;
+		l->done--;
+
+		if (r->urgent)
+			l->urgent--;
+
+		icon_loaded(theme, r->ii);
+	}
+
+	/* Prefetching starts with the first frame. */
+	pthread_cond_broadcast(&l->cnd);
+	pthread_mutex_unlock(&l->mtx);
+}
+
+/**
+ * Check whether there are icons which are to be shown, but which haven't
+ * been installed into the theme yet.
+ */
+bool loader_pending(stheme_t *theme)
+{
+	struct loader *l = theme->loader;
+	bool pending;
+
+	if (!l)
+		return false;
+
+	pthread_mutex_lock(&l->mtx);
+	pending = (l->urgent > 0);
+	pthread_mutex_unlock(&l->mtx);
+
+	return pending;
+}
+
+/**
+ * Wait until the icons which are to be shown have been loaded, so that
+ * they are installed into the theme with the next frame.
+ */
+void loader_wait(stheme_t *theme)
+{
+	struct loader *l = theme->loader;
+
+	if (!l)
+		return;
+
+	loader_run(l);
+
+	pthread_mutex_lock(&l->mtx);
+	while (l->running && l->loading > 0)
+		pthread_cond_wait(&l->cnd, &l->mtx);
+	pthread_mutex_unlock(&l->mtx);
+}
+
+/**
+ * Stop loading the icons of a theme.
+ */
+void loader_free(stheme_t *theme)
+{
+	struct loader *l = theme->loader;
+	int i;
+
+	if (!l)
+		return;
+
+	if (l->running && l->pid == getpid()) {
+		pthread_mutex_lock(&l->mtx);
+		l->quit = true;
+		pthread_cond_broadcast(&l->cnd);
+		pthread_mutex_unlock(&l->mtx);
+		pthread_join(l->th, NULL);
+	}
+
+	/* Icons which have been loaded, but not installed. */
+	for (i = 0; i < l->num; i++) {
+		if (l->req[i].state == REQ_DONE)
+			bundle_release(theme, l->req[i].res.picbuf);
+	}
+
+	free(l);
+	theme->loader = NULL;
+}
+
+#else /* TARGET_KERNEL */
+
+int loader_init(stheme_t *theme, icon_img **icons, int num) { return -1; }
+void loader_request(stheme_t *theme, icon_img *ii) { }
+void loader_poll(stheme_t *theme) { }
+bool loader_pending(stheme_t *theme) { return false; }
+void loader_wait(stheme_t *theme) { }
+void loader_free(stheme_t *theme) { }
+
+#endif /* TARGET_KERNEL */
@@ -285,20 +285,14 @@ void anim_render_canvas(anim *a)
 	}
 }
 
-int load_anims(stheme_t *theme)
+int load_anim(anim *a)
 {
-	int err = 0;
-	item *i;
-
-	for (i = theme->anims.head; i != NULL; i = i->next) {
-		anim *a = (anim*)i->p;
-		a->mng = mng_load(a->filename, &a->w, &a->h);
-		if (!a->mng) {
-			iprint(MSG_ERROR, "%s: failed to allocate memory for mng\n", __func__);
-			err = -1;
-		}
+	a->mng = mng_load(a->filename, &a->w, &a->h);
+	if (!a->mng) {
+		iprint(MSG_ERROR, "%s: failed to allocate memory for mng\n", __func__);
+		return -1;
 	}
 
-	return err;
+	return 0;
 }
 
@@ -0,0 +1,305 @@
+/*
+ * objgrid.c - Spatial index of theme objects.
+ *
+ * Copyright (C) 2004-2008, Michal Januszewski <spock@gentoo.org>
+ *
+ * This file is subject to the terms and conditions of the GNU General Public
+ * License v2.  See the file COPYING in the main directory of this archive for
+ * more details.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "common.h"
+#include "render.h"
+
+/*
+ * The grid makes it possible to find the objects intersecting a given
+ * area of the screen without walking the whole objs list.  It has to be
+ * kept in sync with the bounding rects of the objects, which is why
+ * all changes to obj->bnd after bnd_init() go through obj_bnd_set().
+ *
+ * If the grid cannot be allocated or updated, it is dropped, and
+ * objgrid_query() falls back to walking the objs list.
+ */
+
+/**
+ * Find the range of cells covered by a rect.
+ *
+ * @return false if the rect is empty, true otherwise.
+ */
+static bool cell_range(objgrid *g, rect *re, rect *c)
+{
+	if (re->x2 < re->x1 || re->y2 < re->y1)
+		return false;
+
+	c->x1 = max(re->x1, 0) / OBJGRID_CELL;
+	c->y1 = max(re->y1, 0) / OBJGRID_CELL;
+	c->x2 = min(re->x2 / OBJGRID_CELL, g->cols - 1);
+	c->y2 = min(re->y2 / OBJGRID_CELL, g->rows - 1);
+
+	return (c->x1 <= c->x2 && c->y1 <= c->y2);
+}
+
+/**
+ * Add an object to a cell, keeping the cell sorted by object ID.
+ */
+static int cell_add(objcell *c, obj *o)
+{
+	obj **t;
+	int i;
+
+	if (c->num == c->size) {
+		t = realloc(c->objs, (c->size ? c->size * 2 : 4) * sizeof(obj*));
+		if (!t)
+			return -1;
+		c->objs = t;
+		c->size = c->size ? c->size * 2 : 4;
+	}
+
+	for (i = c->num; i > 0 && c->objs[i-1]->id > o->id; i--)
+		c->objs[i] = c->objs[i-1];
+
+	c->objs[i] = o;
+	c->num++;
+	return 0;
+}
+
+static void cell_del(objcell *c, obj *o)
+{
+	int i;
+
+	for (i = 0; i < c->num; i++) {
+		if (c->objs[i] == o) {
+			memmove(c->objs + i, c->objs + i + 1, (c->num - i - 1) * sizeof(obj*));
+			c->num--;
+			return;
+		}
+	}
+}
+
+static int grid_add(objgrid *g, obj *o, rect *cr)
+{
+	int x, y, err = 0;
+
+	for (y = cr->y1; y <= cr->y2; y++)
+		for (x = cr->x1; x <= cr->x2; x++)
+			err |= cell_add(&g->cells[y * g->cols + x], o);
+
+	return err;
+}
+
+static void grid_del(objgrid *g, obj *o, rect *cr)
+{
+	int x, y;
+
+	for (y = cr->y1; y <= cr->y2; y++)
+		for (x = cr->x1; x <= cr->x2; x++)
+			cell_del(&g->cells[y * g->cols + x], o);
+}
+
+static int obj_cmp(const void *a, const void *b)
+{
+	return (*(obj**)a)->id - (*(obj**)b)->id;
+}
+
+/**
+ * Build the spatial index for all objects of a theme.
+ *
+ * Has to be called after the bounding rects of the objects have been
+ * initialized.
+ *
+ * @return 0 on success, -1 if memory allocation failed.  In the latter
+ *         case, the theme is left without a grid.
+ */
+int objgrid_init(stheme_t *theme)
+{
+	objgrid *g = &theme->grid;
+	item *i;
+	rect cr;
+
+	g->cols = (theme->xres + OBJGRID_CELL - 1) / OBJGRID_CELL;
+	g->rows = (theme->yres + OBJGRID_CELL - 1) / OBJGRID_CELL;
+	g->cells = calloc(g->cols * g->rows, sizeof(objcell));
+	if (!g->cells) {
+		iprint(MSG_ERROR, "Failed to allocate the object grid.\n");
+		objgrid_free(theme);
+		return -1;
+	}
+
+	for (i = theme->objs.head; i != NULL; i = i->next) {
+		obj *o = i->p;
+
+		if (cell_range(g, &o->bnd, &cr) && grid_add(g, o, &cr)) {
+			iprint(MSG_ERROR, "Failed to add an object to the object grid.\n");
+			objgrid_free(theme);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+void objgrid_free(stheme_t *theme)
+{
+	objgrid *g = &theme->grid;
+	int i;
+
+	if (g->cells) {
+		for (i = 0; i < g->cols * g->rows; i++)
+			free(g->cells[i].objs);
+		free(g->cells);
+	}
+
+	free(g->res);
+	memset(g, 0, sizeof(objgrid));
+}
+
+/**
+ * Update the position of an object in the grid after its bounding
+ * rect has been changed.
+ *
+ * @param theme Theme to which the object belongs.
+ * @param o The object, with an already updated bounding rect.
+ * @param old The previous bounding rect of the object.
+ *
+ * @return 0 on success, -1 if memory allocation failed.  In the latter
+ *         case, the grid is dropped.
+ */
+int objgrid_update(stheme_t *theme, obj *o, rect *old)
+{
+	objgrid *g = &theme->grid;
+	rect co, cn;
+	bool in_old, in_new;
+
+	if (!g->cells)
+		return 0;
+
+	in_old = cell_range(g, old, &co);
+	in_new = cell_range(g, &o->bnd, &cn);
+
+	/* Still covering the same cells? */
+	if (in_old == in_new && (!in_old || !memcmp(&co, &cn, sizeof(rect))))
+		return 0;
+
+	if (in_old)
+		grid_del(g, o, &co);
+
+	if (in_new && grid_add(g, o, &cn)) {
+		iprint(MSG_ERROR, "Failed to add an object to the object grid.\n");
+		objgrid_free(theme);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Find all objects whose bounding rects intersect a rect by walking
+ * the objs list.  Used when there is no grid.
+ *
+ * @return 0 on success, -1 if the array could not be allocated.
+ */
+static int objlist_query(stheme_t *theme, rect *re, int *num)
+{
+	objgrid *g = &theme->grid;
+	item *i;
+	obj **t;
+	int n = 0;
+
+	for (i = theme->objs.head; i != NULL; i = i->next) {
+		obj *o = i->p;
+
+		if (o->bnd.x2 < o->bnd.x1 || o->bnd.y2 < o->bnd.y1 ||
+			!rect_intersect(re, &o->bnd))
+			continue;
+
+		if (n == g->res_size) {
+			t = realloc(g->res, (n ? n * 2 : 16) * sizeof(obj*));
+			if (!t)
+				return -1;
+			g->res = t;
+			g->res_size = n ? n * 2 : 16;
+		}
+
+		g->res[n++] = o;
+	}
+
+	*num = n;
+	return 0;
+}
+
+/**
+ * Find all objects whose bounding rects might intersect a rect.
+ *
+ * @param theme The theme to search.
+ * @param re The rect to look for.
+ * @param num Set to the number of objects found, or to -1 if the array
+ *            could not be allocated.
+ *
+ * @return An array of objects, sorted in z-order.  The array is only
+ *         valid until the next call to objgrid_query() or objgrid_update().
+ */
+obj **objgrid_query(stheme_t *theme, rect *re, int *num)
+{
+	objgrid *g = &theme->grid;
+	objcell *c;
+	obj **t;
+	rect cr;
+	int x, y, i, n = 0;
+
+	*num = 0;
+
+	if (!g->cells) {
+		if (objlist_query(theme, re, num))
+			goto nomem;
+		return g->res;
+	}
+
+	if (!cell_range(g, re, &cr))
+		return g->res;
+
+	/* A single cell is already sorted and free of duplicates. */
+	if (cr.x1 == cr.x2 && cr.y1 == cr.y2) {
+		c = &g->cells[cr.y1 * g->cols + cr.x1];
+		*num = c->num;
+		return c->objs;
+	}
+
+	g->stamp++;
+
+	for (y = cr.y1; y <= cr.y2; y++) {
+		for (x = cr.x1; x <= cr.x2; x++) {
+			c = &g->cells[y * g->cols + x];
+
+			for (i = 0; i < c->num; i++) {
+				if (c->objs[i]->stamp == g->stamp)
+					continue;
+
+				if (n == g->res_size) {
+					t = realloc(g->res, (n ? n * 2 : 16) * sizeof(obj*));
+					if (!t)
+						goto nomem;
+					g->res = t;
+					g->res_size = n ? n * 2 : 16;
+				}
+
+				c->objs[i]->stamp = g->stamp;
+				g->res[n++] = c->objs[i];
+			}
+		}
+	}
+
+	qsort(g->res, n, sizeof(obj*), obj_cmp);
+	*num = n;
+	return g->res;
+
+nomem:
+	/* Rendering with only some of the objects would leave the others
+	 * missing from the frame. */
+	iprint(MSG_ERROR, "Failed to allocate memory for the object list.\n");
+	*num = -1;
+	return NULL;
+}
@@ -38,9 +38,14 @@ stheme_t tmptheme;
 static bool is_textbox = false;
 
 /* Note that pic256 and silentpic256 have to be located before pic and
- * silentpic or we are gonna get a parse error @ pic256/silentpic256. */
+ * silentpic or we are gonna get a parse error @ pic256/silentpic256.
+ * The same goes for jpeg_fast and jpeg. */
 struct cfg_opt opts[] =
 {
+	{	.name = "jpeg_fast",
+		.type = t_int,
+		.val = &tmptheme.jpeg_fast	},
+
 	{	.name = "jpeg",
 		.type = t_path,
 		.val = &tmptheme.pic	},
@@ -596,14 +601,14 @@ void parse_rect(char *t)
 	checknskip(pr_err, true, "expected a number instead of '%s'", t);
 
 	/* sanity checks */
-	if (crect->x1 >= tmptheme.xres)
-		crect->x1 = tmptheme.xres-1;
-	if (crect->x2 >= tmptheme.xres)
-		crect->x2 = tmptheme.xres-1;
-	if (crect->y1 >= tmptheme.yres)
-		crect->y1 = tmptheme.yres-1;
-	if (crect->y2 >= tmptheme.yres)
-		crect->y2 = tmptheme.yres-1;
+	if (crect->x1 >= tmptheme.cfg_xres)
+		crect->x1 = tmptheme.cfg_xres-1;
+	if (crect->x2 >= tmptheme.cfg_xres)
+		crect->x2 = tmptheme.cfg_xres-1;
+	if (crect->y1 >= tmptheme.cfg_yres)
+		crect->y1 = tmptheme.cfg_yres-1;
+	if (crect->y2 >= tmptheme.cfg_yres)
+		crect->y2 = tmptheme.cfg_yres-1;
 
 	list_add(&tmptheme.rects, crect);
 	return;
@@ -670,10 +675,10 @@ bool parse_anim(char *t)
 	checknskip(pa_err, true, "expected a number instead of '%s'", t);
 
 	/* Sanity checks */
-	if (canim->x >= tmptheme.xres)
-		canim->x = tmptheme.xres-1;
-	if (canim->y >= tmptheme.yres)
-		canim->y = tmptheme.yres-1;
+	if (canim->x >= tmptheme.cfg_xres)
+		canim->x = tmptheme.cfg_xres-1;
+	if (canim->y >= tmptheme.cfg_yres)
+		canim->y = tmptheme.cfg_yres-1;
 
 	canim->status = 0;
 
@@ -760,14 +765,14 @@ box* parse_box(char *t)
 	checknskip(pb_err, true, "expected a number instead of '%s'", t);
 
 	/* Sanity checks */
-	if (cbox->re.x1 >= tmptheme.xres)
-		cbox->re.x1 = tmptheme.xres-1;
-	if (cbox->re.x2 >= tmptheme.xres)
-		cbox->re.x2 = tmptheme.xres-1;
-	if (cbox->re.y1 >= tmptheme.yres)
-		cbox->re.y1 = tmptheme.yres-1;
-	if (cbox->re.y2 >= tmptheme.yres)
-		cbox->re.y2 = tmptheme.yres-1;
+	if (cbox->re.x1 >= tmptheme.cfg_xres)
+		cbox->re.x1 = tmptheme.cfg_xres-1;
+	if (cbox->re.x2 >= tmptheme.cfg_xres)
+		cbox->re.x2 = tmptheme.cfg_xres-1;
+	if (cbox->re.y1 >= tmptheme.cfg_yres)
+		cbox->re.y1 = tmptheme.cfg_yres-1;
+	if (cbox->re.y2 >= tmptheme.cfg_yres)
+		cbox->re.y2 = tmptheme.cfg_yres-1;
 
 	if (cbox->re.x2 < cbox->re.x1) {
 		parse_error("x2 has to be larger or equal to x1");
@@ -1005,7 +1010,7 @@ bool parse_text(char *t)
 	skip_whitespace(&t, false);
 
 	/* Sanity checks */
-	if (ct->x >= tmptheme.xres) {
+	if (ct->x >= tmptheme.cfg_xres) {
 		parse_error("the x position is invalid (larger than x resolution)");
 		goto pt_err;
 	}
@@ -1013,7 +1018,7 @@ bool parse_text(char *t)
 	if (ct->x < 0)
 		ct->x = 0;
 
-	if (ct->y >= tmptheme.yres) {
+	if (ct->y >= tmptheme.cfg_yres) {
 		parse_error("the y position is invalid (larger than y resolution)");
 		goto pt_err;
 	}
@@ -1168,27 +1173,53 @@ mm_err:
 
 #endif	/* TTF */
 
-int parse_cfg(char *cfgfile, stheme_t *theme)
+/*
+ * A source of config file lines: either an open file, or a copy of
+ * the file in memory.
+ */
+struct cfg_src {
+	FILE *fp;
+	const char *p, *end;
+};
+
+/*
+ * Read a line from a config source, the same way fgets() would.
+ */
+static char *cfg_gets(char *buf, int size, struct cfg_src *src)
+{
+	int i = 0;
+
+	if (src->fp)
+		return fgets(buf, size, src->fp);
+
+	if (src->p >= src->end)
+		return NULL;
+
+	while (i < size - 1 && src->p < src->end) {
+		buf[i++] = *src->p;
+		if (*src->p++ == '\n')
+			break;
+	}
+
+	buf[i] = 0;
+	return buf;
+}
+
+static int parse_cfg_src(char *cfgfile, struct cfg_src *src, stheme_t *theme)
 {
-	FILE* cfgfp;
 	char buf[1024];
 	char *t;
 	int len, i;
 	bool ignore = false;
 	box *bprev = NULL;
 
-	if ((cfgfp = fopen(cfgfile,"r")) == NULL) {
-		iprint(MSG_ERROR, "Can't open cfg file %s.\n", cfgfile);
-		return 1;
-	}
-
 	/* Save the path of the file that is currently being parsed, so that
 	 * it can be used when printing error messages. */
 	curr_cfgfile = cfgfile;
 
 	memcpy(&tmptheme, theme, sizeof(tmptheme));
 
-	while (fgets(buf, sizeof(buf), cfgfp)) {
+	while (cfg_gets(buf, sizeof(buf), src)) {
 
 		line++;
 
@@ -1382,9 +1413,37 @@ box_post:
 	add_main_msg();
 #endif
 	memcpy(theme, &tmptheme, sizeof(tmptheme));
-
-	fclose(cfgfp);
 	return 0;
 }
 
+int parse_cfg(char *cfgfile, stheme_t *theme)
+{
+	struct cfg_src src = { NULL, NULL, NULL };
+	int ret;
+
+	if ((src.fp = fopen(cfgfile,"r")) == NULL) {
+		iprint(MSG_ERROR, "Can't open cfg file %s.\n", cfgfile);
+		return 1;
+	}
+
+	ret = parse_cfg_src(cfgfile, &src, theme);
+	fclose(src.fp);
+	return ret;
+}
+
+/**
+ * Parse a config file which has already been read into memory.
+ *
+ * @param cfgfile Path of the file, used in error messages.
+ * @param data Contents of the file.
+ * @param len Length of the data.
+ * @param theme Theme into which the config is to be parsed.
+ */
+int parse_cfg_buf(char *cfgfile, const char *data, size_t len, stheme_t *theme)
+{
+	struct cfg_src src = { NULL, data, data + len };
+
+	return parse_cfg_src(cfgfile, &src, theme);
+}
+
 
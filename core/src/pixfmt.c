@@ -0,0 +1,244 @@
+/*
+ * pixfmt.c - Row-level pixel kernels specialized for common framebuffer
+ *            layouts.
+ *
+ * Copyright (C) 2004-2008, Michal Januszewski <spock@gentoo.org>
+ *
+ * This file is subject to the terms and conditions of the GNU General Public
+ * License v2.  See the file COPYING in the main directory of this archive for
+ * more details.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "common.h"
+#include "render.h"
+
+/*
+ * All kernels below produce exactly the same output as put_pixel() would
+ * for the same input.  The only difference is that the decisions about
+ * the pixel layout are made once per mode change (in pixfmt_select())
+ * instead of once per pixel.
+ *
+ * The dithering pattern (the 'add' argument) follows the conventions used
+ * by put_pixel(): 'add' is either 1 or 3, and it is XOR-ed with 3 after
+ * every pixel.  It is ignored in 24/32bpp modes.
+ */
+
+/*
+ * 24/32bpp modes with 8-bit color components.  'ro', 'go' and 'bo' are
+ * byte offsets of the color components within a pixel.
+ */
+static inline void px8(u8 *dst, u8 *bg, int a, u8 r, u8 g, u8 b,
+		const int ro, const int go, const int bo)
+{
+	if (a == 0) {
+		dst[ro] = bg[ro];
+		dst[go] = bg[go];
+		dst[bo] = bg[bo];
+	} else if (a == 255) {
+		dst[ro] = r;
+		dst[go] = g;
+		dst[bo] = b;
+	} else {
+		dst[ro] = DIV255(bg[ro] * (255 - a) + r * a);
+		dst[go] = DIV255(bg[go] * (255 - a) + g * a);
+		dst[bo] = DIV255(bg[bo] * (255 - a) + b * a);
+	}
+}
+
+/*
+ * 16bpp modes.  The offsets and lengths are in bits.  Dithering is always
+ * applied, as is done by put_pixel().
+ */
+static inline void px16(u8 *dst, u8 *bg, int a, u8 r, u8 g, u8 b, int add,
+		const int roff, const int rlen, const int goff, const int glen,
+		const int boff, const int blen)
+{
+	u32 i;
+	int tr, tg, tb;
+
+	/* The dithering never carries over to the next color level in
+	 * 15/16bpp modes, so a fully transparent pixel is a plain copy
+	 * (unless there are padding bits that would have to be cleared). */
+	if (a == 0 && rlen + glen + blen == 16) {
+		*(u16*)dst = *(u16*)bg;
+		return;
+	}
+
+	if (a != 255) {
+		i = *(u16*)bg;
+
+		tr = DIV255((((i >> roff) & ((1 << rlen) - 1)) << (8 - rlen)) * (255 - a) + r * a);
+		tg = DIV255((((i >> goff) & ((1 << glen) - 1)) << (8 - glen)) * (255 - a) + g * a);
+		tb = DIV255((((i >> boff) & ((1 << blen) - 1)) << (8 - blen)) * (255 - a) + b * a);
+	} else {
+		tr = r;
+		tg = g;
+		tb = b;
+	}
+
+	tr = CLAMP(tr + add*2 + 1);
+	tg = CLAMP(tg + add);
+	tb = CLAMP(tb + add*2 + 1);
+
+	*(u16*)dst = ((tr >> (8 - rlen)) << roff) |
+				 ((tg >> (8 - glen)) << goff) |
+				 ((tb >> (8 - blen)) << boff);
+}
+
+/*
+ * Generic row loops.  PX is an expression which renders a single pixel
+ * with alpha 'a' and color 'r', 'g', 'b' at 'dst' over 'bg'; BPP is the
+ * number of bytes per pixel.
+ */
+#define ROW_BLEND(PX, BPP)								\
+	int i, a;											\
+														\
+	if (opacity == 0xff) {								\
+		for (i = 0; i < len; i++, src++, dst += BPP, bg += BPP, add ^= 3) { \
+			a = src->a;									\
+			PX;											\
+		}												\
+	} else {											\
+		for (i = 0; i < len; i++, src++, dst += BPP, bg += BPP, add ^= 3) { \
+			a = DIV255(opacity * src->a);				\
+			PX;											\
+		}												\
+	}
+
+#define ROW_CONVERT(PX, BPP)							\
+	int i, a = alpha;									\
+														\
+	for (i = 0; i < len; i++, src++, dst += BPP, bg += BPP, add ^= 3) {	\
+		PX;												\
+	}
+
+#define ROW_FILL(PX, BPP)								\
+	int i;												\
+														\
+	for (i = 0; i < len; i++, dst += BPP, bg += BPP, add ^= 3) {	\
+		PX;												\
+	}
+
+#define ROW_MASK(PX, BPP)								\
+	int i, a;											\
+														\
+	for (i = 0; i < len; i++, dst += BPP, bg += BPP, add ^= 3) {	\
+		a = DIV255(c.a * mask[i]);						\
+		PX;												\
+	}
+
+/*
+ * Instantiate a set of kernels for a pixel layout.  PXF is the name
+ * of the pixel function (px8 or px16), ARGS are the layout-specific
+ * arguments passed to it.
+ */
+#define DEFINE_PIXFMT(name, bpp, PXF, ARGS...)								\
+static void name##_blend(u8 *dst, u8 *bg, rgbacolor *src, int len, int add, u8 opacity) \
+{																			\
+	ROW_BLEND(PXF(dst, bg, a, src->r, src->g, src->b, ## ARGS), bpp)		\
+}																			\
+static void name##_convert(u8 *dst, u8 *bg, rgbcolor *src, int len, int add, u8 alpha) \
+{																			\
+	ROW_CONVERT(PXF(dst, bg, a, src->r, src->g, src->b, ## ARGS), bpp)		\
+}																			\
+static void name##_fill(u8 *dst, u8 *bg, int len, int add, u8 a, u8 r, u8 g, u8 b) \
+{																			\
+	ROW_FILL(PXF(dst, bg, a, r, g, b, ## ARGS), bpp)						\
+}																			\
+static void name##_mask(u8 *dst, u8 *bg, u8 *mask, int len, int add, color c) \
+{																			\
+	ROW_MASK(PXF(dst, bg, a, c.r, c.g, c.b, ## ARGS), bpp)					\
+}
+
+/* 24/32bpp, byte offsets of the red, green and blue components. */
+DEFINE_PIXFMT(rgb888,   3, px8, 2, 1, 0)
+DEFINE_PIXFMT(bgr888,   3, px8, 0, 1, 2)
+DEFINE_PIXFMT(xrgb8888, 4, px8, 2, 1, 0)
+DEFINE_PIXFMT(xbgr8888, 4, px8, 0, 1, 2)
+
+/* 24/32bpp modes with any other layout of the color components. */
+DEFINE_PIXFMT(any888, fbd.bytespp, px8, fbd.ro, fbd.go, fbd.bo)
+
+/* 16bpp, bit offset and length of the red, green and blue components. */
+DEFINE_PIXFMT(rgb565, 2, px16, add, 11, 5, 5, 6, 0, 5)
+DEFINE_PIXFMT(rgb555, 2, px16, add, 10, 5, 5, 5, 0, 5)
+
+/* Anything else goes through put_pixel(). */
+#define px_generic(dst, bg, a, r, g, b)	put_pixel(a, r, g, b, bg, dst, add)
+DEFINE_PIXFMT(generic, fbd.bytespp, px_generic)
+
+#define PIXFMT(__name, __str)	\
+	{							\
+		.name = __str,			\
+		.blend = __name##_blend,	\
+		.convert = __name##_convert,	\
+		.fill = __name##_fill,	\
+		.mask = __name##_mask,	\
+	}
+
+const pixfmt pixfmt_rgb888   = PIXFMT(rgb888, "RGB888");
+const pixfmt pixfmt_bgr888   = PIXFMT(bgr888, "BGR888");
+const pixfmt pixfmt_xrgb8888 = PIXFMT(xrgb8888, "XRGB8888");
+const pixfmt pixfmt_xbgr8888 = PIXFMT(xbgr8888, "XBGR8888");
+const pixfmt pixfmt_any888   = PIXFMT(any888, "24/32bpp");
+const pixfmt pixfmt_rgb565   = PIXFMT(rgb565, "RGB565");
+const pixfmt pixfmt_rgb555   = PIXFMT(rgb555, "RGB555");
+const pixfmt pixfmt_generic  = PIXFMT(generic, "generic");
+
+/* Kernels for the current video mode, with vectorized replacements. */
+static pixfmt pixfmt_accelerated;
+
+/**
+ * Pick the set of row kernels matching the current video mode.
+ *
+ * Has to be called whenever fbd is updated.
+ */
+void pixfmt_select(void)
+{
+	struct fb_var_screeninfo *v = &fbd.var;
+	const pixfmt_accel *a, *best = NULL;
+
+	if (fbd.opt) {
+		if (fbd.ro == 2 && fbd.go == 1 && fbd.bo == 0)
+			fbd.pf = (fbd.bytespp == 3) ? &pixfmt_rgb888 : &pixfmt_xrgb8888;
+		else if (fbd.ro == 0 && fbd.go == 1 && fbd.bo == 2)
+			fbd.pf = (fbd.bytespp == 3) ? &pixfmt_bgr888 : &pixfmt_xbgr8888;
+		else
+			fbd.pf = &pixfmt_any888;
+	} else if (v->bits_per_pixel == 16 &&
+			   v->red.offset == 11 && fbd.rlen == 5 &&
+			   v->green.offset == 5 && fbd.glen == 6 &&
+			   v->blue.offset == 0 && fbd.blen == 5) {
+		fbd.pf = &pixfmt_rgb565;
+	} else if (v->bits_per_pixel == 16 &&
+			   v->red.offset == 10 && fbd.rlen == 5 &&
+			   v->green.offset == 5 && fbd.glen == 5 &&
+			   v->blue.offset == 0 && fbd.blen == 5) {
+		fbd.pf = &pixfmt_rgb555;
+	} else {
+		fbd.pf = &pixfmt_generic;
+	}
+
+	/* The accelerated kernels are sorted by preference, so the last
+	 * one supported by the CPU wins. */
+	for (a = pixfmt_accels; a->name; a++) {
+		if (a->base == fbd.pf && a->supported())
+			best = a;
+	}
+
+	if (best) {
+		pixfmt_accelerated = *fbd.pf;
+		pixfmt_accelerated.name = best->name;
+		if (best->blend)
+			pixfmt_accelerated.blend = best->blend;
+		if (best->convert)
+			pixfmt_accelerated.convert = best->convert;
+		fbd.pf = &pixfmt_accelerated;
+	}
+
+	DEBUG("Using %s pixel kernels.\n", fbd.pf->name);
+}
@@ -0,0 +1,394 @@
+/*
+ * pixfmt_simd.c - Vectorized alpha-compositing kernels.
+ *
+ * Copyright (C) 2004-2008, Michal Januszewski <spock@gentoo.org>
+ *
+ * This file is subject to the terms and conditions of the GNU General Public
+ * License v2.  See the file COPYING in the main directory of this archive for
+ * more details.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "common.h"
+#include "render.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define PIXFMT_X86
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define PIXFMT_NEON
+#include <arm_neon.h>
+#endif
+
+/*
+ * The kernels in this file replace the blend() and convert() kernels of
+ * the 32bpp pixel formats.  They compute exactly what px8() does:
+ *
+ *   c' = DIV255(bg * (255 - a) + c * a)
+ *
+ * which is also exact for a == 0 and a == 255, so no special cases are
+ * necessary.  All intermediate values fit in 16 bits.  The fourth byte
+ * of every pixel in 'dst' is left untouched.  Whatever is left at the
+ * end of a row is handled by the scalar kernels.
+ */
+
+#ifdef PIXFMT_X86
+
+#define TARGET_SSE2		__attribute__((target("sse2")))
+#define TARGET_SSSE3	__attribute__((target("ssse3")))
+#define TARGET_AVX2		__attribute__((target("avx2")))
+
+static int cpu_sse2(void)
+{
+#ifdef __x86_64__
+	return 1;
+#else
+	unsigned int a, b, c, d;
+
+	if (!__get_cpuid(1, &a, &b, &c, &d))
+		return 0;
+	return (d & bit_SSE2) ? 1 : 0;
+#endif
+}
+
+static int cpu_ssse3(void)
+{
+	unsigned int a, b, c, d;
+
+	if (!__get_cpuid(1, &a, &b, &c, &d))
+		return 0;
+	return (c & bit_SSSE3) ? 1 : 0;
+}
+
+static int cpu_avx2(void)
+{
+	unsigned int a, b, c, d, xcr0;
+
+	if (!cpu_ssse3() || __get_cpuid_max(0, NULL) < 7)
+		return 0;
+
+	/* The OS has to save the YMM registers on context switches. */
+	__cpuid(1, a, b, c, d);
+	if (!(c & bit_OSXSAVE) || !(c & bit_AVX))
+		return 0;
+
+	__asm__ __volatile__(".byte 0x0f, 0x01, 0xd0" : "=a" (xcr0), "=d" (d) : "c" (0));
+	if ((xcr0 & 6) != 6)
+		return 0;
+
+	__cpuid_count(7, 0, a, b, c, d);
+	return (b & bit_AVX2) ? 1 : 0;
+}
+
+/*
+ * SSE2: 4 pixels per iteration, two pixels per register once the color
+ * components are unpacked to 16 bits.
+ */
+TARGET_SSE2 static inline __m128i div255_sse2(__m128i x)
+{
+	return _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(x, _mm_set1_epi16(1)),
+										_mm_srli_epi16(x, 8)), 8);
+}
+
+TARGET_SSE2 static inline __m128i mix_sse2(__m128i s, __m128i b, __m128i a)
+{
+	return div255_sse2(_mm_add_epi16(
+			_mm_mullo_epi16(b, _mm_sub_epi16(_mm_set1_epi16(255), a)),
+			_mm_mullo_epi16(s, a)));
+}
+
+#define SSE2_SWAP_RB(x)	_mm_shufflehi_epi16(_mm_shufflelo_epi16(x, _MM_SHUFFLE(3,0,1,2)), _MM_SHUFFLE(3,0,1,2))
+#define SSE2_ALPHA(x)	_mm_shufflehi_epi16(_mm_shufflelo_epi16(x, _MM_SHUFFLE(3,3,3,3)), _MM_SHUFFLE(3,3,3,3))
+
+TARGET_SSE2 static inline void blend_sse2(u8 *dst, u8 *bg, rgbacolor *src,
+		int len, u8 opacity, const int swap, const pixfmt *base)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i rgb = _mm_set1_epi32(0x00ffffff);
+	const __m128i op = _mm_set1_epi16(opacity);
+	__m128i s, b, d, sl, sh, al, ah;
+	int i;
+
+	for (i = 0; i + 4 <= len; i += 4) {
+		s = _mm_loadu_si128((__m128i*)(src + i));
+		b = _mm_loadu_si128((__m128i*)(bg + 4*i));
+		d = _mm_loadu_si128((__m128i*)(dst + 4*i));
+
+		sl = _mm_unpacklo_epi8(s, zero);
+		sh = _mm_unpackhi_epi8(s, zero);
+		if (swap) {
+			sl = SSE2_SWAP_RB(sl);
+			sh = SSE2_SWAP_RB(sh);
+		}
+
+		al = SSE2_ALPHA(sl);
+		ah = SSE2_ALPHA(sh);
+		if (opacity != 0xff) {
+			al = div255_sse2(_mm_mullo_epi16(al, op));
+			ah = div255_sse2(_mm_mullo_epi16(ah, op));
+		}
+
+		sl = mix_sse2(sl, _mm_unpacklo_epi8(b, zero), al);
+		sh = mix_sse2(sh, _mm_unpackhi_epi8(b, zero), ah);
+		s = _mm_packus_epi16(sl, sh);
+
+		_mm_storeu_si128((__m128i*)(dst + 4*i),
+				_mm_or_si128(_mm_and_si128(s, rgb), _mm_andnot_si128(rgb, d)));
+	}
+
+	if (i < len)
+		base->blend(dst + 4*i, bg + 4*i, src + i, len - i, 0, opacity);
+}
+
+TARGET_SSE2 static void xrgb8888_blend_sse2(u8 *dst, u8 *bg, rgbacolor *src, int len, int add, u8 opacity)
+{
+	blend_sse2(dst, bg, src, len, opacity, 1, &pixfmt_xrgb8888);
+}
+
+TARGET_SSE2 static void xbgr8888_blend_sse2(u8 *dst, u8 *bg, rgbacolor *src, int len, int add, u8 opacity)
+{
+	blend_sse2(dst, bg, src, len, opacity, 0, &pixfmt_xbgr8888);
+}
+
+/*
+ * SSSE3: expand packed 24-bit RGB to 32-bit pixels with a single shuffle.
+ */
+TARGET_SSSE3 static inline void convert_ssse3(u8 *dst, u8 *bg, rgbcolor *src,
+		int len, u8 alpha, const int swap, const pixfmt *base)
+{
+	const __m128i shuf = swap ?
+		_mm_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1) :
+		_mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i rgb = _mm_set1_epi32(0x00ffffff);
+	const __m128i a = _mm_set1_epi16(alpha);
+	__m128i s, b, d;
+	int i;
+
+	/* Every load reads 16 bytes, i.e. 4 pixels that are used and 4 bytes
+	 * of the following ones, so stay clear of the end of the row. */
+	for (i = 0; i + 6 <= len; i += 4) {
+		s = _mm_shuffle_epi8(_mm_loadu_si128((__m128i*)(src + i)), shuf);
+		d = _mm_loadu_si128((__m128i*)(dst + 4*i));
+
+		if (alpha != 0xff) {
+			b = _mm_loadu_si128((__m128i*)(bg + 4*i));
+			s = _mm_packus_epi16(
+					mix_sse2(_mm_unpacklo_epi8(s, zero), _mm_unpacklo_epi8(b, zero), a),
+					mix_sse2(_mm_unpackhi_epi8(s, zero), _mm_unpackhi_epi8(b, zero), a));
+		}
+
+		_mm_storeu_si128((__m128i*)(dst + 4*i),
+				_mm_or_si128(_mm_and_si128(s, rgb), _mm_andnot_si128(rgb, d)));
+	}
+
+	if (i < len)
+		base->convert(dst + 4*i, bg + 4*i, src + i, len - i, 0, alpha);
+}
+
+TARGET_SSSE3 static void xrgb8888_convert_ssse3(u8 *dst, u8 *bg, rgbcolor *src, int len, int add, u8 alpha)
+{
+	convert_ssse3(dst, bg, src, len, alpha, 1, &pixfmt_xrgb8888);
+}
+
+TARGET_SSSE3 static void xbgr8888_convert_ssse3(u8 *dst, u8 *bg, rgbcolor *src, int len, int add, u8 alpha)
+{
+	convert_ssse3(dst, bg, src, len, alpha, 0, &pixfmt_xbgr8888);
+}
+
+/*
+ * AVX2: same as SSE2, 8 pixels per iteration.  The unpack and pack
+ * instructions work within 128-bit lanes, so the pixel order is
+ * preserved.
+ */
+TARGET_AVX2 static inline __m256i div255_avx2(__m256i x)
+{
+	return _mm256_srli_epi16(_mm256_add_epi16(_mm256_add_epi16(x, _mm256_set1_epi16(1)),
+											  _mm256_srli_epi16(x, 8)), 8);
+}
+
+TARGET_AVX2 static inline __m256i mix_avx2(__m256i s, __m256i b, __m256i a)
+{
+	return div255_avx2(_mm256_add_epi16(
+			_mm256_mullo_epi16(b, _mm256_sub_epi16(_mm256_set1_epi16(255), a)),
+			_mm256_mullo_epi16(s, a)));
+}
+
+#define AVX2_SWAP_RB(x)	_mm256_shufflehi_epi16(_mm256_shufflelo_epi16(x, _MM_SHUFFLE(3,0,1,2)), _MM_SHUFFLE(3,0,1,2))
+#define AVX2_ALPHA(x)	_mm256_shufflehi_epi16(_mm256_shufflelo_epi16(x, _MM_SHUFFLE(3,3,3,3)), _MM_SHUFFLE(3,3,3,3))
+
+TARGET_AVX2 static inline void blend_avx2(u8 *dst, u8 *bg, rgbacolor *src,
+		int len, u8 opacity, const int swap, const pixfmt *base)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i rgb = _mm256_set1_epi32(0x00ffffff);
+	const __m256i op = _mm256_set1_epi16(opacity);
+	__m256i s, b, d, sl, sh, al, ah;
+	int i;
+
+	for (i = 0; i + 8 <= len; i += 8) {
+		s = _mm256_loadu_si256((__m256i*)(src + i));
+		b = _mm256_loadu_si256((__m256i*)(bg + 4*i));
+		d = _mm256_loadu_si256((__m256i*)(dst + 4*i));
+
+		sl = _mm256_unpacklo_epi8(s, zero);
+		sh = _mm256_unpackhi_epi8(s, zero);
+		if (swap) {
+			sl = AVX2_SWAP_RB(sl);
+			sh = AVX2_SWAP_RB(sh);
+		}
+
+		al = AVX2_ALPHA(sl);
+		ah = AVX2_ALPHA(sh);
+		if (opacity != 0xff) {
+			al = div255_avx2(_mm256_mullo_epi16(al, op));
+			ah = div255_avx2(_mm256_mullo_epi16(ah, op));
+		}
+
+		sl = mix_avx2(sl, _mm256_unpacklo_epi8(b, zero), al);
+		sh = mix_avx2(sh, _mm256_unpackhi_epi8(b, zero), ah);
+		s = _mm256_packus_epi16(sl, sh);
+
+		_mm256_storeu_si256((__m256i*)(dst + 4*i),
+				_mm256_or_si256(_mm256_and_si256(s, rgb), _mm256_andnot_si256(rgb, d)));
+	}
+
+	if (i < len)
+		blend_sse2(dst + 4*i, bg + 4*i, src + i, len - i, opacity, swap, base);
+}
+
+TARGET_AVX2 static void xrgb8888_blend_avx2(u8 *dst, u8 *bg, rgbacolor *src, int len, int add, u8 opacity)
+{
+	blend_avx2(dst, bg, src, len, opacity, 1, &pixfmt_xrgb8888);
+}
+
+TARGET_AVX2 static void xbgr8888_blend_avx2(u8 *dst, u8 *bg, rgbacolor *src, int len, int add, u8 opacity)
+{
+	blend_avx2(dst, bg, src, len, opacity, 0, &pixfmt_xbgr8888);
+}
+
+#endif /* PIXFMT_X86 */
+
+#ifdef PIXFMT_NEON
+
+/* NEON is part of the baseline if the compiler is allowed to use it. */
+static int cpu_neon(void)
+{
+	return 1;
+}
+
+/*
+ * NEON: 8 pixels per iteration, deinterleaved into one register per
+ * color component by the structure loads.
+ */
+static inline uint8x8_t div255_neon(uint16x8_t x)
+{
+	return vshrn_n_u16(vaddq_u16(vaddq_u16(x, vdupq_n_u16(1)), vshrq_n_u16(x, 8)), 8);
+}
+
+static inline uint8x8_t mix_neon(uint8x8_t s, uint8x8_t b, uint8x8_t a)
+{
+	return div255_neon(vmlal_u8(vmull_u8(b, vmvn_u8(a)), s, a));
+}
+
+static inline void blend_neon(u8 *dst, u8 *bg, rgbacolor *src,
+		int len, u8 opacity, const int swap, const pixfmt *base)
+{
+	uint8x8x4_t s, b, d;
+	uint8x8_t a;
+	int i;
+
+	for (i = 0; i + 8 <= len; i += 8) {
+		s = vld4_u8((u8*)(src + i));
+		b = vld4_u8(bg + 4*i);
+		d = vld4_u8(dst + 4*i);
+
+		a = s.val[3];
+		if (opacity != 0xff)
+			a = div255_neon(vmull_u8(a, vdup_n_u8(opacity)));
+
+		d.val[0] = mix_neon(s.val[swap ? 2 : 0], b.val[0], a);
+		d.val[1] = mix_neon(s.val[1], b.val[1], a);
+		d.val[2] = mix_neon(s.val[swap ? 0 : 2], b.val[2], a);
+		vst4_u8(dst + 4*i, d);
+	}
+
+	if (i < len)
+		base->blend(dst + 4*i, bg + 4*i, src + i, len - i, 0, opacity);
+}
+
+static inline void convert_neon(u8 *dst, u8 *bg, rgbcolor *src,
+		int len, u8 alpha, const int swap, const pixfmt *base)
+{
+	uint8x8x3_t s;
+	uint8x8x4_t b, d;
+	uint8x8_t a = vdup_n_u8(alpha);
+	int i;
+
+	for (i = 0; i + 8 <= len; i += 8) {
+		s = vld3_u8((u8*)(src + i));
+		d = vld4_u8(dst + 4*i);
+
+		if (alpha == 0xff) {
+			d.val[0] = s.val[swap ? 2 : 0];
+			d.val[1] = s.val[1];
+			d.val[2] = s.val[swap ? 0 : 2];
+		} else {
+			b = vld4_u8(bg + 4*i);
+			d.val[0] = mix_neon(s.val[swap ? 2 : 0], b.val[0], a);
+			d.val[1] = mix_neon(s.val[1], b.val[1], a);
+			d.val[2] = mix_neon(s.val[swap ? 0 : 2], b.val[2], a);
+		}
+		vst4_u8(dst + 4*i, d);
+	}
+
+	if (i < len)
+		base->convert(dst + 4*i, bg + 4*i, src + i, len - i, 0, alpha);
+}
+
+static void xrgb8888_blend_neon(u8 *dst, u8 *bg, rgbacolor *src, int len, int add, u8 opacity)
+{
+	blend_neon(dst, bg, src, len, opacity, 1, &pixfmt_xrgb8888);
+}
+
+static void xbgr8888_blend_neon(u8 *dst, u8 *bg, rgbacolor *src, int len, int add, u8 opacity)
+{
+	blend_neon(dst, bg, src, len, opacity, 0, &pixfmt_xbgr8888);
+}
+
+static void xrgb8888_convert_neon(u8 *dst, u8 *bg, rgbcolor *src, int len, int add, u8 alpha)
+{
+	convert_neon(dst, bg, src, len, alpha, 1, &pixfmt_xrgb8888);
+}
+
+static void xbgr8888_convert_neon(u8 *dst, u8 *bg, rgbcolor *src, int len, int add, u8 alpha)
+{
+	convert_neon(dst, bg, src, len, alpha, 0, &pixfmt_xbgr8888);
+}
+
+#endif /* PIXFMT_NEON */
+
+/*
+ * Sorted by preference, the last entry supported by the CPU is used by
+ * pixfmt_select().
+ */
+const pixfmt_accel pixfmt_accels[] = {
+#ifdef PIXFMT_X86
+	{ "XRGB8888/SSE2",  &pixfmt_xrgb8888, cpu_sse2,  xrgb8888_blend_sse2, NULL },
+	{ "XBGR8888/SSE2",  &pixfmt_xbgr8888, cpu_sse2,  xbgr8888_blend_sse2, NULL },
+	{ "XRGB8888/SSSE3", &pixfmt_xrgb8888, cpu_ssse3, xrgb8888_blend_sse2, xrgb8888_convert_ssse3 },
+	{ "XBGR8888/SSSE3", &pixfmt_xbgr8888, cpu_ssse3, xbgr8888_blend_sse2, xbgr8888_convert_ssse3 },
+	{ "XRGB8888/AVX2",  &pixfmt_xrgb8888, cpu_avx2,  xrgb8888_blend_avx2, xrgb8888_convert_ssse3 },
+	{ "XBGR8888/AVX2",  &pixfmt_xbgr8888, cpu_avx2,  xbgr8888_blend_avx2, xbgr8888_convert_ssse3 },
+#endif
+#ifdef PIXFMT_NEON
+	{ "XRGB8888/NEON",  &pixfmt_xrgb8888, cpu_neon,  xrgb8888_blend_neon, xrgb8888_convert_neon },
+	{ "XBGR8888/NEON",  &pixfmt_xbgr8888, cpu_neon,  xbgr8888_blend_neon, xbgr8888_convert_neon },
+#endif
+	{ NULL }
+};
@@ -0,0 +1,293 @@
+/*
+ * pool.c - A pool of worker threads.
+ *
+ * Copyright (C) 2004-2008, Michal Januszewski <spock@gentoo.org>
+ *
+ * This file is subject to the terms and conditions of the GNU General Public
+ * License v2.  See the file COPYING in the main directory of this archive for
+ * more details.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "common.h"
+#include "render.h"
+
+/*
+ * A job is a range of lines of the screen.  It is cut into horizontal
+ * bands, which are processed in parallel by the worker threads and by
+ * the thread which submitted the job.  There are several bands per
+ * thread, so that a band which takes longer (e.g. because it contains
+ * more objects) doesn't keep the other threads idle.
+ *
+ * The pool is also used to run sets of independent tasks, such as loading
+ * the images and fonts of a theme.  Every task is then a single band.
+ *
+ * The pool is only used when config.threads is not 1, and the threads
+ * are created when the first job large enough to be worth it is
+ * submitted.  In the kernel helper, everything is done serially.
+ */
+
+#define POOL_MAX_THREADS	32
+#define POOL_BANDS			4		/* bands per thread */
+#define POOL_MIN_PIXELS		(64 * 1024)	/* smaller jobs are not split */
+#define POOL_MIN_LINES		8		/* minimum height of a band */
+
+#ifndef TARGET_KERNEL
+#include <pthread.h>
+
+static struct {
+	pthread_t th[POOL_MAX_THREADS];
+	int num;					/* number of worker threads */
+	pid_t pid;					/* process in which the threads live */
+	bool failed;
+
+	pthread_mutex_t mtx;
+	pthread_cond_t cnd_work;
+	pthread_cond_t cnd_done;
+	unsigned int gen;			/* incremented for every job */
+	bool quit;
+
+	/* The current job. */
+	pool_fn fn;
+	void *data;
+	int y1, y2;
+	int bands, next, done;
+} pool = {
+	.mtx = PTHREAD_MUTEX_INITIALIZER,
+	.cnd_work = PTHREAD_COND_INITIALIZER,
+	.cnd_done = PTHREAD_COND_INITIALIZER,
+};
+
+static pthread_mutex_t mtx_serial = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Process bands of the current job until there are none left.
+ * Has to be called with pool.mtx held.
+ */
+static void pool_work(void)
+{
+	int b, y1, y2, h;
+
+	while (pool.next < pool.bands) {
+		b = pool.next++;
+		h = pool.y2 - pool.y1 + 1;
+		y1 = pool.y1 + h * b / pool.bands;
+		y2 = pool.y1 + h * (b + 1) / pool.bands - 1;
+
+		pthread_mutex_unlock(&pool.mtx);
+		pool.fn(pool.data, y1, y2);
+		pthread_mutex_lock(&pool.mtx);
+
+		if (++pool.done == pool.bands)
+			pthread_cond_signal(&pool.cnd_done);
+	}
+}
+
+static void *pool_thread(void *unused)
+{
+	unsigned int gen;
+
+	pthread_mutex_lock(&pool.mtx);
+	gen = pool.gen;
+	while (1) {
+		while (pool.gen == gen && !pool.quit)
+			pthread_cond_wait(&pool.cnd_work, &pool.mtx);
+
+		if (pool.quit)
+			break;
+
+		gen = pool.gen;
+		pool_work();
+	}
+	pthread_mutex_unlock(&pool.mtx);
+
+	return NULL;
+}
+
+/*
+ * Start the worker threads.
+ *
+ * @return The number of threads available for processing jobs,
+ *         including the calling one.
+ */
+static int pool_start(void)
+{
+	int n = config.threads;
+
+	if (pool.num && pool.pid == getpid())
+		return pool.num + 1;
+
+	/* Threads are not inherited by child processes (e.g. the daemon
+	 * after going into background), so they have to be started again. */
+	if (pool.num) {
+		pool.num = 0;
+		pthread_mutex_init(&pool.mtx, NULL);
+		pthread_cond_init(&pool.cnd_work, NULL);
+		pthread_cond_init(&pool.cnd_done, NULL);
+		pthread_mutex_init(&mtx_serial, NULL);
+	}
+
+	if (pool.failed)
+		return 1;
+
+	if (n == 0) {
+		n = sysconf(_SC_NPROCESSORS_ONLN);
+		if (n < 1)
+			n = 1;
+	}
+
+	if (n > POOL_MAX_THREADS + 1)
+		n = POOL_MAX_THREADS + 1;
+
+	pool.pid = getpid();
+	pool.quit = false;
+
+	for (pool.num = 0; pool.num < n - 1; pool.num++) {
+		if (pthread_create(&pool.th[pool.num], NULL, pool_thread, NULL)) {
+			iprint(MSG_WARN, "Failed to start a rendering thread.\n");
+			break;
+		}
+	}
+
+	if (!pool.num)
+		pool.failed = true;
+
+	return pool.num + 1;
+}
+
+/*
+ * Split the lines y1..y2 into 'bands' bands and process them using
+ * all available threads.
+ */
+static void pool_submit(pool_fn fn, void *data, int y1, int y2, int bands)
+{
+	pthread_mutex_lock(&pool.mtx);
+	pool.fn = fn;
+	pool.data = data;
+	pool.y1 = y1;
+	pool.y2 = y2;
+	pool.bands = bands;
+	pool.next = 0;
+	pool.done = 0;
+	pool.gen++;
+	pthread_cond_broadcast(&pool.cnd_work);
+
+	pool_work();
+
+	while (pool.done < pool.bands)
+		pthread_cond_wait(&pool.cnd_done, &pool.mtx);
+	pthread_mutex_unlock(&pool.mtx);
+}
+
+/**
+ * Process a range of lines, in parallel if possible.
+ *
+ * @param fn Function called for every band of the range, with the first
+ *           and the last line of the band.  Bands don't overlap, and the
+ *           function can be called for several bands at the same time.
+ * @param data Argument passed to fn.
+ * @param y1 The first line of the range.
+ * @param y2 The last line of the range.
+ * @param pixels Approximate number of pixels to be processed.  Small jobs
+ *               are processed serially in the calling thread.
+ */
+void pool_run(pool_fn fn, void *data, int y1, int y2, int pixels)
+{
+	int n;
+
+	if (y2 < y1)
+		return;
+
+	if ((config.threads == 1) || pixels < POOL_MIN_PIXELS ||
+		(y2 - y1 + 1) < 2 * POOL_MIN_LINES || (n = pool_start()) == 1) {
+		fn(data, y1, y2);
+		return;
+	}
+
+	pool_submit(fn, data, y1, y2, min(n * POOL_BANDS, (y2 - y1 + 1) / POOL_MIN_LINES));
+}
+
+/**
+ * Run a set of independent tasks, in parallel if possible.
+ *
+ * @param fn Function called once for every task, with both line
+ *           arguments set to the index of the task.  Tasks are started
+ *           in the order of their indices.
+ * @param data Argument passed to fn.
+ * @param num Number of tasks.
+ */
+void pool_tasks(pool_fn fn, void *data, int num)
+{
+	int k;
+
+	if (num <= 0)
+		return;
+
+	if (config.threads == 1 || num == 1 || pool_start() == 1) {
+		for (k = 0; k < num; k++)
+			fn(data, k, k);
+		return;
+	}
+
+	pool_submit(fn, data, 0, num - 1, num);
+}
+
+/**
+ * Stop the worker threads.
+ */
+void pool_free(void)
+{
+	int i;
+
+	if (!pool.num || pool.pid != getpid())
+		return;
+
+	pthread_mutex_lock(&pool.mtx);
+	pool.quit = true;
+	pthread_cond_broadcast(&pool.cnd_work);
+	pthread_mutex_unlock(&pool.mtx);
+
+	for (i = 0; i < pool.num; i++)
+		pthread_join(pool.th[i], NULL);
+
+	pool.num = 0;
+}
+
+/**
+ * Serialize code which cannot be run by several bands at the same time.
+ */
+void pool_lock(void)
+{
+	pthread_mutex_lock(&mtx_serial);
+}
+
+void pool_unlock(void)
+{
+	pthread_mutex_unlock(&mtx_serial);
+}
+
+#else /* TARGET_KERNEL */
+
+void pool_run(pool_fn fn, void *data, int y1, int y2, int pixels)
+{
+	if (y2 >= y1)
+		fn(data, y1, y2);
+}
+
+void pool_tasks(pool_fn fn, void *data, int num)
+{
+	int k;
+
+	for (k = 0; k < num; k++)
+		fn(data, k, k);
+}
+
+void pool_free(void) { }
+void pool_lock(void) { }
+void pool_unlock(void) { }
+
+#endif /* TARGET_KERNEL */
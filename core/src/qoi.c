@@ -0,0 +1,262 @@
+/*
+ * qoi.c - Decoder and encoder for images in the QOI format
+ *
+ * Copyright (C) 2004-2008, Michal Januszewski <spock@gentoo.org>
+ *
+ * This file is subject to the terms and conditions of the GNU General Public
+ * License v2.  See the file COPYING in the main directory of this archive for
+ * more details.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "common.h"
+#include "qoi.h"
+
+/*
+ * A QOI file is a 14 byte header (magic, big-endian width and height,
+ * number of channels, colorspace), followed by a stream of operations,
+ * each of which produces one or more pixels, and an end marker.  Every
+ * operation either repeats the previous pixel, picks a recently seen
+ * pixel from a 64-entry hash table, encodes a small difference to the
+ * previous pixel, or stores the pixel verbatim.
+ */
+#define QOI_OP_INDEX	0x00	/* 00xxxxxx */
+#define QOI_OP_DIFF		0x40	/* 01xxxxxx */
+#define QOI_OP_LUMA		0x80	/* 10xxxxxx */
+#define QOI_OP_RUN		0xc0	/* 11xxxxxx */
+#define QOI_OP_RGB		0xfe	/* 11111110 */
+#define QOI_OP_RGBA		0xff	/* 11111111 */
+#define QOI_MASK		0xc0
+
+#define QOI_HASH(c)		(((c)[0] * 3 + (c)[1] * 5 + (c)[2] * 7 + (c)[3] * 11) & 63)
+
+/* Maximum size of an image (in both dimensions) accepted by the decoder. */
+#define QOI_MAX_SIZE	16384
+
+static inline unsigned int get_be32(const u8 *p)
+{
+	return ((unsigned int)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static inline void put_be32(u8 *p, unsigned int v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+/**
+ * Prepare the decoding of a QOI image.
+ *
+ * @param buf The whole QOI file.
+ * @param len Length of the file.
+ *
+ * @return 0 on success, -1 if the file is not a valid QOI image.
+ */
+int qoi_dec_init(struct qoi_dec *d, const u8 *buf, size_t len)
+{
+	if (len < QOI_HEADER_SIZE + QOI_PADDING || memcmp(buf, QOI_MAGIC, 4))
+		return -1;
+
+	d->w = get_be32(buf + 4);
+	d->h = get_be32(buf + 8);
+	d->channels = buf[12];
+
+	if (d->w == 0 || d->h == 0 || d->w > QOI_MAX_SIZE || d->h > QOI_MAX_SIZE ||
+		(d->channels != 3 && d->channels != 4))
+		return -1;
+
+	d->p = buf + QOI_HEADER_SIZE;
+	d->end = buf + len - QOI_PADDING;
+	d->run = 0;
+	memset(d->index, 0, sizeof(d->index));
+	d->px[0] = d->px[1] = d->px[2] = 0;
+	d->px[3] = 0xff;
+	return 0;
+}
+
+/*
+ * The state of the decoder is kept in local variables while decoding
+ * a line, and 'n' is a constant in both instances of this function.
+ * A truncated stream repeats the last pixel instead of reading past
+ * its end (the end marker leaves room for the longest operation).
+ */
+static inline void qoi_dec_line_n(struct qoi_dec *d, u8 *out, const int n)
+{
+	const u8 *p = d->p, *end = d->end;
+	unsigned int x;
+	int run = d->run;
+	u8 px[4];
+
+	memcpy(px, d->px, 4);
+
+	for (x = 0; x < d->w; x++, out += n) {
+		if (run > 0) {
+			run--;
+		} else if (p < end) {
+			int b = *p++;
+
+			if (b == QOI_OP_RGB) {
+				px[0] = p[0];
+				px[1] = p[1];
+				px[2] = p[2];
+				p += 3;
+			} else if (b == QOI_OP_RGBA) {
+				memcpy(px, p, 4);
+				p += 4;
+			} else {
+				switch (b & QOI_MASK) {
+				case QOI_OP_INDEX:
+					memcpy(px, d->index[b], 4);
+					break;
+
+				case QOI_OP_DIFF:
+					px[0] += ((b >> 4) & 3) - 2;
+					px[1] += ((b >> 2) & 3) - 2;
+					px[2] += (b & 3) - 2;
+					break;
+
+				case QOI_OP_LUMA:
+				{
+					int b2 = *p++;
+					int vg = (b & 0x3f) - 32;
+
+					px[0] += vg - 8 + ((b2 >> 4) & 0x0f);
+					px[1] += vg;
+					px[2] += vg - 8 + (b2 & 0x0f);
+					break;
+				}
+
+				default:
+					run = b & 0x3f;
+					break;
+				}
+			}
+
+			memcpy(d->index[QOI_HASH(px)], px, 4);
+		}
+
+		out[0] = px[0];
+		out[1] = px[1];
+		out[2] = px[2];
+		if (n == 4)
+			out[3] = px[3];
+	}
+
+	d->p = p;
+	d->run = run;
+	memcpy(d->px, px, 4);
+}
+
+/**
+ * Decode the next line of a QOI image.
+ *
+ * @param out Buffer for the line, w * bytespp bytes long.
+ * @param bytespp 3 for RGB, 4 for RGBA output.  The alpha channel
+ *                of RGB images is always 0xff.
+ */
+void qoi_dec_line(struct qoi_dec *d, u8 *out, int bytespp)
+{
+	if (bytespp == 4)
+		qoi_dec_line_n(d, out, 4);
+	else
+		qoi_dec_line_n(d, out, 3);
+}
+
+/**
+ * Encode an image in the QOI format.
+ *
+ * @param rgba The image, as RGBA pixels.
+ * @param alpha Store the alpha channel?  If not set, the image is
+ *              assumed to be opaque.
+ * @param len Set to the length of the encoded image.
+ *
+ * @return The encoded image (to be freed by the caller), or NULL
+ *         if memory could not be allocated.
+ */
+u8 *qoi_encode(const u8 *rgba, unsigned int w, unsigned int h, bool alpha, size_t *len)
+{
+	u8 index[64][4], prev[4] = { 0, 0, 0, 0xff }, px[4];
+	size_t i, npx = (size_t)w * h;
+	int run = 0;
+	u8 *out, *p;
+
+	out = malloc(npx * (alpha ? 5 : 4) + QOI_HEADER_SIZE + QOI_PADDING);
+	if (!out)
+		return NULL;
+
+	memcpy(out, QOI_MAGIC, 4);
+	put_be32(out + 4, w);
+	put_be32(out + 8, h);
+	out[12] = alpha ? 4 : 3;
+	out[13] = 0;				/* sRGB with linear alpha */
+	p = out + QOI_HEADER_SIZE;
+
+	memset(index, 0, sizeof(index));
+
+	for (i = 0; i < npx; i++, rgba += 4) {
+		int k;
+
+		px[0] = rgba[0];
+		px[1] = rgba[1];
+		px[2] = rgba[2];
+		px[3] = alpha ? rgba[3] : 0xff;
+
+		if (!memcmp(px, prev, 4)) {
+			if (++run == 62 || i == npx - 1) {
+				*p++ = QOI_OP_RUN | (run - 1);
+				run = 0;
+			}
+			continue;
+		}
+
+		if (run) {
+			*p++ = QOI_OP_RUN | (run - 1);
+			run = 0;
+		}
+
+		k = QOI_HASH(px);
+		if (!memcmp(index[k], px, 4)) {
+			*p++ = QOI_OP_INDEX | k;
+		} else if (px[3] != prev[3]) {
+			memcpy(index[k], px, 4);
+			*p++ = QOI_OP_RGBA;
+			memcpy(p, px, 4);
+			p += 4;
+		} else {
+			signed char vr = px[0] - prev[0];
+			signed char vg = px[1] - prev[1];
+			signed char vb = px[2] - prev[2];
+			signed char vg_r = vr - vg;
+			signed char vg_b = vb - vg;
+
+			memcpy(index[k], px, 4);
+
+			if (vr > -3 && vr < 2 && vg > -3 && vg < 2 && vb > -3 && vb < 2) {
+				*p++ = QOI_OP_DIFF | (vr + 2) << 4 | (vg + 2) << 2 | (vb + 2);
+			} else if (vg_r > -9 && vg_r < 8 && vg > -33 && vg < 32 &&
+					   vg_b > -9 && vg_b < 8) {
+				*p++ = QOI_OP_LUMA | (vg + 32);
+				*p++ = (vg_r + 8) << 4 | (vg_b + 8);
+			} else {
+				*p++ = QOI_OP_RGB;
+				*p++ = px[0];
+				*p++ = px[1];
+				*p++ = px[2];
+			}
+		}
+
+		memcpy(prev, px, 4);
+	}
+
+	/* End marker. */
+	memset(p, 0, QOI_PADDING - 1);
+	p[QOI_PADDING - 1] = 1;
+	p += QOI_PADDING;
+
+	*len = p - out;
+	return out;
+}
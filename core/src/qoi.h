@@ -0,0 +1,28 @@
+#ifndef _QOI_H
+#define _QOI_H
+
+/*
+ * The QOI image format ("Quite OK Image", see https://qoiformat.org),
+ * a lossless format for RGB and RGBA images that is much faster to
+ * decode than PNG.
+ */
+#define QOI_MAGIC			"qoif"
+#define QOI_HEADER_SIZE		14
+#define QOI_PADDING			8		/* size of the end marker */
+
+/* State of a decoder, which produces one line of the image at a time. */
+struct qoi_dec {
+	const u8 *p;			/* next byte of the data stream */
+	const u8 *end;			/* end of the data stream, without the end marker */
+	u8 px[4];				/* previous pixel */
+	u8 index[64][4];		/* recently seen pixels */
+	int run;				/* number of times px is still to be repeated */
+	unsigned int w, h;
+	u8 channels;			/* 3 (RGB) or 4 (RGBA) */
+};
+
+int qoi_dec_init(struct qoi_dec *d, const u8 *buf, size_t len);
+void qoi_dec_line(struct qoi_dec *d, u8 *out, int bytespp);
+u8 *qoi_encode(const u8 *rgba, unsigned int w, unsigned int h, bool alpha, size_t *len);
+
+#endif /* _QOI_H */
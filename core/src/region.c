@@ -0,0 +1,257 @@
+/*
+ * region.c - Operations on sets of non-overlapping rectangles.
+ *
+ * Copyright (C) 2004-2008, Michal Januszewski <spock@gentoo.org>
+ *
+ * This file is subject to the terms and conditions of the GNU General Public
+ * License v2.  See the file COPYING in the main directory of this archive for
+ * more details.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include "common.h"
+#include "render.h"
+
+/*
+ * All operations are done by sweeping the two input regions from top to
+ * bottom.  The sweep stops at every line where a band of either region
+ * starts or ends, and the x spans of the current bands of both regions
+ * are combined according to a truth table.  The resulting band is then
+ * either appended to the output or coalesced with the band above it.
+ */
+
+#define IN_A	2
+#define IN_B	1
+
+static const int region_ops[] = {
+	[REGION_UNION]     = (1 << (IN_A | IN_B)) | (1 << IN_A) | (1 << IN_B),
+	[REGION_SUBTRACT]  = (1 << IN_A),
+	[REGION_INTERSECT] = (1 << (IN_A | IN_B)),
+};
+
+/* The x coordinate of the e-th edge of a list of spans. */
+#define EDGE(s, e)	(((e) & 1) ? (s)[(e) >> 1].x2 + 1 : (s)[(e) >> 1].x1)
+
+static int region_reserve(region *r, int n)
+{
+	rect *t;
+	int size;
+
+	if (n <= r->size)
+		return 0;
+
+	size = max(max(n, r->size * 2), 16);
+	t = realloc(r->rects, size * sizeof(rect));
+	if (!t)
+		return -1;
+
+	r->rects = t;
+	r->size = size;
+	return 0;
+}
+
+/**
+ * Find the index of the first rect of the band following the band
+ * which contains rect 'i'.
+ */
+static int band_next(region *r, int i)
+{
+	int y1 = r->rects[i].y1;
+
+	while (i < r->num && r->rects[i].y1 == y1)
+		i++;
+
+	return i;
+}
+
+/**
+ * Find the spans of a region at line 'y'.
+ *
+ * @param r The region to search.
+ * @param i Index of the band to start the search at.  Updated so that
+ *          subsequent calls for lines below 'y' can continue from there.
+ * @param y The line to look at.
+ * @param s Set to the first span at line 'y'.
+ * @param n Set to the number of spans at line 'y'.
+ *
+ * @return The last line for which the same spans are valid.
+ */
+static int band_at(region *r, int *i, int y, rect **s, int *n)
+{
+	while (*i < r->num && r->rects[*i].y2 < y)
+		*i = band_next(r, *i);
+
+	*s = NULL;
+	*n = 0;
+
+	if (*i >= r->num)
+		return INT_MAX;
+
+	if (r->rects[*i].y1 > y)
+		return r->rects[*i].y1 - 1;
+
+	*s = r->rects + *i;
+	*n = band_next(r, *i) - *i;
+	return r->rects[*i].y2;
+}
+
+/**
+ * Combine two lists of spans, and append the result to a region
+ * as a new band spanning the lines y1..y2.
+ */
+static int spans_op(region *res, rect *sa, int na, rect *sb, int nb,
+		int y1, int y2, int mask)
+{
+	int ea = 0, eb = 0, in = 0, x, xs = 0;
+	int now, was = 0;
+	rect *re;
+
+	while (ea < 2 * na || eb < 2 * nb) {
+		x = INT_MAX;
+		if (ea < 2 * na)
+			x = EDGE(sa, ea);
+		if (eb < 2 * nb)
+			x = min(x, EDGE(sb, eb));
+
+		while (ea < 2 * na && EDGE(sa, ea) == x) {
+			in ^= IN_A;
+			ea++;
+		}
+
+		while (eb < 2 * nb && EDGE(sb, eb) == x) {
+			in ^= IN_B;
+			eb++;
+		}
+
+		now = (mask >> in) & 1;
+		if (now && !was) {
+			xs = x;
+		} else if (!now && was) {
+			if (region_reserve(res, res->num + 1))
+				return -1;
+
+			re = res->rects + res->num++;
+			re->x1 = xs;
+			re->x2 = x - 1;
+			re->y1 = y1;
+			re->y2 = y2;
+		}
+		was = now;
+	}
+
+	return 0;
+}
+
+/**
+ * Compute a union, difference or intersection of two regions.
+ *
+ * @param dst The region where the result is to be stored.  Can be the
+ *            same as 'a' or 'b'.
+ * @param a The first operand.
+ * @param b The second operand.
+ * @param op The operation to perform.
+ *
+ * @return 0 on success, -1 if memory allocation failed, in which
+ *         case 'dst' is left unchanged.
+ */
+int region_op(region *dst, region *a, region *b, enum region_op op)
+{
+	region res;
+	rect *sa, *sb;
+	int ia = 0, ib = 0, na, nb, ya, yb, y, ye, k;
+	int start, prev = 0, nprev = 0;
+
+	/* Build the result in the spare buffer of 'dst', so that no memory
+	 * has to be allocated once the buffers are large enough. */
+	region_init(res);
+	res.rects = dst->spare;
+	res.size = dst->spare_size;
+
+	y = INT_MAX;
+	if (a->num)
+		y = a->rects[0].y1;
+	if (b->num)
+		y = min(y, b->rects[0].y1);
+
+	while (ia < a->num || ib < b->num) {
+		ya = band_at(a, &ia, y, &sa, &na);
+		yb = band_at(b, &ib, y, &sb, &nb);
+
+		if (ia >= a->num && ib >= b->num)
+			break;
+
+		ye = min(ya, yb);
+		start = res.num;
+
+		if (spans_op(&res, sa, na, sb, nb, y, ye, region_ops[op])) {
+			dst->spare = res.rects;
+			dst->spare_size = res.size;
+			return -1;
+		}
+
+		/* Coalesce the new band with the previous one if both have
+		 * the same x spans and there is no gap between them. */
+		if (res.num - start > 0 && res.num - start == nprev &&
+			res.rects[prev].y2 == y - 1) {
+			for (k = 0; k < nprev; k++) {
+				if (res.rects[prev + k].x1 != res.rects[start + k].x1 ||
+					res.rects[prev + k].x2 != res.rects[start + k].x2)
+					break;
+			}
+
+			if (k == nprev) {
+				for (k = 0; k < nprev; k++)
+					res.rects[prev + k].y2 = ye;
+				res.num = start;
+			} else {
+				prev = start;
+			}
+		} else if (res.num - start > 0) {
+			prev = start;
+			nprev = res.num - start;
+		}
+
+		y = ye + 1;
+	}
+
+	dst->spare = dst->rects;
+	dst->spare_size = dst->size;
+	dst->rects = res.rects;
+	dst->size = res.size;
+	dst->num = res.num;
+	return 0;
+}
+
+/**
+ * Compute a union, difference or intersection of a region and a rect.
+ *
+ * The result is stored in 'r'.  Empty rects (x2 < x1 or y2 < y1) are
+ * valid and represent an empty set of pixels.
+ *
+ * @return 0 on success, -1 if memory allocation failed.
+ */
+int region_op_rect(region *r, rect *re, enum region_op op)
+{
+	region t;
+
+	region_init(t);
+	t.rects = re;
+	t.size = 1;
+	t.num = (re->x2 < re->x1 || re->y2 < re->y1) ? 0 : 1;
+
+	return region_op(r, r, &t, op);
+}
+
+/**
+ * Free all memory used by a region, and make it empty.
+ */
+void region_free(region *r)
+{
+	free(r->rects);
+	free(r->spare);
+	region_init(*r);
+}
@@ -111,27 +111,12 @@ inline void put_pixel(u8 a, u8 r, u8 g, u8 b, u8 *src, u8 *dst, u8 add)
 /* Converts a RGBA/RGB image to whatever format the framebuffer uses */
 void rgba2fb(rgbacolor* data, u8 *bg, u8* out, int len, int y, u8 alpha, u8 opacity)
 {
-	int i, add = 0;
-	rgbcolor* rgb = (rgbcolor*)data;
-
-	add ^= (0 ^ y) & 1 ? 1 : 3;
-
-	for (i = 0; i < len; i++) {
-		if (alpha) {
-			if (opacity == 0xff)
-				put_pixel(data->a, data->r, data->g, data->b, bg, out, add);
-			else
-				put_pixel(opacity * data->a / 255, data->r, data->g, data->b, bg, out, add);
-			data++;
-		} else {
-			put_pixel(opacity, rgb->r, rgb->g, rgb->b, bg, out, add);
-			rgb++;
-		}
+	int add = (y & 1) ? 1 : 3;
 
-		out += fbd.bytespp;
-		bg += fbd.bytespp;
-		add ^= 3;
-	}
+	if (alpha)
+		fbd.pf->blend(out, bg, data, len, add, opacity);
+	else
+		fbd.pf->convert(out, bg, (rgbcolor*)data, len, add, opacity);
 }
 
 void blit(u8 *src, rect *bnd, int src_w, u8 *dst, int x, int y, int dst_w)
@@ -249,61 +234,41 @@ void rect_sanitize(stheme_t *theme, rect *re)
 }
 
 /**
- * Add a rect to the re-blit list.
+ * Add a rect to the re-blit region.
  *
  * @param theme The theme for which the rect is to be added.
  * @param a The rect to be added.
  */
 void blit_add(stheme_t *theme, rect *a)
 {
-	rect *re = malloc(sizeof(rect));
-	if (!re)
-		return;
+	rect re;
 
-	memcpy(re, a, sizeof(rect));
+	memcpy(&re, a, sizeof(rect));
 
 	/*
 	 * TODO: Possibly remove this call when the whole module
 	 * is properly unittested and we're sure no pathological situations
 	 * can arise.
 	 */
-	rect_sanitize(theme, re);
+	rect_sanitize(theme, &re);
 
-	list_add(&theme->blit, re);
+	region_op_rect(&theme->blit, &re, REGION_UNION);
 }
 
 /**
- * Normalize the re-blit list.
+ * Change the bounding rect of an object.
  *
- * Collapse rects that contain each other into single items.
- *
- * TODO: normalize partially overlapping rects.
+ * @param theme The theme to which the object belongs.
+ * @param o The object.
+ * @param re The new bounding rect.
  */
-void blit_normalize(stheme_t *theme)
+void obj_bnd_set(stheme_t *theme, obj *o, rect *re)
 {
-	item *i, *j, *prev;
-	rect *a, *b;
-
-	for (i = theme->blit.head; i; i = i->next) {
-start:	a = i->p;
-		prev = i;
-
-		for (j = i->next; j; j = j->next) {
-			b = j->p;
-
-			if (rect_contains(a, b)) {
-				list_del(&theme->blit, prev, j);
-				free(b);
-				j = prev;
-			} else if (rect_contains(b, a)) {
-				i->p = b;
-				list_del(&theme->blit, prev, j);
-				free(a);
-				goto start;
-			}
-			prev = j;
-		}
-	}
+	rect old;
+
+	memcpy(&old, &o->bnd, sizeof(rect));
+	memcpy(&o->bnd, re, sizeof(rect));
+	objgrid_update(theme, o, &old);
 }
 
 void render_add(stheme_t *theme, obj *o, rect *a)
@@ -396,85 +361,83 @@ void box_prerender(stheme_t *theme, box *b, bool force)
 	obj *o = container_of(b);
 
 	if (b->attr & BOX_INTER) {
-		box *tb = malloc(sizeof(box));
-		if (!tb)
-			return;
+		box tb;
 
-		box_interpolate(b, b->inter, tb);
+		/* Clear the padding and the unused pointers, so that the box
+		 * can be compared with memcmp(). */
+		memset(&tb, 0, sizeof(box));
+		box_interpolate(b, b->inter, &tb);
 
 		/* No change since last time? */
-		if (!memcmp(tb, b->curr, sizeof(box)) && !force) {
-			free(tb);
+		if (!memcmp(&tb, b->curr, sizeof(box)) && !force)
 			return;
-		}
 
 		/*
 		 * In the case of horizontal and vertical gradients, or solid boxes,
 		 * optimize the rendering process by only rendering the new part of
 		 * the box.
 		 */
-		if (b->attr & (BOX_VGRAD | BOX_SOLID) && b->curr->re.y1 == tb->re.y1 && b->curr->re.y2 == tb->re.y2 && !force) {
+		if (b->attr & (BOX_VGRAD | BOX_SOLID) && b->curr->re.y1 == tb.re.y1 && b->curr->re.y2 == tb.re.y2 && !force) {
 			rect re;
 
-			re.y1 = tb->re.y1;
-			re.y2 = tb->re.y2;
+			re.y1 = tb.re.y1;
+			re.y2 = tb.re.y2;
 
-			if (b->curr->re.x1 != tb->re.x1) {
-				re.x1 = min(b->curr->re.x1, tb->re.x1);
-				re.x2 = max(b->curr->re.x1, tb->re.x1);
+			if (b->curr->re.x1 != tb.re.x1) {
+				re.x1 = min(b->curr->re.x1, tb.re.x1);
+				re.x2 = max(b->curr->re.x1, tb.re.x1);
 				blit_add(theme, &re);
 				render_add(theme, o, &re);
 			}
 
-			if (b->curr->re.x2 != tb->re.x2) {
-				re.x1 = min(b->curr->re.x2, tb->re.x2);
-				re.x2 = max(b->curr->re.x2, tb->re.x2);
+			if (b->curr->re.x2 != tb.re.x2) {
+				re.x1 = min(b->curr->re.x2, tb.re.x2);
+				re.x2 = max(b->curr->re.x2, tb.re.x2);
 				blit_add(theme, &re);
 				render_add(theme, o, &re);
 			}
 
-			if (memcmp(&tb->re, &o->bnd, sizeof(rect))) {
-				memcpy(&o->bnd, &tb->re, sizeof(rect));
+			if (memcmp(&tb.re, &o->bnd, sizeof(rect))) {
+				obj_bnd_set(theme, o, &tb.re);
 			}
 
-		} else if (b->attr & (BOX_HGRAD | BOX_SOLID) && b->curr->re.x1 == tb->re.x1 && b->curr->re.x2 == tb->re.x2 && !force) {
+		} else if (b->attr & (BOX_HGRAD | BOX_SOLID) && b->curr->re.x1 == tb.re.x1 && b->curr->re.x2 == tb.re.x2 && !force) {
 			rect re;
 
-			re.x1 = tb->re.x1;
-			re.x2 = tb->re.x2;
+			re.x1 = tb.re.x1;
+			re.x2 = tb.re.x2;
 
-			if (b->curr->re.y1 != tb->re.y1) {
-				re.y1 = min(b->curr->re.y1, tb->re.y1);
-				re.y2 = max(b->curr->re.y1, tb->re.y1);
+			if (b->curr->re.y1 != tb.re.y1) {
+				re.y1 = min(b->curr->re.y1, tb.re.y1);
+				re.y2 = max(b->curr->re.y1, tb.re.y1);
 				blit_add(theme, &re);
 				render_add(theme, o, &re);
 			}
 
-			if (b->curr->re.y2 != tb->re.y2) {
-				re.y1 = min(b->curr->re.y2, tb->re.y2);
-				re.y2 = max(b->curr->re.y2, tb->re.y2);
+			if (b->curr->re.y2 != tb.re.y2) {
+				re.y1 = min(b->curr->re.y2, tb.re.y2);
+				re.y2 = max(b->curr->re.y2, tb.re.y2);
 				blit_add(theme, &re);
 				render_add(theme, o, &re);
 			}
 
-			if (memcmp(&tb->re, &o->bnd, sizeof(rect))) {
-				memcpy(&o->bnd, &tb->re, sizeof(rect));
+			if (memcmp(&tb.re, &o->bnd, sizeof(rect))) {
+				obj_bnd_set(theme, o, &tb.re);
 			}
 		/* Render the whole box without any optimizations. */
 		} else {
-			if (memcmp(&tb->re, &o->bnd, sizeof(rect))) {
+			if (memcmp(&tb.re, &o->bnd, sizeof(rect))) {
 				blit_add(theme, &o->bnd);
 				render_add(theme, o, &o->bnd);
-				memcpy(&o->bnd, &tb->re, sizeof(rect));
+				obj_bnd_set(theme, o, &tb.re);
 			}
 
 			/* TODO: add some more optimizations here? */
-			blit_add(theme, &tb->re);
-			render_add(theme, o, &tb->re);
+			blit_add(theme, &tb.re);
+			render_add(theme, o, &tb.re);
 		}
 
-		free(b->curr);
-		b->curr = tb;
+		memcpy(b->curr, &tb, sizeof(box));
 
 	} else {
 		blit_add(theme, &o->bnd);
@@ -482,11 +445,14 @@ void box_prerender(stheme_t *theme, box *b, bool force)
 	}
 }
 
+#define BOX_CHUNK	256
+
 void box_render(stheme_t *theme, box *box, rect *re, u8 *target, u8 opacity)
 {
-	int x, y, a, r, g, b, h;
+	int x, y, a, r, g, b, h, k, n;
 	int add;
 	u8 *pic;
+	rgbacolor row[BOX_CHUNK];
 	float hr, hg, hb, ha, fr, fg, fb, fa;
 	int r1, r2, g1, g2, b1, b2, a1, a2;
 	int h1, h2;
@@ -555,26 +521,32 @@ void box_render(stheme_t *theme, box *box, rect *re, u8 *target, u8 opacity)
 			a = a1; fa = (float)a1 + ha * (re->x1 - box->re.x1);
 		}
 
-		for (x = re->x1; x <= re->x2; x++) {
-			if (!opt) {
+		if (opt) {
+			fbd.pf->fill(pic, pic, re->x2 - re->x1 + 1, add, a, r, g, b);
+			continue;
+		}
+
+		/* Gradients are computed into a temporary buffer and then
+		 * blended with the background in chunks. */
+		for (x = re->x1; x <= re->x2; x += n) {
+			n = min(BOX_CHUNK, re->x2 - x + 1);
+
+			for (k = 0; k < n; k++) {
 				fa += ha;
 				fr += hr;
 				fg += hg;
 				fb += hb;
 
-				a = (u8)fa;
-				b = (u8)fb;
-				g = (u8)fg;
-				r = (u8)fr;
+				row[k].a = (u8)fa;
+				row[k].b = (u8)fb;
+				row[k].g = (u8)fg;
+				row[k].r = (u8)fr;
 			}
 
-			if (opacity == 0xff, 1) {
-				put_pixel(a, r, g, b, pic, pic, add);
-			} else {
-				put_pixel(a * opacity / 255, r, g, b, pic, pic, add);
-			}
-			pic += fbd.bytespp;
-			add ^= 3;
+			fbd.pf->blend(pic, pic, row, n, add, 0xff);
+			pic += n * fbd.bytespp;
+			if (n & 1)
+				add ^= 3;
 		}
 	}
 }
@@ -586,6 +558,10 @@ void icon_render(stheme_t *theme, icon *ticon, rect *re, u8 *target)
 	u8 *out = NULL;
 	u8 *in = NULL;
 
+	/* The icon might still be being loaded. */
+	if (!ticon->img->picbuf)
+		return;
+
 	xi = re->x1 - ticon->x;
 	yi = re->y1 - ticon->y;
 	wi = re->x2 - re->x1 + 1;
@@ -627,7 +603,7 @@ void icon_prerender(stheme_t *theme, icon *c, bool force)
 		blit_add(theme, &crn);
 		render_add(theme, o, &crn);
 
-		memcpy(&o->bnd, &crn, sizeof(rect));
+		obj_bnd_set(theme, o, &crn);
 	} else {
 		blit_add(theme, &o->bnd);
 		render_add(theme, o, &o->bnd);
@@ -715,10 +691,70 @@ void obj_prerender(stheme_t *theme, obj *o, bool force)
 	}
 }
 
+/*
+ * The second pass of render_objs(), done separately for every band
+ * of the screen.
+ */
+struct render_job {
+	stheme_t *theme;
+	u8 *target;
+	u8 *bg;
+	obj ***objs;	/* objects intersecting the rects of the blit region */
+	int *num;
+};
+
+static void render_band(void *data, int y1, int y2)
+{
+	struct render_job *job = data;
+	stheme_t *theme = job->theme;
+	obj **objs;
+	rect re, tmp;
+	int k, l;
+
+	for (k = 0; k < theme->blit.num; k++) {
+		re = theme->blit.rects[k];
+		re.y1 = max(re.y1, y1);
+		re.y2 = min(re.y2, y2);
+
+		if (re.y2 < re.y1)
+			continue;
+
+		/* Blit the background image. */
+		blit(job->bg, &re, theme->xres, job->target, re.x1, re.y1, theme->xres);
+
+		objs = job->objs[k];
+
+		for (l = 0; l < job->num[k]; l++) {
+			obj *o = objs[l];
+
+			rect_min(&o->bnd, &re, &tmp);
+
+			/* Skip this object if its bouding box does not intersect
+			 * the target area. */
+			if (tmp.x2 < tmp.x1 || tmp.y2 < tmp.y1)
+				continue;
+
+			/* Text rendering modifies the glyph cache of the font. */
+			if (o->type == o_text) {
+				pool_lock();
+				obj_render(theme, o, &tmp, job->target);
+				pool_unlock();
+			} else {
+				obj_render(theme, o, &tmp, job->target);
+			}
+		}
+	}
+}
+
 void render_objs(stheme_t *theme, u8 *target, u8 mode, bool force)
 {
-	item *i, *j;
-	u8 *bg;
+	struct render_job job;
+	item *i;
+	obj **objs;
+	int k, l, n, pixels = 0;
+
+	/* Temporary data from the previous frame is no longer needed. */
+	arena_reset(&theme->scratch);
 
 	/*
 	 * First pass: mark rectangles for reblitting and rerendering
@@ -729,7 +765,7 @@ void render_objs(stheme_t *theme, u8 *target, u8 mode, bool force)
 	 */
 	for (i = theme->objs.head; i != NULL; i = i->next) {
 		obj *o = i->p;
-		if (!(o->modes & mode))
+		if (!(o->modes & mode) || (o->baked && mode == FBSPL_MODE_SILENT))
 			continue;
 
 		/* Only invalidated objects are updated. */
@@ -739,38 +775,61 @@ void render_objs(stheme_t *theme, u8 *target, u8 mode, bool force)
 		}
 	}
 
-	blit_normalize(theme);
+	if (region_empty(theme->blit))
+		return;
+
+	job.theme = theme;
+	job.target = target;
 
 	if (mode & FBSPL_MODE_VERBOSE) {
-		bg = (u8*)theme->verbose_img.data;
+		job.bg = (u8*)theme->verbose_img.data;
 	} else {
-		bg = (u8*)theme->silent_img.data;
+		job.bg = (u8*)theme->silent_img.data;
 	}
 
-	/* Second pass: actually render the objects. */
-	for (i = theme->blit.head; i != NULL; i = i->next) {
-		rect *re = i->p;
+	/*
+	 * Find the objects to be rendered in every rect of the blit region.
+	 * The object grid is not thread-safe, so this is done before the
+	 * second pass.
+	 */
+	job.objs = arena_alloc(&theme->scratch, theme->blit.num * sizeof(obj**));
+	job.num = arena_alloc(&theme->scratch, theme->blit.num * sizeof(int));
+	if (!job.objs || !job.num)
+		goto nomem;
 
-		/* Blit the background image. */
-		blit(bg, re, theme->xres, target, re->x1, re->y1, theme->xres);
+	for (k = 0; k < theme->blit.num; k++) {
+		rect *re = &theme->blit.rects[k];
 
-		for (j = theme->objs.head; j != NULL; j = j->next) {
-			obj *o = j->p;
-			rect tmp;
+		pixels += (re->x2 - re->x1 + 1) * (re->y2 - re->y1 + 1);
+		objs = objgrid_query(theme, re, &n);
+		if (n < 0)
+			return;
 
-			if (!(o->modes & mode))
-				continue;
+		job.objs[k] = arena_alloc(&theme->scratch, max(n, 1) * sizeof(obj*));
+		if (!job.objs[k])
+			goto nomem;
 
-			rect_min(&o->bnd, re, &tmp);
+		for (l = 0, job.num[k] = 0; l < n; l++) {
+			obj *o = objs[l];
 
-			/* Skip this object if its bouding box does not intersect
-			 * the target area. */
-			if (tmp.x2 < tmp.x1 || tmp.y2 < tmp.y1)
+			if (!(o->modes & mode) || (o->baked && mode == FBSPL_MODE_SILENT))
 				continue;
 
-			obj_render(theme, o, &tmp, target);
+			job.objs[k][job.num[k]++] = o;
 		}
 	}
+
+	/*
+	 * Second pass: actually render the objects.  The rects in the blit
+	 * region don't overlap, so every pixel is processed only once, and
+	 * different bands of the screen can be rendered at the same time.
+	 */
+	pool_run(render_band, &job, theme->blit.rects[0].y1,
+			 theme->blit.rects[theme->blit.num - 1].y2, pixels);
+	return;
+
+nomem:
+	iprint(MSG_ERROR, "Failed to allocate memory for rendering.\n");
 }
 
 /**
@@ -820,6 +879,9 @@ void invalidate_service(stheme_t *theme, char *svc, enum ESVC state)
 
 			o->invalid = true;
 			obj_visibility_set(theme, o, t->type == state);
+
+			if (t->type == state && !t->img->picbuf)
+				loader_request(theme, t->img);
 			break;
 		}
 
@@ -841,6 +903,35 @@ void invalidate_service(stheme_t *theme, char *svc, enum ESVC state)
 	}
 }
 
+/**
+ * Update all objects using an icon which has just been loaded.
+ */
+void icon_loaded(stheme_t *theme, icon_img *ii)
+{
+	item *i;
+
+	for (i = theme->objs.head; i != NULL; i = i->next) {
+		obj *o = i->p;
+		icon *t = o->p;
+		rect re;
+
+		if (o->type != o_icon || t->img != ii)
+			continue;
+
+		if (!t->crop) {
+			re.x1 = t->x;
+			re.y1 = t->y;
+			re.x2 = t->x + ii->w - 1;
+			re.y2 = t->y + ii->h - 1;
+			rect_sanitize(theme, &re);
+			obj_bnd_set(theme, o, &re);
+		}
+
+		if (o->visible)
+			o->invalid = true;
+	}
+}
+
 /**
  * Invalidate all objects that depend on the progress variable.
  */
@@ -957,40 +1048,120 @@ void bnd_init(stheme_t *theme)
 			break;
 		}
 	}
+
+	/* Without the grid, objects are found by walking the objs list. */
+	if (objgrid_init(theme))
+		iprint(MSG_WARN, "Rendering without the object grid.\n");
 }
 
-#if 0
-int bgcache_init(stheme_t *theme)
+/**
+ * Check whether an object always looks the same once the theme is loaded.
+ *
+ * Objects which depend on the progress, the state of services or the
+ * message log, execute commands, are animated or fade in and out, as
+ * well as objects which are part of the textbox, are dynamic.
+ */
+static bool obj_is_static(stheme_t *theme, obj *o)
 {
-	item *i, *j;
+	item *i;
 
-	/* Prepare the background image */
-	memcpy(theme->bgbuf, theme->silent_img.data, theme->xres * theme->yres * fbd.bytespp);
+	if (o->blendin || o->blendout)
+		return false;
+
+	for (i = theme->textbox.head; i != NULL; i = i->next) {
+		if (i->p == o)
+			return false;
+	}
+
+	switch (o->type) {
+
+	case o_box:
+	{
+		box *t = o->p;
+		return !t->inter;
+	}
+
+	case o_icon:
+	{
+		icon *t = o->p;
+		return !t->crop && !t->svc && t->img && t->img->picbuf;
+	}
+
+#if WANT_TTF
+	case o_text:
+	{
+		text *t = o->p;
+
+		/* The last text object is the main splash message, which
+		 * can be changed with fbsplashr_message_set(). */
+		if (o == theme->objs.tail->p)
+			return false;
+
+		return !(t->flags & (F_TXT_EXEC | F_TXT_EVAL | F_TXT_MSGLOG)) &&
+				t->curr_progress < 0;
+	}
+#endif
+	default:
+		return false;
+	}
+}
+
+/**
+ * Render all static objects of the silent mode into the silent background
+ * image.
+ *
+ * An object can only be baked if no dynamic object below it can ever
+ * intersect it.  Otherwise, it has to be redrawn every time the dynamic
+ * object is, and is treated as dynamic itself.  Baked objects are skipped
+ * by render_objs() in the silent mode.  They are still rendered normally
+ * in the verbose mode.
+ */
+void bake_static(stheme_t *theme)
+{
+	region dyn;
+	rect all = { 0, theme->xres - 1, 0, theme->yres - 1 };
+	rect *re;
+	item *i;
+	int k;
+
+	if (!(theme->modes & FBSPL_MODE_SILENT) || !theme->silent_img.data ||
+		fbd.var.bits_per_pixel == 8)
+		return;
+
+	region_init(dyn);
 
-	/*
-	 * If we intersect another object, we will need to allocate a background
-	 * buffer to avoid unnecessary redrawing later.  If we don't intersect
-	 * anything, there's no need for a buffer as we will get our background
-	 * directly from silent_img
-	 */
 	for (i = theme->objs.head; i != NULL; i = i->next) {
-		obj *a = i->p;
+		obj *o = i->p;
 
-		for (j = theme->objs.head; j != i; j = j->next) {
-			obj *b = j->p;
+		if (!(o->modes & FBSPL_MODE_SILENT))
+			continue;
+
+		if (obj_is_static(theme, o)) {
+			for (k = 0; k < dyn.num; k++) {
+				if (rect_intersect(&dyn.rects[k], &o->bnd))
+					break;
+			}
 
-			if (rect_intersect(&a->bnd, &b->bnd)) {
-				a->bgcache = malloc(fbd.bytespp * (a->bnd.x2 - a->bnd.x1 + 1) * (a->bnd.y2 - a->bnd.y1 + 1));
-				blit(theme->bgbuf, &a->bnd, theme->xres, a->bgcache, 0, 0, (a->bnd.x2 - a->bnd.x1 + 1));
-				break;
+			if (k == dyn.num) {
+				obj_prerender(theme, o, true);
+				obj_render(theme, o, &o->bnd, (u8*)theme->silent_img.data);
+				o->baked = true;
+				continue;
 			}
 		}
 
-		render_obj(theme, theme->bgbuf, 's', a, true);
+		/* The size of dynamic text is not known in advance. */
+		re = (o->type == o_text && !obj_is_static(theme, o)) ? &all : &o->bnd;
+
+		if (region_op_rect(&dyn, re, REGION_UNION)) {
+			iprint(MSG_ERROR, "Failed to allocate memory for the static objects.\n");
+			break;
+		}
 	}
 
-	return 0;
+	/* Everything that is left will be repainted with the first frame. */
+	region_free(&dyn);
+	region_clear(theme->blit);
 }
-#endif
 
 
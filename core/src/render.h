@@ -39,6 +39,34 @@ typedef struct {
 	int x1, x2, y1, y2;
 } rect;
 
+/*
+ * A set of pixels, represented as a list of non-overlapping rects.  The
+ * rects are grouped into bands of rects sharing y1 and y2.  Bands are
+ * sorted by y, rects within a band are sorted by x.  Neither the bands
+ * nor the rects within a band touch each other, and vertically adjacent
+ * bands with identical x spans are always coalesced.
+ */
+typedef struct {
+	rect *rects;
+	int num;				/* number of rects in use */
+	int size;				/* number of rects allocated */
+	rect *spare;			/* buffer for the results of region operations */
+	int spare_size;
+} region;
+
+#define region_init(r)		{ (r).rects = (r).spare = NULL; (r).num = (r).size = (r).spare_size = 0; }
+#define region_clear(r)		{ (r).num = 0; }
+#define region_empty(r)		((r).num == 0)
+
+/* Memory for temporary data that only lives until the end of a frame. */
+typedef struct {
+	u8 *buf;
+	size_t size;			/* size of buf */
+	size_t used;			/* bytes allocated since the last reset */
+	size_t peak;			/* largest value of 'used' seen so far */
+	struct arena_chunk *extra;	/* allocations that didn't fit into buf */
+} arena;
+
 typedef struct {
 	int x, y;
 	icon_img *img;
@@ -54,18 +82,39 @@ typedef struct {
 	enum otype type;		/* object type */
 	void *p;				/* pointer to the type-specific data */
 	rect bnd;				/* bounding rectangle */
-	u8 *bgcache;			/* bgnd cache, directly from the bg picture if NULL */
 	u8 modes;
 	bool invalid;			/* indicates whether this object has to be repainted */
 	bool visible;			/* is this object to be rendered? */
+	bool baked;				/* already rendered into the silent background */
 	u8 opacity;				/* global object opacity */
 	u16 op_tstep;			/* opacity time step in ms */
 	short op_step;			/* opacity step */
 	short wait_msecs;		/* time to wait till the next step */
 	u16 blendin;			/* blend-in time in ms, 0 if disabled */
 	u16 blendout;			/* blend-out time in ms, 0 if disabled */
+	unsigned int stamp;		/* last objgrid query that returned this object */
 } obj;
 
+/*
+ * A uniform grid over the theme area.  Every cell holds the objects
+ * whose bounding rectangles intersect it, sorted by object ID (i.e.
+ * in z-order).
+ */
+typedef struct {
+	obj **objs;
+	int num, size;
+} objcell;
+
+typedef struct {
+	int cols, rows;
+	objcell *cells;
+	obj **res;				/* results of the last query */
+	int res_size;
+	unsigned int stamp;		/* query counter, used to filter out duplicates */
+} objgrid;
+
+#define OBJGRID_CELL	64	/* cell size, in pixels */
+
 typedef struct {
 	rect re;
 	obj *o;
@@ -109,7 +158,8 @@ typedef struct text {
 	u8 flags;
 	u8 style;
 	char *val;
-	u16 *cache;
+	u32 *cache;				/* text decoded to UCS-4 */
+	int cache_size;			/* number of characters allocated for cache */
 	font_e *font;
 	int curr_progress;		/* if this string uses the $progress variable,
 							 * curr_progress holds its currently used value
@@ -126,6 +176,7 @@ typedef struct fbspl_theme {
 	u16 ty;
 	u16 tw;
 	u16 th;
+	u16 jpeg_fast;			/* decode JPEGs with the fast profile? */
 
 	u8 modes;				/* bitmask of supported splash modes */
 
@@ -159,6 +210,9 @@ typedef struct fbspl_theme {
 
 	/* A list of fonts used in the theme. */
 	list fonts;
+#if WANT_TTF
+	glyph_cache glyphs;		/* Glyphs rendered with the fonts above. */
+#endif
 
 	/* A list of rectangles. Rectangles are not on the objs list as they
 	 * only describe a special area on the screen and are not renderable. */
@@ -166,6 +220,8 @@ typedef struct fbspl_theme {
 
 	int xres;		/* Resolution for which this theme has been designed. */
 	int yres;
+	int cfg_xres;	/* Resolution of the config file.  Different from the */
+	int cfg_yres;	/* above only if the theme is scaled. */
 	int xmarg;		/* Margins. Non-zero only if using a config file
 					 * designed for a different resolution than the one
 					 * currently in use. */
@@ -175,12 +231,46 @@ typedef struct fbspl_theme {
 	int log_lines, log_cols;
 	list msglog;
 
-	list blit;		/* List of rectangular regions (rect's) that need to be re-blit to the
+	objgrid grid;	/* Spatial index of the objs list. */
+	arena scratch;	/* Temporary data used while rendering a frame. */
+
+	region blit;	/* Parts of the screen that need to be re-blit to the
 					   screen. */
+	region stale;	/* Parts of the hidden page that are out of date when
+					   page flipping is used. */
 	list render;	/* List of rectangular regions (orect's) that need to be re-rendered
 					   to update the screen image. */
+
+	u8 *bundle;		/* Mapping of the precompiled theme bundle, if any. */
+	size_t bundle_len;
+
+	struct cache_map *cache;	/* Images mapped from the image cache. */
+	int cache_num;
+
+	u8 *icon_atlas;	/* Pixel data of all loaded icons. */
+	size_t icon_atlas_len;
+
+	struct loader *loader;	/* Icons being loaded in the background. */
+
+	bool stream;	/* Display the silent background while it is being
+					   loaded (progressive first paint). */
 } stheme_t;
 
+/* Memory used by a loaded theme, in bytes, per class of data. */
+typedef struct {
+	size_t bg;				/* background images */
+	size_t icons;			/* icon atlas and icons mapped from the bundle */
+	size_t anims;			/* animation files and canvases */
+	size_t fonts;			/* fonts and glyph caches */
+	unsigned long glyph_hits;	/* glyph cache lookups */
+	unsigned long glyph_misses;
+	size_t render;			/* background buffer, spatial index and scratch memory */
+	size_t mapped;			/* part of the above mapped from the theme bundle
+							   or from the image cache */
+	int icons_num;			/* icons used by the theme */
+	int icons_stored;		/* distinct icons actually stored */
+} theme_mem;
+
 #if defined(CONFIG_MNG) && !defined(TARGET_KERNEL)
 #include "mng_splash.h"
 
@@ -228,6 +318,48 @@ typedef struct {
 #define BOX_VGRAD  0x40
 #define BOX_HGRAD  0x20
 
+/*
+ * A set of row-level pixel kernels specialized for a specific framebuffer
+ * layout.  All kernels process 'len' pixels, read the background from 'bg'
+ * and write the result to 'dst' (which can be the same as 'bg').  'add'
+ * is the initial value of the dithering offset (1 or 3).
+ */
+typedef struct pixfmt {
+	const char *name;
+
+	/* Blend a row of RGBA pixels with the background. */
+	void (*blend)(u8 *dst, u8 *bg, rgbacolor *src, int len, int add, u8 opacity);
+
+	/* Convert a row of RGB pixels, using a common alpha value. */
+	void (*convert)(u8 *dst, u8 *bg, rgbcolor *src, int len, int add, u8 alpha);
+
+	/* Fill a row with a solid color. */
+	void (*fill)(u8 *dst, u8 *bg, int len, int add, u8 a, u8 r, u8 g, u8 b);
+
+	/* Fill a row with a solid color, using per-pixel coverage values
+	 * which are multiplied by c.a to get the alpha channel. */
+	void (*mask)(u8 *dst, u8 *bg, u8 *mask, int len, int add, color c);
+} pixfmt;
+
+/*
+ * Vectorized replacements for some of the kernels of a pixfmt.  NULL
+ * members are not replaced.  The results have to be bit-identical to
+ * those of the kernels in 'base'.
+ */
+typedef struct pixfmt_accel {
+	const char *name;
+	const pixfmt *base;
+	int (*supported)(void);
+	void (*blend)(u8 *dst, u8 *bg, rgbacolor *src, int len, int add, u8 opacity);
+	void (*convert)(u8 *dst, u8 *bg, rgbcolor *src, int len, int add, u8 alpha);
+} pixfmt_accel;
+
+/*
+ * A function processing the lines y1..y2 of a screen buffer, as a part
+ * of a job split into horizontal bands by pool_run().
+ */
+typedef void (*pool_fn)(void *data, int y1, int y2);
+
 struct fb_data {
 	struct fb_var_screeninfo   var;
 	struct fb_fix_screeninfo   fix;
@@ -235,6 +367,9 @@ struct fb_data {
 	bool opt;				/* can we use optimized 24/32bpp routines? */
 	u8 ro, go, bo;			/* red, green, blue offset */
 	u8 rlen, glen, blen;	/* red, green, blue length */
+	const pixfmt *pf;		/* row kernels for the current video mode */
+	bool flip;				/* use page flipping? */
+	int page;				/* index of the displayed page when flipping */
 };
 
 /* ************************************************************************
@@ -243,6 +378,7 @@ struct fb_data {
 
 /* common.c */
 int fb_get_settings(int);
+void fb_layout_init(void);
 int do_getpic(unsigned char, unsigned char, char);
 int cfg_check_sanity(stheme_t *theme, u8 mode);
 
@@ -250,6 +386,10 @@ int dev_create(char *fn, char *sys);
 int fb_open(int fb, bool create);
 void fb_unmap(u8 *fb);
 void* fb_mmap(int fb);
+bool fb_flip_possible(void);
+u8 *fb_hidden(void);
+int fb_flip(int fb);
+int fb_frame_interval(void);
 
 int tty_open(int tty);
 
@@ -272,12 +412,14 @@ int tty_open(int tty);
 
 int parse_svc_state(char *t, enum ESVC *state);
 int parse_cfg(char *cfgfile, stheme_t *st);
+int parse_cfg_buf(char *cfgfile, const char *data, size_t len, stheme_t *st);
 
 /* render.c */
 void rgba2fb(rgbacolor* data, u8 *bg, u8* out, int len, int y, u8 alpha, u8 opacity);
 void put_pixel(u8 a, u8 r, u8 g, u8 b, u8 *src, u8 *dst, u8 add);
 void invalidate_all(stheme_t *theme);
 void invalidate_service(stheme_t *theme, char *svc, enum ESVC state);
+void icon_loaded(stheme_t *theme, icon_img *ii);
 void invalidate_progress(stheme_t *theme);
 void invalidate_textbox(stheme_t *theme, bool active);
 void rect_interpolate(rect *a, rect *b, rect *c);
@@ -286,11 +428,103 @@ void rect_sanitize(stheme_t *theme, rect *re);
 void box_interpolate(box *a, box *b, box *c);
 void render_objs(stheme_t *theme, u8 *target, u8 mode, bool force);
 void bnd_init(stheme_t *theme);
+void bake_static(stheme_t *theme);
 void blit_add(stheme_t *theme, rect *a);
+void obj_bnd_set(stheme_t *theme, obj *o, rect *re);
 void render_add(stheme_t *theme, obj *o, rect *a);
 
+/* region.c */
+enum region_op { REGION_UNION, REGION_SUBTRACT, REGION_INTERSECT };
+int region_op(region *dst, region *a, region *b, enum region_op op);
+int region_op_rect(region *r, rect *re, enum region_op op);
+void region_free(region *r);
+
+/* arena.c */
+void *arena_alloc(arena *a, size_t size);
+void arena_reset(arena *a);
+void arena_free(arena *a);
+
+/* shadow.c */
+void shadow_init(u8 *fb, size_t len, size_t page);
+void shadow_free(void);
+void shadow_invalidate(void);
+void shadow_validate(u8 *dst);
+void shadow_put(u8 *dst, const u8 *src, size_t len);
+
+/* libfbsplashrender.c */
+stheme_t *theme_load(bool use_bundle);
+
+/* bundle.c */
+enum { BUNDLE_VERBOSE, BUNDLE_SILENT, BUNDLE_ICON };
+
+void bundle_path(char *buf, int len, int xres, int yres);
+int bundle_map(stheme_t *theme, const char *path);
+int bundle_open(stheme_t *theme);
+void bundle_close(stheme_t *theme);
+const char *bundle_cfg(stheme_t *theme, size_t *len);
+u8 *bundle_get(stheme_t *theme, int type, const char *src, unsigned int *w, unsigned int *h);
+bool bundle_owns(stheme_t *theme, void *p);
+void bundle_release(stheme_t *theme, void *p);
+int bundle_write(stheme_t *theme, const char *path);
+
+/* cache.c */
+u8 *cache_get(stheme_t *theme, int type, const char *src, bool fast,
+			  unsigned int *w, unsigned int *h);
+u8 *cache_put(stheme_t *theme, int type, const char *src, bool fast,
+			  const u8 *data, unsigned int w, unsigned int h);
+bool cache_owns(stheme_t *theme, void *p);
+bool cache_release(stheme_t *theme, void *p);
+void cache_close(stheme_t *theme);
+
+/* scale.c */
+#define theme_scaled(t)		((t)->xres != (t)->cfg_xres || (t)->yres != (t)->cfg_yres)
+
+int scale_rgba(u8 *src, int sw, int sh, u8 *dst, int dw, int dh, bool alpha);
+int scale_len(stheme_t *theme, int len, bool vert);
+void theme_scale_res(stheme_t *theme);
+void theme_scale(stheme_t *theme);
+
+/* loader.c */
+int loader_init(stheme_t *theme, icon_img **icons, int num);
+void loader_request(stheme_t *theme, icon_img *ii);
+void loader_poll(stheme_t *theme);
+bool loader_pending(stheme_t *theme);
+void loader_wait(stheme_t *theme);
+void loader_free(stheme_t *theme);
+
+/* pool.c */
+void pool_run(pool_fn fn, void *data, int y1, int y2, int pixels);
+void pool_tasks(pool_fn fn, void *data, int num);
+void pool_free(void);
+void pool_lock(void);
+void pool_unlock(void);
+
+/* objgrid.c */
+int objgrid_init(stheme_t *theme);
+void objgrid_free(stheme_t *theme);
+int objgrid_update(stheme_t *theme, obj *o, rect *old);
+obj **objgrid_query(stheme_t *theme, rect *re, int *num);
+
+/* pixfmt.c */
+extern const pixfmt pixfmt_xrgb8888, pixfmt_xbgr8888, pixfmt_rgb888, pixfmt_bgr888;
+extern const pixfmt pixfmt_rgb565, pixfmt_rgb555, pixfmt_generic;
+void pixfmt_select(void);
+
+/* pixfmt_simd.c */
+extern const pixfmt_accel pixfmt_accels[];
+
 /* image.c */
-int load_images(stheme_t *theme, char mode);
+int load_bg_images(stheme_t *theme, char mode);
+int load_icon(stheme_t *theme, icon_img *ii);
+int image_load_rgba(char *filename, u8 **data, unsigned int *width, unsigned int *height);
+int load_assets(stheme_t *theme, bool verbose, bool silent);
+void icon_release(stheme_t *theme, icon_img *ii);
+void theme_mem_usage(stheme_t *theme, theme_mem *m);
+
+#if WANT_TTF
+/* ttf.c */
+int load_font(font_e *fe);
+#endif
 
 /* fbcon_decor.c */
 int fbcon_decor_open(bool create);
@@ -312,7 +546,17 @@ void list_del(list *l, item *prev, item *curr);
 void paint_rect(stheme_t *theme, u8 *dst, u8 *src, int x1, int y1, int x2, int y2);
 void put_img(stheme_t *theme, u8 *dst, u8 *src);
 void paint_img(stheme_t *theme, u8 *dst, u8 *src);
+void present_img(stheme_t *theme, u8 *src);
+void present_rects(stheme_t *theme, u8 *src);
+void present_rect(stheme_t *theme, rect *re);
 void fade(stheme_t *theme, u8 *dst, u8 *image, struct fb_cmap cmap, u8 bgnd, int fd, char type);
+void crossfade(stheme_t *theme, u8 *dst, u8 *image, u8 bgnd);
+bool effect_active(stheme_t *theme);
+void effect_stop(bool finish);
+void effect_update(stheme_t *theme);
+void effect_lock(void);
+void effect_unlock(void);
+void effect_free(void);
 void set_directcolor_cmap(int fd);
 
 /* common.c */
@@ -328,6 +572,7 @@ extern fbspl_cfg_t config;
 /* libsplashrender */
 extern int fd_tty[MAX_NR_CONSOLES];
 extern struct fb_data fbd;
+extern u8 *fb_mem;
 
 
 
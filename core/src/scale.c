@@ -0,0 +1,519 @@
+/*
+ * scale.c - Scaling of themes to the resolution of the screen.
+ *
+ * Copyright (C) 2004-2008, Michal Januszewski <spock@gentoo.org>
+ *
+ * This file is subject to the terms and conditions of the GNU General Public
+ * License v2.  See the file COPYING in the main directory of this archive for
+ * more details.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <dirent.h>
+#include "common.h"
+#include "render.h"
+
+#if defined(__SSE2__)
+#define SCALE_SSE2
+#include <emmintrin.h>
+#endif
+
+/*
+ * When no config file for the resolution of the screen is available and
+ * scaling is enabled (config.scale), the theme is loaded from the config
+ * file for the nearest resolution and scaled to the resolution of the
+ * screen: the coordinates of all objects are scaled right after the config
+ * file is parsed, and the images are scaled as they are loaded.
+ *
+ * Images are scaled by a separable filter: every line is first scaled
+ * horizontally, and the result is then scaled vertically.  The filter
+ * weights for every output column and line are computed once per image,
+ * in fixed point, so the inner loops only deal with integers.  All
+ * versions of the inner loops give identical results.
+ *
+ * Images are scaled serially, in the thread that loads them.  The images
+ * of a theme are already loaded in parallel (see load_assets()), and jobs
+ * of the thread pool cannot be nested.
+ */
+
+#define SCALE_PREC		14			/* fractional bits of the weights */
+#define SCALE_HALF		(1 << (SCALE_PREC - 1))
+
+/* Filter weights for all output pixels along one axis. */
+struct scale_coefs {
+	int taps;					/* maximum number of taps */
+	int *start;					/* first input pixel, per output pixel */
+	int *num;					/* number of taps, per output pixel */
+	short *w;					/* 'taps' weights per output pixel */
+};
+
+static double filter_bilinear(double x)
+{
+	x = fabs(x);
+	return (x < 1.0) ? 1.0 - x : 0.0;
+}
+
+static double sinc(double x)
+{
+	if (x == 0.0)
+		return 1.0;
+
+	x *= M_PI;
+	return sin(x) / x;
+}
+
+static double filter_lanczos(double x)
+{
+	return (fabs(x) < 3.0) ? sinc(x) * sinc(x / 3.0) : 0.0;
+}
+
+static void scale_coefs_free(struct scale_coefs *c)
+{
+	free(c->start);
+	free(c->num);
+	free(c->w);
+}
+
+/*
+ * Compute the filter weights for scaling 'in' pixels to 'out' pixels.
+ * When scaling down, the filter is stretched, so that every input pixel
+ * contributes to the result.
+ */
+static int scale_coefs_init(struct scale_coefs *c, int in, int out, int filter)
+{
+	double (*fn)(double) = (filter == FBSPL_SCALE_LANCZOS) ? filter_lanczos : filter_bilinear;
+	double support = (filter == FBSPL_SCALE_LANCZOS) ? 3.0 : 1.0;
+	double scale = (double)in / out, fscale = max(scale, 1.0);
+	double *tw;
+	int i, k, x1, x2, sum, big;
+
+	support *= fscale;
+	c->taps = (int)ceil(support) * 2 + 1;
+	c->start = malloc(out * sizeof(int));
+	c->num = malloc(out * sizeof(int));
+	c->w = calloc(out * c->taps, sizeof(short));
+	tw = malloc(c->taps * sizeof(double));
+
+	if (!c->start || !c->num || !c->w || !tw) {
+		scale_coefs_free(c);
+		free(tw);
+		return -1;
+	}
+
+	for (i = 0; i < out; i++) {
+		double center = (i + 0.5) * scale, total = 0.0;
+		short *w = c->w + i * c->taps;
+
+		x1 = max((int)(center - support + 0.5), 0);
+		x2 = min((int)(center + support + 0.5), in);
+		if (x2 - x1 > c->taps)
+			x2 = x1 + c->taps;
+
+		for (k = x1; k < x2; k++) {
+			tw[k - x1] = fn((k + 0.5 - center) / fscale);
+			total += tw[k - x1];
+		}
+
+		/* Convert the weights to fixed point and make sure that they
+		 * add up to exactly 1, so that flat areas stay flat. */
+		sum = 0;
+		big = 0;
+		for (k = 0; k < x2 - x1; k++) {
+			w[k] = (short)floor((total != 0.0 ? tw[k] / total : 0.0) * (1 << SCALE_PREC) + 0.5);
+			sum += w[k];
+			if (w[k] > w[big])
+				big = k;
+		}
+		w[big] += (1 << SCALE_PREC) - sum;
+
+		c->start[i] = x1;
+		c->num[i] = x2 - x1;
+	}
+
+	free(tw);
+	return 0;
+}
+
+struct scale_job {
+	u8 *src, *tmp, *dst;
+	int sw, sh, dw, dh;
+	struct scale_coefs h, v;
+};
+
+static inline u8 scale_clamp(int x)
+{
+	x >>= SCALE_PREC;
+	return (x < 0) ? 0 : (x > 255) ? 255 : x;
+}
+
+/*
+ * Scale the lines y1..y2 of the source image horizontally.
+ */
+static void scale_hband(void *data, int y1, int y2)
+{
+	struct scale_job *job = data;
+	int x, y, k;
+
+	for (y = y1; y <= y2; y++) {
+		u8 *in = job->src + y * job->sw * 4;
+		u8 *out = job->tmp + y * job->dw * 4;
+
+		for (x = 0; x < job->dw; x++, out += 4) {
+			u8 *p = in + job->h.start[x] * 4;
+			short *w = job->h.w + x * job->h.taps;
+			int n = job->h.num[x];
+#ifdef SCALE_SSE2
+			__m128i acc = _mm_set1_epi32(SCALE_HALF), zero = _mm_setzero_si128();
+			__m128i t;
+
+			/* Two input pixels at a time: interleave their channels
+			 * as 16-bit values, and multiply-add with both weights. */
+			for (k = 0; k + 1 < n; k += 2, p += 8) {
+				t = _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i*)p), zero);
+				t = _mm_unpacklo_epi16(t, _mm_srli_si128(t, 8));
+				acc = _mm_add_epi32(acc, _mm_madd_epi16(t,
+						_mm_set1_epi32((u16)w[k] | ((u32)(u16)w[k+1] << 16))));
+			}
+
+			if (k < n) {
+				t = _mm_unpacklo_epi8(_mm_cvtsi32_si128(*(int*)p), zero);
+				t = _mm_unpacklo_epi16(t, zero);
+				acc = _mm_add_epi32(acc, _mm_madd_epi16(t, _mm_set1_epi32((u16)w[k])));
+			}
+
+			acc = _mm_srai_epi32(acc, SCALE_PREC);
+			acc = _mm_packs_epi32(acc, acc);
+			*(int*)out = _mm_cvtsi128_si32(_mm_packus_epi16(acc, acc));
+#else
+			int acc[4] = { SCALE_HALF, SCALE_HALF, SCALE_HALF, SCALE_HALF };
+			int c;
+
+			for (k = 0; k < n; k++, p += 4) {
+				for (c = 0; c < 4; c++)
+					acc[c] += w[k] * p[c];
+			}
+
+			for (c = 0; c < 4; c++)
+				out[c] = scale_clamp(acc[c]);
+#endif
+		}
+	}
+}
+
+/*
+ * Compute the lines y1..y2 of the destination image from the
+ * horizontally scaled lines.
+ */
+static void scale_vband(void *data, int y1, int y2)
+{
+	struct scale_job *job = data;
+	int len = job->dw * 4, stride = job->dw * 4;
+	int x = 0, y, k;
+
+	for (y = y1; y <= y2; y++) {
+		u8 *in = job->tmp + job->v.start[y] * stride;
+		u8 *out = job->dst + y * stride;
+		short *w = job->v.w + y * job->v.taps;
+		int n = job->v.num[y];
+
+		x = 0;
+#ifdef SCALE_SSE2
+		/* 8 bytes of two input lines at a time, interleaved as 16-bit
+		 * values, multiplied and added with the weights of both lines. */
+		for (; x + 8 <= len; x += 8) {
+			__m128i zero = _mm_setzero_si128();
+			__m128i lo = _mm_set1_epi32(SCALE_HALF), hi = lo;
+			__m128i a, b, wk;
+			u8 *p = in + x;
+
+			for (k = 0; k < n; k += 2, p += 2 * stride) {
+				a = _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i*)p), zero);
+				if (k + 1 < n) {
+					b = _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i*)(p + stride)), zero);
+					wk = _mm_set1_epi32((u16)w[k] | ((u32)(u16)w[k+1] << 16));
+				} else {
+					b = zero;
+					wk = _mm_set1_epi32((u16)w[k]);
+				}
+
+				lo = _mm_add_epi32(lo, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), wk));
+				hi = _mm_add_epi32(hi, _mm_madd_epi16(_mm_unpackhi_epi16(a, b), wk));
+			}
+
+			lo = _mm_packs_epi32(_mm_srai_epi32(lo, SCALE_PREC), _mm_srai_epi32(hi, SCALE_PREC));
+			_mm_storel_epi64((__m128i*)(out + x), _mm_packus_epi16(lo, lo));
+		}
+#endif
+		for (; x < len; x++) {
+			int acc = SCALE_HALF;
+			u8 *p = in + x;
+
+			for (k = 0; k < n; k++, p += stride)
+				acc += w[k] * *p;
+
+			out[x] = scale_clamp(acc);
+		}
+	}
+}
+
+/**
+ * Scale an RGBA image, using the filter selected by config.scale.
+ *
+ * @param src The source image, sw x sh pixels.
+ * @param dst The destination buffer, dw x dh pixels.
+ * @param alpha Set if the image is not opaque.  The color channels are then
+ *              weighted by alpha, which avoids dark fringes around
+ *              transparent areas.  The source image is modified in this
+ *              case, unless the function fails.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int scale_rgba(u8 *src, int sw, int sh, u8 *dst, int dw, int dh, bool alpha)
+{
+	struct scale_job job;
+	int filter = config.scale, i, err = -1;
+
+	if (filter == FBSPL_SCALE_NONE)
+		filter = FBSPL_SCALE_BILINEAR;
+
+	memset(&job, 0, sizeof(job));
+	job.src = src;
+	job.dst = dst;
+	job.sw = sw;
+	job.sh = sh;
+	job.dw = dw;
+	job.dh = dh;
+
+	job.tmp = malloc(dw * sh * 4);
+	if (!job.tmp || scale_coefs_init(&job.h, sw, dw, filter))
+		goto out;
+
+	if (scale_coefs_init(&job.v, sh, dh, filter)) {
+		scale_coefs_free(&job.h);
+		goto out;
+	}
+
+	/* Premultiply the color channels. */
+	if (alpha) {
+		for (i = 0; i < sw * sh * 4; i += 4) {
+			src[i]   = DIV255(src[i] * src[i+3]);
+			src[i+1] = DIV255(src[i+1] * src[i+3]);
+			src[i+2] = DIV255(src[i+2] * src[i+3]);
+		}
+	}
+
+	scale_hband(&job, 0, sh - 1);
+	scale_vband(&job, 0, dh - 1);
+
+	scale_coefs_free(&job.h);
+	scale_coefs_free(&job.v);
+
+	if (alpha) {
+		for (i = 0; i < dw * dh * 4; i += 4) {
+			int a = dst[i+3];
+
+			if (a == 0) {
+				dst[i] = dst[i+1] = dst[i+2] = 0;
+			} else if (a != 255) {
+				dst[i]   = min(255, (dst[i] * 255 + a / 2) / a);
+				dst[i+1] = min(255, (dst[i+1] * 255 + a / 2) / a);
+				dst[i+2] = min(255, (dst[i+2] * 255 + a / 2) / a);
+			}
+		}
+	}
+
+	err = 0;
+out:
+	free(job.tmp);
+	return err;
+}
+
+/*
+ * Coordinates of pixels are scaled so that the scaled pixel covers the
+ * position of the original one.  The last pixel of a rect is scaled so
+ * that adjacent rects stay adjacent.
+ */
+static inline int scale_x1(stheme_t *theme, int x)
+{
+	return x * theme->xres / theme->cfg_xres;
+}
+
+static inline int scale_x2(stheme_t *theme, int x)
+{
+	return (x + 1) * theme->xres / theme->cfg_xres - 1;
+}
+
+static inline int scale_y1(stheme_t *theme, int y)
+{
+	return y * theme->yres / theme->cfg_yres;
+}
+
+static inline int scale_y2(stheme_t *theme, int y)
+{
+	return (y + 1) * theme->yres / theme->cfg_yres - 1;
+}
+
+static void scale_rect(stheme_t *theme, rect *re)
+{
+	re->x1 = scale_x1(theme, re->x1);
+	re->x2 = scale_x2(theme, re->x2);
+	re->y1 = scale_y1(theme, re->y1);
+	re->y2 = scale_y2(theme, re->y2);
+}
+
+/**
+ * Scale a length (e.g. the size of an icon) along the x or y axis of
+ * a scaled theme.
+ */
+int scale_len(stheme_t *theme, int len, bool vert)
+{
+	int n = vert ? theme->yres : theme->xres;
+	int d = vert ? theme->cfg_yres : theme->cfg_xres;
+
+	return max(1, (len * n + d / 2) / d);
+}
+
+/**
+ * Find the config file from which a theme will be scaled to its
+ * resolution (xres x yres), and set cfg_xres and cfg_yres accordingly.
+ * Unlike fbsplash_get_res(), config files for higher resolutions are
+ * considered too, although scaling up is penalized.  Both are set to 0
+ * if the theme has no config files at all.
+ */
+void theme_scale_res(stheme_t *theme)
+{
+	char buf[512];
+	unsigned int t, mdist = 0xffffffff;
+	int tx, ty, n;
+	struct dirent *dent;
+	DIR *tdir;
+
+	theme->cfg_xres = 0;
+	theme->cfg_yres = 0;
+
+	snprintf(buf, 512, FBSPL_THEME_DIR "/%s/%dx%d.cfg", config.theme, theme->xres, theme->yres);
+	if (!access(buf, R_OK)) {
+		theme->cfg_xres = theme->xres;
+		theme->cfg_yres = theme->yres;
+		return;
+	}
+
+	snprintf(buf, 512, FBSPL_THEME_DIR "/%s", config.theme);
+	tdir = opendir(buf);
+	if (!tdir)
+		return;
+
+	while ((dent = readdir(tdir))) {
+		/* Skip anything that is not a config file, e.g. theme bundles. */
+		n = 0;
+		if (sscanf(dent->d_name, "%dx%d.cfg%n", &tx, &ty, &n) != 2 || !n ||
+			dent->d_name[n] || tx <= 0 || ty <= 0)
+			continue;
+
+		t = (tx - theme->xres) * (tx - theme->xres) + (ty - theme->yres) * (ty - theme->yres);
+
+		/* Penalize configs for resolutions with different aspect ratios,
+		 * and configs that would have to be scaled up. */
+		if (tx * theme->yres != ty * theme->xres)
+			t *= 10;
+		if (tx < theme->xres || ty < theme->yres)
+			t *= 2;
+
+		if (t < mdist) {
+			theme->cfg_xres = tx;
+			theme->cfg_yres = ty;
+			mdist = t;
+		}
+	}
+	closedir(tdir);
+}
+
+/**
+ * Scale the coordinates of all objects of a theme from the resolution
+ * of its config file (cfg_xres x cfg_yres) to the resolution of the theme
+ * (xres x yres).  Has to be called before any assets are loaded.
+ */
+void theme_scale(stheme_t *theme)
+{
+	item *i;
+
+	for (i = theme->objs.head; i != NULL; i = i->next) {
+		obj *o = i->p;
+
+		switch (o->type) {
+		case o_box:
+		{
+			box *b = o->p;
+
+			scale_rect(theme, &b->re);
+			if (b->inter) {
+				scale_rect(theme, &b->inter->re);
+				if (b->curr)
+					box_interpolate(b, b->inter, b->curr);
+			}
+			break;
+		}
+
+		case o_icon:
+		{
+			icon *c = o->p;
+
+			c->x = scale_x1(theme, c->x);
+			c->y = scale_y1(theme, c->y);
+			if (c->crop) {
+				scale_rect(theme, &c->crop_from);
+				scale_rect(theme, &c->crop_to);
+				rect_interpolate(&c->crop_from, &c->crop_to, &c->crop_curr);
+			}
+			break;
+		}
+
+#if WANT_TTF
+		case o_text:
+		{
+			text *t = o->p;
+
+			t->x = scale_x1(theme, t->x);
+			t->y = scale_y1(theme, t->y);
+			break;
+		}
+#endif
+
+#if WANT_MNG
+		/* Only the position of animations can be changed. */
+		case o_anim:
+		{
+			anim *a = o->p;
+
+			a->x = scale_x1(theme, a->x);
+			a->y = scale_y1(theme, a->y);
+			break;
+		}
+#endif
+		default:
+			break;
+		}
+	}
+
+	for (i = theme->rects.head; i != NULL; i = i->next)
+		scale_rect(theme, i->p);
+
+#if WANT_TTF
+	for (i = theme->fonts.head; i != NULL; i = i->next) {
+		font_e *fe = i->p;
+		fe->size = scale_len(theme, fe->size, true);
+	}
+#endif
+
+	theme->tx = scale_x1(theme, theme->tx);
+	theme->ty = scale_y1(theme, theme->ty);
+	if (theme->tw)
+		theme->tw = scale_len(theme, theme->tw, false);
+	if (theme->th)
+		theme->th = scale_len(theme, theme->th, true);
+}
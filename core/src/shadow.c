@@ -0,0 +1,215 @@
+/*
+ * shadow.c - Writing to the framebuffer through a shadow copy.
+ *
+ * Copyright (C) 2004-2008, Michal Januszewski <spock@gentoo.org>
+ *
+ * This file is subject to the terms and conditions of the GNU General Public
+ * License v2.  See the file COPYING in the main directory of this archive for
+ * more details.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "common.h"
+#include "render.h"
+
+#if defined(__GNUC__) && defined(__SSE2__)
+#define SHADOW_SSE2
+#include <emmintrin.h>
+#endif
+
+/*
+ * Video memory is usually uncached or write-combined, which makes writing
+ * to it slow and reading from it even slower.  The shadow holds a copy of
+ * everything that has been written to the framebuffer mapping.  Before a
+ * cache line is written to the framebuffer, it is compared with the
+ * shadow, and skipped if its contents are already there.  The framebuffer
+ * itself is never read.
+ *
+ * The shadow is only trusted for a page after the whole theme area of that
+ * page has been written with put_img(), and stops being trusted whenever
+ * something else might have changed the contents of the framebuffer (a
+ * console switch, a new theme, an effect drawing directly to the screen).
+ */
+
+#define SHADOW_LINE		64	/* size of a cache line, in bytes */
+
+static u8 *shadow = NULL;	/* copy of the whole framebuffer mapping */
+static u8 *map = NULL;		/* the framebuffer mapping */
+static size_t map_len, page_len;
+static bool valid[2];		/* is the shadow of a page up to date? */
+
+/**
+ * Allocate a shadow for a framebuffer mapping.
+ *
+ * @param fb The mapping.
+ * @param len Length of the mapping.
+ * @param page Length of a single page of the mapping.
+ */
+void shadow_init(u8 *fb, size_t len, size_t page)
+{
+	shadow_free();
+
+	shadow = malloc(len);
+	if (!shadow) {
+		iprint(MSG_WARN, "Failed to allocate the shadow framebuffer.\n");
+		return;
+	}
+
+	map = fb;
+	map_len = len;
+	page_len = page;
+}
+
+void shadow_free(void)
+{
+	free(shadow);
+	shadow = NULL;
+	map = NULL;
+	map_len = page_len = 0;
+	shadow_invalidate();
+}
+
+/**
+ * Forget everything that is known about the contents of the framebuffer.
+ */
+void shadow_invalidate(void)
+{
+	valid[0] = valid[1] = false;
+}
+
+/**
+ * Mark the page containing 'dst' as completely covered by the shadow.
+ */
+void shadow_validate(u8 *dst)
+{
+	if (shadow && dst >= map && dst < map + map_len)
+		valid[(dst - map) / page_len] = true;
+}
+
+#ifdef SHADOW_SSE2
+static inline bool line_equal(const u8 *a, const u8 *b)
+{
+	__m128i t;
+
+	t = _mm_and_si128(
+			_mm_and_si128(
+				_mm_cmpeq_epi8(_mm_loadu_si128((__m128i*)a), _mm_loadu_si128((__m128i*)b)),
+				_mm_cmpeq_epi8(_mm_loadu_si128((__m128i*)(a + 16)), _mm_loadu_si128((__m128i*)(b + 16)))),
+			_mm_and_si128(
+				_mm_cmpeq_epi8(_mm_loadu_si128((__m128i*)(a + 32)), _mm_loadu_si128((__m128i*)(b + 32))),
+				_mm_cmpeq_epi8(_mm_loadu_si128((__m128i*)(a + 48)), _mm_loadu_si128((__m128i*)(b + 48)))));
+
+	return _mm_movemask_epi8(t) == 0xffff;
+}
+
+/*
+ * Copy data to the framebuffer, bypassing the cache for all aligned
+ * 16-byte blocks.
+ */
+static void stream_copy(u8 *dst, const u8 *src, size_t len)
+{
+	size_t n = (16 - ((uintptr_t)dst & 15)) & 15;
+
+	if (n > len)
+		n = len;
+
+	memcpy(dst, src, n);
+	dst += n;
+	src += n;
+	len -= n;
+
+	for (; len >= 16; len -= 16, dst += 16, src += 16)
+		_mm_stream_si128((__m128i*)dst, _mm_loadu_si128((__m128i*)src));
+
+	memcpy(dst, src, len);
+}
+
+/* Make the streaming stores visible to everyone else. */
+#define stream_fence()	_mm_sfence()
+#else
+static inline bool line_equal(const u8 *a, const u8 *b)
+{
+	return !memcmp(a, b, SHADOW_LINE);
+}
+
+#define stream_copy		memcpy
+#define stream_fence()	do { } while (0)
+#endif
+
+/*
+ * Write a run of changed data to the framebuffer and the shadow.
+ */
+static void run_put(u8 *dst, u8 *sh, const u8 *src, size_t len)
+{
+	memcpy(sh, src, len);
+	stream_copy(dst, src, len);
+}
+
+/**
+ * Copy data to the framebuffer.
+ *
+ * If 'dst' points to the framebuffer mapping and the shadow of its page
+ * is up to date, only the cache lines which differ from the shadow are
+ * written.  Otherwise, all data is written and the shadow is updated.
+ *
+ * @param dst Destination, not necessarily in the framebuffer.
+ * @param src Source data.
+ * @param len Number of bytes to copy.
+ */
+void shadow_put(u8 *dst, const u8 *src, size_t len)
+{
+	size_t i, n, run;
+	bool changed = false;
+	u8 *sh;
+
+	if (!shadow || dst < map || dst + len > map + map_len) {
+		memcpy(dst, src, len);
+		return;
+	}
+
+	sh = shadow + (dst - map);
+
+	if (!valid[(dst - map) / page_len]) {
+		run_put(dst, sh, src, len);
+		stream_fence();
+		return;
+	}
+
+	/* Compare the data line by line, where the lines are aligned with
+	 * the cache lines of the framebuffer, and write every sequence of
+	 * changed lines at once. */
+	n = SHADOW_LINE - ((uintptr_t)dst & (SHADOW_LINE - 1));
+	run = len;
+
+	for (i = 0; i < len; i += n, n = SHADOW_LINE) {
+		bool eq;
+
+		if (n > len - i)
+			n = len - i;
+
+		if (n == SHADOW_LINE)
+			eq = line_equal(sh + i, src + i);
+		else
+			eq = !memcmp(sh + i, src + i, n);
+
+		if (!eq && run == len) {
+			run = i;
+		} else if (eq && run != len) {
+			run_put(dst + run, sh + run, src + run, i - run);
+			changed = true;
+			run = len;
+		}
+	}
+
+	if (run != len) {
+		run_put(dst + run, sh + run, src + run, len - run);
+		changed = true;
+	}
+
+	if (changed)
+		stream_fence();
+}
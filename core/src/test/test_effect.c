@@ -0,0 +1,195 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include "../common.h"
+#include "../render.h"
+
+/* Large enough for a frame of the effect to take longer than one step
+ * of the fade, so that the executor never has to wait for the clock. */
+#define XRES	2048
+#define YRES	1536
+#define FADETIME	300
+
+/* Frames that have to be rendered while an effect is running.  The
+ * first one can get in before the effect draws anything. */
+#define RENDERS		4
+
+int tests_failed = 0;
+int tests_run = 0;
+
+static u8 *screen;
+
+static void fb_setup(void)
+{
+	memset(&fbd, 0, sizeof(fbd));
+	fbd.var.xres = XRES;
+	fbd.var.yres = YRES;
+	fbd.var.yres_virtual = YRES;
+	fbd.var.bits_per_pixel = 32;
+	fbd.var.red.offset = 16;
+	fbd.var.green.offset = 8;
+	fbd.var.blue.offset = 0;
+	fbd.var.red.length = fbd.var.green.length = fbd.var.blue.length = 8;
+	fbd.fix.visual = FB_VISUAL_TRUECOLOR;
+	fbd.fix.line_length = XRES * 4;
+	fbd.bytespp = 4;
+
+	screen = malloc(XRES * YRES * 4);
+	fb_mem = screen;
+}
+
+static void theme_setup(stheme_t *theme)
+{
+	memset(theme, 0, sizeof(*theme));
+	theme->xres = XRES;
+	theme->yres = YRES;
+	theme->bgbuf = malloc(XRES * YRES * 4);
+	region_init(theme->blit);
+	region_init(theme->stale);
+}
+
+static void theme_cleanup(stheme_t *theme)
+{
+	free(theme->bgbuf);
+	region_free(&theme->blit);
+	region_free(&theme->stale);
+}
+
+/*
+ * Render a frame while an effect is running, the way
+ * fbsplashr_render_screen() does: a band of the background buffer is
+ * changed and marked for blitting.
+ *
+ * @return true if the effect was still running.
+ */
+static bool render_during_effect(stheme_t *theme, int n)
+{
+	rect re = { 0, XRES - 1, 0, 15 };
+	bool active;
+
+	re.y1 = (n * 16) % YRES;
+	re.y2 = re.y1 + 15;
+
+	effect_lock();
+	active = effect_active(theme);
+	if (active) {
+		memset(theme->bgbuf + re.y1 * XRES * 4, n, 16 * XRES * 4);
+		blit_add(theme, &re);
+		effect_update(theme);
+	}
+	effect_unlock();
+
+	return active;
+}
+
+/*
+ * Update a band of the background buffer and have it displayed, the way
+ * the daemon's 'paint rect' command does.  While the effect is running,
+ * the band is expected to show up faded, i.e. different from the
+ * background buffer.
+ *
+ * @return true if the effect was still running.
+ */
+static bool paint_rect_during_effect(stheme_t *theme, int n, int *unfaded)
+{
+	rect re = { 0, XRES - 1, 0, 15 };
+	int off;
+	bool active;
+
+	re.y1 = (n * 16) % YRES;
+	re.y2 = re.y1 + 15;
+	off = re.y1 * XRES * 4;
+
+	effect_lock();
+	active = effect_active(theme);
+	memset(theme->bgbuf + off, 0xff, 16 * XRES * 4);
+	effect_unlock();
+
+	present_rect(theme, &re);
+
+	effect_lock();
+	if (effect_active(theme) && !memcmp(screen + off, theme->bgbuf + off, 16 * XRES * 4))
+		(*unfaded)++;
+	effect_unlock();
+
+	return active;
+}
+
+static void result(bool ok, const char *name)
+{
+	tests_run++;
+	if (!ok) {
+		printf("* Failed: %s\n", name);
+		tests_failed++;
+	} else {
+		printf("* OK: %s\n", name);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	struct fb_cmap cmap = { 0 };
+	stheme_t theme;
+	int i, n, unfaded = 0;
+
+	config.fadetime = FADETIME;
+	fb_setup();
+	theme_setup(&theme);
+
+	/* Fadein in the background. */
+	for (i = 0; i < XRES * YRES; i++)
+		((u32*)theme.bgbuf)[i] = rand();
+
+	effect_lock();
+	fade(&theme, screen, theme.bgbuf, cmap, 1, -1, 0);
+	effect_unlock();
+
+	for (n = 0; render_during_effect(&theme, n + 1); n++)
+		usleep(1000);
+
+	fbsplashr_effect_wait();
+	result(n >= RENDERS, "frames rendered during a fadein");
+	result(!memcmp(screen, theme.bgbuf, XRES * YRES * 4), "fadein ends with the last rendered frame");
+
+	/* Crossfade in the background, from the random image to a flat
+	 * one, with the rendered frames blended in as well. */
+	memcpy(screen, theme.bgbuf, XRES * YRES * 4);
+	memset(theme.bgbuf, 0x40, XRES * YRES * 4);
+
+	effect_lock();
+	crossfade(&theme, screen, theme.bgbuf, 1);
+	effect_unlock();
+
+	for (n = 0; render_during_effect(&theme, n + 1); n++)
+		usleep(1000);
+
+	fbsplashr_effect_wait();
+	result(n >= RENDERS, "frames rendered during a crossfade");
+	result(!memcmp(screen, theme.bgbuf, XRES * YRES * 4), "crossfade ends with the last rendered frame");
+
+	/* Rect updates during a fadein. */
+	for (i = 0; i < XRES * YRES; i++)
+		((u32*)theme.bgbuf)[i] = rand();
+
+	effect_lock();
+	fade(&theme, screen, theme.bgbuf, cmap, 1, -1, 0);
+	effect_unlock();
+
+	for (n = 0; paint_rect_during_effect(&theme, n + 1, &unfaded); n++)
+		usleep(1000);
+
+	fbsplashr_effect_wait();
+	result(n >= RENDERS, "rects painted during a fadein");
+	result(!unfaded, "rects painted during a fadein are faded");
+	result(!memcmp(screen, theme.bgbuf, XRES * YRES * 4), "fadein ends with the last painted rect");
+
+	effect_free();
+	theme_cleanup(&theme);
+	free(screen);
+
+	printf("Ran %d tests, %d failed.\n", tests_run, tests_failed);
+
+	return tests_failed;
+}
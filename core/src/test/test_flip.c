@@ -0,0 +1,221 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include "../common.h"
+#include "../render.h"
+
+#define XRES	64
+#define YRES	48
+#define STRIDE	(80 * 4)
+#define ROUNDS	200
+
+int tests_failed = 0;
+int tests_run = 0;
+
+/* The fake framebuffer: a file with room for two pages, and a record of
+ * the pan requests made by the library. */
+static u8 *vmem;
+static int pans;
+static int pan_y;
+static bool pan_fail;
+
+int ioctl(int fd, unsigned long req, ...)
+{
+	struct fb_var_screeninfo *var;
+	va_list ap;
+
+	va_start(ap, req);
+	var = va_arg(ap, struct fb_var_screeninfo*);
+	va_end(ap);
+
+	if (req != FBIOPAN_DISPLAY)
+		return 0;
+
+	if (pan_fail)
+		return -1;
+
+	pans++;
+	pan_y = var->yoffset;
+	return 0;
+}
+
+static void fb_setup(int fd, int yres_virtual)
+{
+	memset(&fbd, 0, sizeof(fbd));
+	fbd.var.xres = XRES;
+	fbd.var.yres = YRES;
+	fbd.var.yres_virtual = yres_virtual;
+	fbd.var.bits_per_pixel = 32;
+	fbd.fix.line_length = STRIDE;
+	fbd.fix.ypanstep = 1;
+	fbd.bytespp = 4;
+
+	fd_fb = fd;
+	pans = 0;
+	pan_y = 0;
+	pan_fail = false;
+	fb_mem = fb_mmap(fd);
+}
+
+static void theme_setup(stheme_t *theme, int xres, int yres)
+{
+	rect full = { 0, xres - 1, 0, yres - 1 };
+
+	memset(theme, 0, sizeof(*theme));
+	theme->xres = xres;
+	theme->yres = yres;
+	theme->xmarg = (XRES - xres) / 2;
+	theme->ymarg = (YRES - yres) / 2;
+	theme->bgbuf = malloc(xres * yres * 4);
+	region_init(theme->blit);
+	region_init(theme->stale);
+	region_op_rect(&theme->stale, &full, REGION_UNION);
+}
+
+static void theme_cleanup(stheme_t *theme)
+{
+	free(theme->bgbuf);
+	region_free(&theme->blit);
+	region_free(&theme->stale);
+}
+
+/*
+ * Check that the page the display is panned to shows the background
+ * buffer, with black margins around it.
+ */
+static bool check_displayed(stheme_t *theme, u8 *page, bool margins)
+{
+	int x, y;
+	u8 *p;
+
+	for (y = 0; y < YRES; y++) {
+		for (x = 0; x < XRES; x++) {
+			u32 want = 0, have;
+			int tx = x - theme->xmarg, ty = y - theme->ymarg;
+
+			if (tx >= 0 && tx < theme->xres && ty >= 0 && ty < theme->yres)
+				want = ((u32*)theme->bgbuf)[ty * theme->xres + tx];
+			else if (!margins)
+				continue;
+
+			p = page + y * STRIDE + x * 4;
+			have = *(u32*)p;
+			if (have != want)
+				return false;
+		}
+	}
+
+	return true;
+}
+
+static void rnd_update(stheme_t *theme)
+{
+	rect re;
+	int x, y;
+
+	re.x1 = rand() % theme->xres;
+	re.y1 = rand() % theme->yres;
+	re.x2 = re.x1 + rand() % (theme->xres - re.x1);
+	re.y2 = re.y1 + rand() % (theme->yres - re.y1);
+
+	for (y = re.y1; y <= re.y2; y++)
+		for (x = re.x1; x <= re.x2; x++)
+			((u32*)theme->bgbuf)[y * theme->xres + x] = rand();
+
+	blit_add(theme, &re);
+}
+
+static void result(bool ok, const char *name)
+{
+	tests_run++;
+	if (!ok) {
+		printf("* Failed: %s\n", name);
+		tests_failed++;
+	} else {
+		printf("* OK: %s\n", name);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	char path[] = "/tmp/test_flipXXXXXX";
+	stheme_t theme;
+	int fd, i, j;
+	bool ok;
+
+	srand(42);
+	config.pageflip = true;
+
+	fd = mkstemp(path);
+	if (fd < 0 || ftruncate(fd, 2 * YRES * STRIDE)) {
+		printf("* Failed: could not create the fake framebuffer\n");
+		return 1;
+	}
+	unlink(path);
+
+	/* Flipping between two pages, with a theme smaller than the screen. */
+	fb_setup(fd, 2 * YRES);
+	vmem = fb_mem;
+	theme_setup(&theme, XRES - 10, YRES - 6);
+	memset(vmem, 0xaa, 2 * YRES * STRIDE);
+
+	for (i = 0; i < theme.xres * theme.yres; i++)
+		((u32*)theme.bgbuf)[i] = rand();
+
+	present_img(&theme, theme.bgbuf);
+	ok = fbd.flip && pans == 1 && pan_y == YRES && fb_mem == vmem + YRES * STRIDE &&
+		 check_displayed(&theme, fb_mem, true);
+	result(ok, "full frame flipped to page 1");
+
+	for (i = 0, ok = true; i < ROUNDS && ok; i++) {
+		for (j = rand() % 4; j >= 0; j--)
+			rnd_update(&theme);
+
+		present_rects(&theme, theme.bgbuf);
+		ok = pans == i + 2 && pan_y == ((i & 1) ? YRES : 0) &&
+			 fb_mem == vmem + pan_y * STRIDE &&
+			 check_displayed(&theme, fb_mem, true) &&
+			 region_empty(theme.blit);
+	}
+	result(ok, "damage flipped between pages");
+
+	/* Nothing to update, nothing to flip. */
+	present_rects(&theme, theme.bgbuf);
+	result(pans == ROUNDS + 1, "no flip without damage");
+
+	/* The device refuses to pan: the frame is drawn into the displayed page. */
+	pan_fail = true;
+	rnd_update(&theme);
+	present_rects(&theme, theme.bgbuf);
+	ok = !fbd.flip && check_displayed(&theme, fb_mem, false);
+	rnd_update(&theme);
+	present_rects(&theme, theme.bgbuf);
+	ok = ok && check_displayed(&theme, fb_mem, false);
+	result(ok, "fallback on pan failure");
+
+	fb_unmap(fb_mem);
+	theme_cleanup(&theme);
+
+	/* Not enough room for a second page. */
+	fb_setup(fd, 2 * YRES - 1);
+	theme_setup(&theme, XRES, YRES);
+	for (i = 0; i < theme.xres * theme.yres; i++)
+		((u32*)theme.bgbuf)[i] = rand();
+
+	present_img(&theme, theme.bgbuf);
+	rnd_update(&theme);
+	present_rects(&theme, theme.bgbuf);
+	ok = !fbd.flip && pans == 0 && check_displayed(&theme, fb_mem, true);
+	result(ok, "single page without enough virtual space");
+
+	fb_unmap(fb_mem);
+	theme_cleanup(&theme);
+	close(fd);
+
+	printf("Ran %d tests, %d failed.\n", tests_run, tests_failed);
+
+	return tests_failed;
+}
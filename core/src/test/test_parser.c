@@ -125,8 +125,8 @@ int main(int argc, char **argv)
 
 	config->verbosity = FBSPL_VERB_QUIET;
 
-	tmptheme.xres = 1000;
-	tmptheme.yres = 1000;
+	tmptheme.cfg_xres = 1000;
+	tmptheme.cfg_yres = 1000;
 
 	for (i = 0; i < ARRAY_SIZE(icons_ok); i++) {
 		test_parse(parse_icon, true, icons_ok[i], 4);
@@ -0,0 +1,111 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include "../common.h"
+#include "../render.h"
+
+#define MAXLEN	67
+#define GUARD	16
+
+static u8 opacities[] = { 0, 1, 127, 128, 200, 254, 255 };
+
+int tests_failed = 0;
+int tests_run = 0;
+
+static u8 rnd_alpha(void)
+{
+	/* Make sure the special cases are well represented. */
+	switch (rand() % 4) {
+	case 0:  return 0;
+	case 1:  return 255;
+	default: return rand();
+	}
+}
+
+static void rnd_fill(u8 *p, int len)
+{
+	int i;
+
+	for (i = 0; i < len; i++)
+		p[i] = rand();
+}
+
+/*
+ * Run the vectorized and the reference kernel on the same input, both
+ * in-place and with separate background and destination buffers, and
+ * check that the outputs are bit-identical.
+ */
+static bool check_kernel(const pixfmt_accel *acc, bool blend)
+{
+	u8 src[MAXLEN * 4 + GUARD];
+	u8 bg[MAXLEN * 4 + GUARD], bg_ref[MAXLEN * 4 + GUARD];
+	u8 out[MAXLEN * 4 + GUARD], out_ref[MAXLEN * 4 + GUARD];
+	int len, o, i, inplace;
+
+	for (len = 0; len <= MAXLEN; len++) {
+		for (o = 0; o < sizeof(opacities); o++) {
+			for (inplace = 0; inplace < 2; inplace++) {
+				rnd_fill(src, sizeof(src));
+				rnd_fill(bg, sizeof(bg));
+				rnd_fill(out, sizeof(out));
+				if (blend) {
+					for (i = 0; i < len; i++)
+						((rgbacolor*)src)[i].a = rnd_alpha();
+				}
+				memcpy(bg_ref, bg, sizeof(bg));
+				memcpy(out_ref, out, sizeof(out));
+
+				if (blend) {
+					acc->blend(inplace ? bg : out, bg, (rgbacolor*)src, len, 1, opacities[o]);
+					acc->base->blend(inplace ? bg_ref : out_ref, bg_ref, (rgbacolor*)src, len, 1, opacities[o]);
+				} else {
+					acc->convert(inplace ? bg : out, bg, (rgbcolor*)src, len, 1, opacities[o]);
+					acc->base->convert(inplace ? bg_ref : out_ref, bg_ref, (rgbcolor*)src, len, 1, opacities[o]);
+				}
+
+				if (memcmp(bg, bg_ref, sizeof(bg)) || memcmp(out, out_ref, sizeof(out))) {
+					printf("  mismatch: len=%d, opacity=%d, in-place=%d\n", len, opacities[o], inplace);
+					return false;
+				}
+			}
+		}
+	}
+
+	return true;
+}
+
+static void test_kernel(const pixfmt_accel *acc, bool blend)
+{
+	tests_run++;
+
+	if (!check_kernel(acc, blend)) {
+		printf("* Failed: %s %s\n", acc->name, blend ? "blend" : "convert");
+		tests_failed++;
+	} else {
+		printf("* OK: %s %s\n", acc->name, blend ? "blend" : "convert");
+	}
+}
+
+int main(int argc, char **argv)
+{
+	const pixfmt_accel *acc;
+
+	srand(42);
+
+	for (acc = pixfmt_accels; acc->name; acc++) {
+		if (!acc->supported()) {
+			printf("* Skipped: %s (not supported by the CPU)\n", acc->name);
+			continue;
+		}
+
+		if (acc->blend)
+			test_kernel(acc, true);
+		if (acc->convert)
+			test_kernel(acc, false);
+	}
+
+	printf("Ran %d tests, %d failed.\n", tests_run, tests_failed);
+
+	return tests_failed;
+}
@@ -0,0 +1,124 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include "../common.h"
+#include "../render.h"
+#include "../qoi.h"
+
+#define W		193
+#define H		41
+
+int tests_failed = 0;
+int tests_run = 0;
+
+static u8 img[W * H * 4];
+
+static void result(bool ok, const char *name)
+{
+	tests_run++;
+	if (!ok) {
+		printf("* Failed: %s\n", name);
+		tests_failed++;
+	} else {
+		printf("* OK: %s\n", name);
+	}
+}
+
+/*
+ * Decode an image and compare it with the original, whose alpha
+ * channel is ignored for 3-byte output.
+ */
+static bool roundtrip(const u8 *buf, size_t len, int bytespp)
+{
+	struct qoi_dec d;
+	u8 line[W * 4];
+	int x, y, i;
+
+	if (qoi_dec_init(&d, buf, len) || d.w != W || d.h != H)
+		return false;
+
+	for (y = 0; y < H; y++) {
+		qoi_dec_line(&d, line, bytespp);
+		for (x = 0; x < W; x++) {
+			for (i = 0; i < bytespp; i++) {
+				if (line[x * bytespp + i] != img[(y * W + x) * 4 + i])
+					return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+int main(int argc, char **argv)
+{
+	/* Encoding of a 2x1 RGB image: a black pixel (a run of the initial
+	 * pixel) and a small difference to it. */
+	static const u8 tiny_qoi[] = {
+		'q', 'o', 'i', 'f', 0, 0, 0, 2, 0, 0, 0, 1, 3, 0,
+		0xc0, 0x7f,
+		0, 0, 0, 0, 0, 0, 0, 1,
+	};
+	static const u8 tiny[] = { 0, 0, 0, 0xff, 1, 1, 1, 0xff };
+	struct qoi_dec d;
+	u8 *buf, line[W * 4];
+	size_t len;
+	int i, y;
+	bool ok;
+
+	srand(42);
+
+	buf = qoi_encode(tiny, 2, 1, false, &len);
+	result(buf && len == sizeof(tiny_qoi) && !memcmp(buf, tiny_qoi, len),
+		   "encoding follows the QOI specification");
+	free(buf);
+
+	/* Mix smooth gradients, long runs, repeated colors, random noise
+	 * and changes of the alpha channel, so that every operation is used. */
+	for (i = 0; i < W * H; i++) {
+		u8 *p = img + i * 4;
+		int x = i % W, y = i / W;
+
+		if (y < 10) {
+			p[0] = x;
+			p[1] = x + y * 3;
+			p[2] = 255 - x * 2;
+		} else if (y < 20) {
+			p[0] = p[1] = p[2] = (x / 70) * 40;
+		} else if (y < 30) {
+			p[0] = (x % 3) * 80;
+			p[1] = 20;
+			p[2] = (x % 5) * 50;
+		} else {
+			p[0] = rand();
+			p[1] = rand();
+			p[2] = rand();
+		}
+		p[3] = (y > 35) ? rand() : 0xff;
+	}
+
+	buf = qoi_encode(img, W, H, true, &len);
+	result(buf && roundtrip(buf, len, 4), "RGBA image, RGBA output");
+	result(buf && roundtrip(buf, len, 3), "RGBA image, RGB output");
+	free(buf);
+
+	buf = qoi_encode(img, W, H, false, &len);
+	ok = buf && roundtrip(buf, len, 3) && buf[12] == 3;
+	result(ok, "RGB image, RGB output");
+
+	/* A truncated image has to be decoded without reading past its end. */
+	if (buf) {
+		ok = !qoi_dec_init(&d, buf, len / 2);
+		for (y = 0; y < H && ok; y++)
+			qoi_dec_line(&d, line, 4);
+		result(ok && d.p <= buf + len / 2, "truncated image");
+		free(buf);
+	}
+
+	result(qoi_dec_init(&d, tiny, sizeof(tiny)) != 0, "invalid header");
+
+	printf("Ran %d tests, %d failed.\n", tests_run, tests_failed);
+
+	return tests_failed;
+}
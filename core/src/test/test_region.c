@@ -0,0 +1,149 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include "../common.h"
+#include "../render.h"
+
+#define W		48
+#define H		48
+#define ROUNDS	500
+
+int tests_failed = 0;
+int tests_run = 0;
+
+static const char *op_names[] = { "union", "subtract", "intersect" };
+
+static void rnd_rect(rect *re)
+{
+	re->x1 = rand() % W;
+	re->y1 = rand() % H;
+	re->x2 = re->x1 + rand() % (W - re->x1);
+	re->y2 = re->y1 + rand() % (H - re->y1);
+}
+
+static void bitmap_op(u8 *bm, rect *re, enum region_op op)
+{
+	int x, y;
+	bool in;
+
+	for (y = 0; y < H; y++) {
+		for (x = 0; x < W; x++) {
+			in = (x >= re->x1 && x <= re->x2 && y >= re->y1 && y <= re->y2);
+
+			if (op == REGION_UNION)
+				bm[y * W + x] |= in;
+			else if (op == REGION_SUBTRACT)
+				bm[y * W + x] &= !in;
+			else
+				bm[y * W + x] &= in;
+		}
+	}
+}
+
+/*
+ * Check that a region covers exactly the pixels set in a bitmap, that
+ * no pixel is covered twice and that the region is in its canonical
+ * banded and coalesced form.
+ */
+static bool check_region(region *r, u8 *bm)
+{
+	u8 cov[W * H];
+	rect *a, *b;
+	int i, j, k, l, n, x, y;
+
+	memset(cov, 0, sizeof(cov));
+
+	for (i = 0; i < r->num; i++) {
+		a = &r->rects[i];
+		if (a->x2 < a->x1 || a->y2 < a->y1)
+			return false;
+
+		for (y = a->y1; y <= a->y2; y++)
+			for (x = a->x1; x <= a->x2; x++)
+				cov[y * W + x]++;
+
+		if (i == 0)
+			continue;
+
+		b = &r->rects[i - 1];
+		if (a->y1 == b->y1) {
+			/* Same band: same height, sorted, not touching. */
+			if (a->y2 != b->y2 || a->x1 <= b->x2 + 1)
+				return false;
+		} else if (a->y1 <= b->y2) {
+			return false;
+		}
+	}
+
+	/* Adjacent bands with identical spans have to be coalesced. */
+	for (i = 0; i < r->num; i = k) {
+		k = i;
+
+		while (k < r->num && r->rects[k].y1 == r->rects[i].y1)
+			k++;
+		for (l = k; l < r->num && r->rects[l].y1 == r->rects[k].y1; l++)
+			;
+		n = k - i;
+
+		if (k == r->num || l - k != n || r->rects[k].y1 != r->rects[i].y2 + 1)
+			continue;
+
+		for (j = 0; j < n; j++) {
+			if (r->rects[i + j].x1 != r->rects[k + j].x1 ||
+				r->rects[i + j].x2 != r->rects[k + j].x2)
+				break;
+		}
+		if (j == n)
+			return false;
+	}
+
+	return !memcmp(cov, bm, sizeof(cov));
+}
+
+int main(int argc, char **argv)
+{
+	u8 bm[W * H];
+	region r;
+	rect re;
+	int op, i;
+	bool ok;
+
+	srand(42);
+
+	for (op = REGION_UNION; op <= REGION_INTERSECT; op++) {
+		tests_run++;
+		ok = true;
+
+		for (i = 0; i < ROUNDS && ok; i++) {
+			region_init(r);
+			memset(bm, 0, sizeof(bm));
+
+			/* Build a random starting region... */
+			while (rand() % 8) {
+				rnd_rect(&re);
+				region_op_rect(&r, &re, REGION_UNION);
+				bitmap_op(bm, &re, REGION_UNION);
+			}
+
+			/* ...and apply the tested operation to it. */
+			rnd_rect(&re);
+			region_op_rect(&r, &re, op);
+			bitmap_op(bm, &re, op);
+
+			ok = check_region(&r, bm);
+			region_free(&r);
+		}
+
+		if (!ok) {
+			printf("* Failed: region %s\n", op_names[op]);
+			tests_failed++;
+		} else {
+			printf("* OK: region %s\n", op_names[op]);
+		}
+	}
+
+	printf("Ran %d tests, %d failed.\n", tests_run, tests_failed);
+
+	return tests_failed;
+}
@@ -0,0 +1,130 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include "../common.h"
+#include "../render.h"
+
+#define W		(173 * 4)		/* row length, in bytes */
+#define STRIDE	(192 * 4)
+#define H		32
+#define ROUNDS	300
+#define POISON	0x5a
+
+int tests_failed = 0;
+int tests_run = 0;
+
+static u8 fb[STRIDE * H + 64];
+static u8 img[W * H];
+
+static void put(u8 *vmem, int off)
+{
+	int y;
+
+	for (y = 0; y < H; y++)
+		shadow_put(vmem + off + y * STRIDE, img + y * W, W);
+}
+
+/*
+ * Check that the framebuffer holds the image everywhere except in
+ * cache lines which already held the right data before the update
+ * and which have been poisoned since.
+ */
+static bool check(u8 *vmem, int off, u8 *prev)
+{
+	int y, x;
+
+	for (y = 0; y < H; y++) {
+		for (x = 0; x < W; x++) {
+			u8 *p = vmem + off + y * STRIDE + x;
+			u8 *line = (u8*)((unsigned long)p & ~63UL);
+			int lo = (line - (vmem + off + y * STRIDE));
+			bool same = true;
+			int i;
+
+			/* Was the whole cache line (within this row) unchanged? */
+			for (i = max(lo, 0); i < min(lo + 64, W); i++) {
+				if (prev[y * W + i] != img[y * W + i])
+					same = false;
+			}
+
+			if (same ? (*p != POISON) : (*p != img[y * W + x]))
+				return false;
+		}
+	}
+
+	return true;
+}
+
+static void result(bool ok, const char *name)
+{
+	tests_run++;
+	if (!ok) {
+		printf("* Failed: %s\n", name);
+		tests_failed++;
+	} else {
+		printf("* OK: %s\n", name);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	u8 prev[W * H];
+	u8 *vmem = fb;
+	int i, k, off;
+	bool ok;
+
+	srand(42);
+
+	/* Use a misaligned start so that rows don't begin on cache lines. */
+	off = 20;
+
+	shadow_init(vmem, sizeof(fb), sizeof(fb));
+
+	for (i = 0; i < W * H; i++)
+		img[i] = rand();
+
+	/* Nothing is known yet, so everything has to be written. */
+	memset(vmem, POISON, sizeof(fb));
+	put(vmem, off);
+	ok = true;
+	for (i = 0; i < H && ok; i++)
+		ok = !memcmp(vmem + off + i * STRIDE, img + i * W, W);
+	result(ok, "initial write without a valid shadow");
+
+	shadow_validate(vmem);
+
+	for (k = 0, ok = true; k < ROUNDS && ok; k++) {
+		memcpy(prev, img, sizeof(img));
+
+		/* Change a few random spans of the image. */
+		for (i = rand() % 6; i > 0; i--) {
+			int p = rand() % (W * H);
+			int n = 1 + rand() % 300;
+
+			while (n-- && p < W * H)
+				img[p++] = rand();
+		}
+
+		/* Anything not written by the update will stay poisoned. */
+		memset(vmem, POISON, sizeof(fb));
+		put(vmem, off);
+		ok = check(vmem, off, prev);
+	}
+	result(ok, "only changed cache lines are written");
+
+	/* After invalidation, everything has to be written again. */
+	shadow_invalidate();
+	memset(vmem, POISON, sizeof(fb));
+	put(vmem, off);
+	ok = true;
+	for (i = 0; i < H && ok; i++)
+		ok = !memcmp(vmem + off + i * STRIDE, img + i * W, W);
+	result(ok, "full write after invalidation");
+
+	shadow_free();
+
+	printf("Ran %d tests, %d failed.\n", tests_run, tests_failed);
+
+	return tests_failed;
+}
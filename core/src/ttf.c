@@ -35,6 +35,8 @@ int boot_msg_width = 0;
 
 #define DEFAULT_PTSIZE  18
 #define NUM_GRAYS       256
+#define TTF_CHUNK       256
+#define GLYPH_CACHE_MEM (512 << 10)	/* default glyph cache limit, in bytes */
 
 #ifdef TARGET_KERNEL
 int ceil(float a)
@@ -59,26 +61,99 @@ static void Flush_Glyph(c_glyph* glyph)
 		free(glyph->pixmap.buffer);
 		glyph->pixmap.buffer = 0;
 	}
-	glyph->cached = 0;
 }
 
-static void Flush_Cache(TTF_Font* font)
+/* Memory used by a cached glyph, in bytes. */
+static size_t glyph_mem(c_glyph *glyph)
 {
-	int i;
-	int size = sizeof(font->cache) / sizeof(font->cache[0]);
+	size_t len = sizeof(*glyph);
 
-	for(i = 0; i < size; ++i) {
-		if(font->cache[i].cached) {
-			Flush_Glyph(&font->cache[i]);
-		}
+	if (glyph->bitmap.buffer)
+		len += glyph->bitmap.pitch * glyph->bitmap.rows;
+	if (glyph->pixmap.buffer)
+		len += glyph->pixmap.pitch * glyph->pixmap.rows;
 
-	}
-	if(font->scratch.cached) {
-		Flush_Glyph(&font->scratch);
-	}
+	return len;
+}
+
+static unsigned int glyph_hash(FT_Face face, int ptsize, int style, u32 ch)
+{
+	unsigned long h = (unsigned long)face >> 4;
+
+	h = h * 31 + ptsize;
+	h = h * 31 + style;
+	h = h * 31 + ch;
+	h ^= h >> 16;
+
+	return (h * 0x9e3779b1u) & (GLYPH_HASH_SIZE - 1);
+}
+
+/* Remove a glyph from the LRU list. */
+static void glyph_unlink(glyph_cache *gc, c_glyph *glyph)
+{
+	if (glyph->prev)
+		glyph->prev->next = glyph->next;
+	else
+		gc->head = glyph->next;
+
+	if (glyph->next)
+		glyph->next->prev = glyph->prev;
+	else
+		gc->tail = glyph->prev;
+}
+
+/* Put a glyph at the front of the LRU list. */
+static void glyph_link(glyph_cache *gc, c_glyph *glyph)
+{
+	glyph->prev = NULL;
+	glyph->next = gc->head;
+
+	if (gc->head)
+		gc->head->prev = glyph;
+	else
+		gc->tail = glyph;
+
+	gc->head = glyph;
 }
 
-static FT_Error Load_Glyph(TTF_Font* font, unsigned short ch, c_glyph* cached, int want)
+/* Remove a glyph from the cache and free it. */
+static void glyph_drop(glyph_cache *gc, c_glyph *glyph)
+{
+	c_glyph **p;
+
+	p = &gc->hash[glyph_hash(glyph->face, glyph->ptsize, glyph->style, glyph->ch)];
+	while (*p != glyph)
+		p = &(*p)->hnext;
+	*p = glyph->hnext;
+
+	glyph_unlink(gc, glyph);
+	gc->mem -= glyph_mem(glyph);
+	gc->num--;
+
+	Flush_Glyph(glyph);
+	free(glyph);
+}
+
+/*
+ * Drop the least recently used glyphs until the cache fits within its
+ * memory limit.  The glyph 'keep' is in use and is never dropped.
+ */
+static void glyph_trim(glyph_cache *gc, c_glyph *keep)
+{
+	while (gc->mem > gc->max_mem && gc->tail && gc->tail != keep)
+		glyph_drop(gc, gc->tail);
+}
+
+static void glyph_cache_free(glyph_cache *gc)
+{
+	while (gc->tail)
+		glyph_drop(gc, gc->tail);
+
+	free(gc->hash);
+	gc->hash = NULL;
+}
+
+static FT_Error Load_Glyph(TTF_Font* font, u32 ch, c_glyph* cached, int want)
 {
 	FT_Face face;
 	FT_Error error;
@@ -247,52 +322,113 @@ static FT_Error Load_Glyph(TTF_Font* font, unsigned short ch, c_glyph* cached, i
 		}
 	}
 
-	/* We're done, mark this glyph cached */
-	cached->cached = ch;
-
 	return 0;
 }
 
-static FT_Error Find_Glyph(TTF_Font* font, unsigned short ch, int want)
+/*
+ * Look up a glyph in the glyph cache and make sure that the data
+ * specified by 'want' is loaded.  Returns NULL if the glyph cannot be
+ * loaded.
+ */
+static c_glyph *Find_Glyph(glyph_cache *gc, TTF_Font* font, u32 ch, int want)
 {
-	int retval = 0;
+	c_glyph *glyph;
+	unsigned int h;
+	size_t len;
 
-	if(ch < 256) {
-		font->current = &font->cache[ch];
+	if (!gc->hash) {
+		gc->hash = calloc(GLYPH_HASH_SIZE, sizeof(*gc->hash));
+		if (!gc->hash) {
+			iprint(MSG_ERROR, "Out of memory\n");
+			return NULL;
+		}
+
+		if (!gc->max_mem)
+			gc->max_mem = GLYPH_CACHE_MEM;
+	}
+
+	h = glyph_hash(font->face, font->ptsize, font->style, ch);
+
+	for (glyph = gc->hash[h]; glyph; glyph = glyph->hnext) {
+		if (glyph->ch == ch && glyph->face == font->face &&
+			glyph->ptsize == font->ptsize && glyph->style == font->style)
+			break;
+	}
+
+	if (glyph) {
+		gc->hits++;
+		if (glyph != gc->head) {
+			glyph_unlink(gc, glyph);
+			glyph_link(gc, glyph);
+		}
+
+		if ((glyph->stored & want) == want)
+			return glyph;
 	} else {
-		if (font->scratch.cached != ch) {
-			Flush_Glyph(&font->scratch);
+		gc->misses++;
+		glyph = calloc(1, sizeof(*glyph));
+		if (!glyph) {
+			iprint(MSG_ERROR, "Out of memory\n");
+			return NULL;
 		}
-		font->current = &font->scratch;
+
+		glyph->face = font->face;
+		glyph->ptsize = font->ptsize;
+		glyph->style = font->style;
+		glyph->ch = ch;
+		glyph->hnext = gc->hash[h];
+		gc->hash[h] = glyph;
+		glyph_link(gc, glyph);
+		gc->mem += sizeof(*glyph);
+		gc->num++;
 	}
-	if ((font->current->stored & want) != want) {
-		retval = Load_Glyph(font, ch, font->current, want);
+
+	len = glyph_mem(glyph);
+	if (Load_Glyph(font, ch, glyph, want)) {
+		gc->mem += glyph_mem(glyph) - len;
+		glyph_drop(gc, glyph);
+		return NULL;
 	}
-	return retval;
+
+	gc->mem += glyph_mem(glyph) - len;
+	glyph_trim(gc, glyph);
+
+	return glyph;
 }
 
-static unsigned short *UTF8_to_UNICODE(unsigned short *unicode, const char *utf8, int len)
+/*
+ * Decode a UTF-8 string to UCS-4.  Malformed and truncated sequences are
+ * replaced with U+FFFD.
+ */
+static u32 *UTF8_to_UNICODE(u32 *unicode, const char *utf8, int len)
 {
-	int i, j;
-	unsigned short ch;
-
-	for (i=0, j=0; i < len; ++i, ++j) {
-		ch = ((const unsigned char *)utf8)[i];
-		if (ch >= 0xF0) {
-			ch  =  (unsigned short)(utf8[i]&0x07) << 18;
-			ch |=  (unsigned short)(utf8[++i]&0x3F) << 12;
-			ch |=  (unsigned short)(utf8[++i]&0x3F) << 6;
-			ch |=  (unsigned short)(utf8[++i]&0x3F);
-		} else
-		if (ch >= 0xE0) {
-			ch  =  (unsigned short)(utf8[i]&0x3F) << 12;
-			ch |=  (unsigned short)(utf8[++i]&0x3F) << 6;
-			ch |=  (unsigned short)(utf8[++i]&0x3F);
-		} else
-		if (ch >= 0xC0) {
-			ch  =  (unsigned short)(utf8[i]&0x3F) << 6;
-			ch |=  (unsigned short)(utf8[++i]&0x3F);
+	const unsigned char *s = (const unsigned char *)utf8;
+	int i, j, k, n;
+	u32 ch, min;
+
+	for (i = 0, j = 0; i < len; j++) {
+		ch = s[i++];
+
+		if (ch < 0x80) {
+			unicode[j] = ch;
+			continue;
+		} else if (ch >= 0xc2 && ch < 0xe0) {
+			n = 1; ch &= 0x1f; min = 0x80;
+		} else if (ch >= 0xe0 && ch < 0xf0) {
+			n = 2; ch &= 0x0f; min = 0x800;
+		} else if (ch >= 0xf0 && ch < 0xf5) {
+			n = 3; ch &= 0x07; min = 0x10000;
+		} else {
+			unicode[j] = 0xfffd;
+			continue;
 		}
+
+		for (k = 0; k < n && i < len && (s[i] & 0xc0) == 0x80; k++)
+			ch = (ch << 6) | (s[i++] & 0x3f);
+
+		if (k < n || ch < min || ch > 0x10ffff || (ch >= 0xd800 && ch < 0xe000))
+			ch = 0xfffd;
+
 		unicode[j] = ch;
 	}
 	unicode[j] = 0;
@@ -329,15 +465,14 @@ void TTF_Quit(void)
 	TTF_initialized = 0;
 }
 
-static int TTF_SizeUNICODE(TTF_Font *font, const unsigned short *text, int *w, int *h)
+static int TTF_SizeUNICODE(glyph_cache *gc, TTF_Font *font, const u32 *text, int *w, int *h)
 {
 	int status;
-	const unsigned short *ch;
+	const u32 *ch;
 	int x, z;
 	int minx, maxx;
 	int miny, maxy;
 	c_glyph *glyph;
-	FT_Error error;
 
 	/* Initialize everything to 0 */
 	if (! TTF_initialized) {
@@ -350,11 +485,10 @@ static int TTF_SizeUNICODE(TTF_Font *font, const unsigned short *text, int *w, i
 	/* Load each character and sum it's bounding box */
 	x= 0;
 	for (ch=text; *ch; ++ch) {
-		error = Find_Glyph(font, *ch, CACHED_METRICS);
-		if (error) {
+		glyph = Find_Glyph(gc, font, *ch, CACHED_METRICS);
+		if (!glyph) {
 			return -1;
 		}
-		glyph = font->current;
 
 		z = x + glyph->minx;
 		if (minx > z) {
@@ -391,20 +525,20 @@ static int TTF_SizeUNICODE(TTF_Font *font, const unsigned short *text, int *w, i
 	return status;
 }
 
-static void TTF_RenderUNICODE_Shaded(stheme_t *theme, u8 *target, const unsigned short *text,
+static void TTF_RenderUNICODE_Shaded(stheme_t *theme, u8 *target, const u32 *text,
 			      TTF_Font* font, int x, int y, color fcol, rect *re)
 {
-	int xstart, width, height, i, j, row_underline;
-	unsigned int val;
-	const unsigned short* ch;
+	int xstart, width, height, i, j, k, n, row_underline;
+	int c0, c1;
+	const u32* ch;
 	unsigned char* src;
 	unsigned char* dst;
+	unsigned char mask[TTF_CHUNK];
 	int row, col;
 	c_glyph *glyph;
-	FT_Error error;
 
 	/* Get the dimensions of the text surface */
-	if ((TTF_SizeUNICODE(font, text, &width, NULL) < 0) || !width) {
+	if ((TTF_SizeUNICODE(&theme->glyphs, font, text, &width, NULL) < 0) || !width) {
 		iprint(MSG_ERROR, "Text has zero width.\n");
 		return;
 	}
@@ -431,10 +565,9 @@ static void TTF_RenderUNICODE_Shaded(stheme_t *theme, u8 *target, const unsigned
 		FT_Bitmap* current;
 		rect tre;
 
-		error = Find_Glyph(font, *ch, CACHED_METRICS|CACHED_PIXMAP);
-		if (error)
+		glyph = Find_Glyph(&theme->glyphs, font, *ch, CACHED_METRICS|CACHED_PIXMAP);
+		if (!glyph)
 			return;
-		glyph = font->current;
 
 		tre.x1 = xstart + x;
 		tre.x2 = tre.x1 + glyph->advance - 1;
@@ -452,57 +585,58 @@ static void TTF_RenderUNICODE_Shaded(stheme_t *theme, u8 *target, const unsigned
 			goto next_glyph;
 
 		current = &glyph->pixmap;
+
+		/* Columns of the glyph that are to be rendered.  With underlining,
+		 * the gaps between the characters have to be filled too. */
+		c0 = (font->style & TTF_STYLE_UNDERLINE && glyph->minx > 0) ? -glyph->minx : 0;
+		c1 = (font->style & TTF_STYLE_UNDERLINE && *(ch+1)) ?
+				current->width + glyph->advance : current->width;
+
 		for (row = 0; row < ((font->style & TTF_STYLE_UNDERLINE) ? height - glyph->yoffset : current->rows); ++row) {
-			int add;
-			u8 *memlimit = target + theme->xres * theme->yres * fbd.bytespp;
+			int add, jstart, jend;
+			bool underline;
 
-			/* Sanity checks.. */
 			i = y + row + glyph->yoffset;
-			j = tre.x1;
-
 			if (i < re->y1 || i > re->y2)
 				continue;
 
-			if (j >= theme->xres)
-				continue;
+			/* Clip the row to the rendered rect. */
+			jstart = tre.x1 + c0;
+			j = max(jstart, re->x1);
+			jend = min(jstart + c1 - c0 - 1, min(re->x2, theme->xres - 1));
 
-			if (font->style & TTF_STYLE_UNDERLINE && glyph->minx > 0) {
-				j -= glyph->minx;
-			}
+			if (j > jend)
+				continue;
 
 			dst = (unsigned char *)target + (i * theme->xres + j) * fbd.bytespp;
 			src = current->buffer + row*current->pitch;
 
 			add = x & 1;
 			add ^= (add ^ (row+y)) & 1 ? 1 : 3;
+			if ((j - jstart) & 1)
+				add ^= 3;
 
-			for (col = ((font->style & TTF_STYLE_UNDERLINE && glyph->minx > 0) ? -glyph->minx : 0);
-			     col < ((font->style & TTF_STYLE_UNDERLINE && *(ch+1)) ?
-			           current->width + glyph->advance : current->width); col++, j++) {
-
-				if (j < re->x1 || j > re->x2)
-					continue;
-
-				if (j >= theme->xres)
-					continue;
+			underline = (font->style & TTF_STYLE_UNDERLINE && row+glyph->yoffset >= row_underline &&
+						 row+glyph->yoffset < row_underline + font->underline_height);
 
-				if (dst + fbd.bytespp-1 > memlimit)
-					break;
+			for (; j <= jend; j += n) {
+				n = min(TTF_CHUNK, jend - j + 1);
 
-				if (row < current->rows && col < current->width && col >= 0)
-					val = *src++;
-				else
-					val = 0;
+				for (k = 0; k < n; k++) {
+					col = c0 + j + k - jstart;
 
-				/* Handle underline */
-				if (font->style & TTF_STYLE_UNDERLINE && row+glyph->yoffset >= row_underline &&
-				    row+glyph->yoffset < row_underline + font->underline_height) {
-					val = NUM_GRAYS-1;
+					if (underline)
+						mask[k] = NUM_GRAYS-1;
+					else if (row < current->rows && col < current->width && col >= 0)
+						mask[k] = src[col];
+					else
+						mask[k] = 0;
 				}
 
-				put_pixel(fcol.a * val / 255, fcol.r, fcol.g, fcol.b, dst, dst, add);
-				dst += fbd.bytespp;
-				add ^= 3;
+				fbd.pf->mask(dst, dst, mask, n, add, fcol);
+				dst += n * fbd.bytespp;
+				if (n & 1)
+					add ^= 3;
 			}
 		}
 
@@ -518,15 +652,15 @@ next_glyph:
 
 static void TTF_CloseFont(TTF_Font* font)
 {
-	Flush_Cache(font);
 	FT_Done_Face(font->face);
 	free(font);
 }
 
 static void TTF_SetFontStyle(TTF_Font* font, int style)
 {
+	/* The style is a part of the key of the cached glyphs, so glyphs
+	 * rendered with other styles can stay in the cache. */
 	font->style = style;
-	Flush_Cache(font);
 }
 
 static TTF_Font* TTF_OpenFontIndex(const char *file, int ptsize, long index)
@@ -603,6 +737,7 @@ static TTF_Font* TTF_OpenFontIndex(const char *file, int ptsize, long index)
 	}
 
 	/* Set the default font style */
+	font->ptsize = ptsize;
 	font->style = TTF_STYLE_NORMAL;
 	font->glyph_overhang = face->size->metrics.y_ppem / 10;
 	/* x offset = cos(((90.0-12)/360)*2*M_PI), or 12 degree angle */
@@ -625,24 +760,35 @@ static TTF_Font* TTF_OpenFont(const char *file, int ptsize)
 	return a;
 }
 
-int load_fonts(stheme_t *theme)
+/*
+ * Open the font of a font entry.  Can be called by several threads
+ * at the same time.
+ */
+int load_font(font_e *fe)
 {
-	item *i;
+	if (fe->font)
+		return 0;
 
-	for (i = theme->fonts.head; i != NULL; i = i->next) {
-		font_e *fe = (font_e*) i->p;
-		if (!fe->font) {
-			fe->font = TTF_OpenFont(fe->file, fe->size);
-		}
-	}
+	/* Faces cannot be created from the same FreeType library
+	 * concurrently. */
+	pool_lock();
+	fe->font = TTF_OpenFont(fe->file, fe->size);
+	pool_unlock();
 
-	return 0;
+	return fe->font ? 0 : -1;
 }
 
 int free_fonts(stheme_t *theme)
 {
 	item *i, *j;
 
+	if (theme->glyphs.hits || theme->glyphs.misses)
+		iprint(MSG_INFO, "Glyph cache: %lu hits, %lu misses, %d glyphs cached.\n",
+			   theme->glyphs.hits, theme->glyphs.misses, theme->glyphs.num);
+
+	/* The glyphs refer to the faces of the fonts. */
+	glyph_cache_free(&theme->glyphs);
+
 	for (i = theme->fonts.head; i != NULL;) {
 		font_e *fe = (font_e*) i->p;
 		j = i->next;
@@ -661,9 +807,32 @@ int free_fonts(stheme_t *theme)
 	return 0;
 }
 
-static char *text_get_output(char *prg)
+/**
+ * Get the amount of memory used by the loaded fonts of a theme,
+ * including the glyph cache.
+ */
+size_t fonts_mem_usage(stheme_t *theme)
 {
-	char *buf = malloc(1024);
+	size_t len = 0;
+	item *i;
+
+	for (i = theme->fonts.head; i != NULL; i = i->next) {
+		font_e *fe = (font_e*) i->p;
+
+		if (fe->font)
+			len += sizeof(TTF_Font);
+	}
+
+	len += theme->glyphs.mem;
+	if (theme->glyphs.hash)
+		len += GLYPH_HASH_SIZE * sizeof(c_glyph*);
+
+	return len;
+}
+
+static char *text_get_output(arena *a, char *prg)
+{
+	char *buf = arena_alloc(a, 1024);
 	fd_set rfds;
 	struct timeval tv;
 	int pfds[2];
@@ -694,7 +863,7 @@ static char *text_get_output(char *prg)
 		tv.tv_usec = 250000;
 		i = select(pfds[0]+1, &rfds, NULL, NULL, &tv);
 		if (i != -1 && i != 0) {
-			i = read(pfds[0], buf, 1024);
+			i = read(pfds[0], buf, 1023);
 			if (i > 0)
 				buf[i] = 0;
 		}
@@ -706,7 +875,7 @@ static char *text_get_output(char *prg)
 	return buf;
 }
 
-static char *text_eval(char *txt)
+static char *text_eval(arena *a, char *txt)
 {
 	char *p, *t, *ret, *d;
 	int len, i;
@@ -719,7 +888,9 @@ static char *text_eval(char *txt)
 		p = t+1;
 	}
 
-	ret = malloc(len+1);
+	ret = arena_alloc(a, len+1);
+	if (!ret)
+		return NULL;
 
 	p = txt;
 	d = ret;
@@ -760,7 +931,7 @@ static char *text_eval(char *txt)
 
 void text_render(stheme_t *theme, text *ct, rect *re, u8 *target)
 {
-	u16 *t, *p;
+	u32 *t, *p;
 	obj *o = container_of(ct);
 	color col;
 	int x, y;
@@ -796,8 +967,8 @@ void text_render(stheme_t *theme, text *ct, rect *re, u8 *target)
 void text_bnd(stheme_t *theme, text *ct, rect *bnd)
 {
 	obj *o;
-	char *txt = NULL, *txt2;
-	u16 *p;
+	char *txt = NULL;
+	u32 *p;
 	int unicode_len, t;
 	int lines = 1;
 
@@ -806,21 +977,14 @@ void text_bnd(stheme_t *theme, text *ct, rect *bnd)
 	if (!ct->font || !ct->font->font)
 		return;
 
-	if (ct->cache)
-		free(ct->cache);
-
+	/* All temporary strings are allocated from the scratch arena of
+	 * the theme, which is reset at the beginning of every frame. */
 	if (ct->flags & F_TXT_EXEC) {
-		txt = text_get_output(ct->val);
+		txt = text_get_output(&theme->scratch, ct->val);
 	}
 
 	if (ct->flags & F_TXT_EVAL) {
-		if (txt) {
-			txt2 = text_eval(txt);
-			free(txt);
-			txt = txt2;
-		} else {
-			txt = text_eval(ct->val);
-		}
+		txt = text_eval(&theme->scratch, txt ? txt : ct->val);
 	}
 
 	if (ct->flags & F_TXT_MSGLOG) {
@@ -843,7 +1007,9 @@ void text_bnd(stheme_t *theme, text *ct, rect *bnd)
 			return;
 		}
 
-		txt = malloc(sizeof(char) * len);
+		txt = arena_alloc(&theme->scratch, sizeof(char) * len);
+		if (!txt)
+			return;
 		txt[0] = 0;
 
 		for (i = theme->msglog.head; i; i = i->next) {
@@ -858,22 +1024,24 @@ void text_bnd(stheme_t *theme, text *ct, rect *bnd)
 	if (ct->curr_progress >= 0)
 		ct->curr_progress = config.progress;
 
-	/* Copy the Latin-1 text to a UNICODE text buffer */
+	/* Decode the UTF-8 text to a UNICODE text buffer.  A string
+	 * never decodes to more characters than it has bytes. */
 	unicode_len = strlen(txt);
-	ct->cache = (u16 *)malloc((unicode_len+1) * sizeof(*ct->cache));
-
-	if (ct->cache == NULL) {
-		iprint(MSG_ERROR, "Out of memory.\n");
-		return;
+	if (unicode_len + 1 > ct->cache_size) {
+		p = realloc(ct->cache, (unicode_len+1) * sizeof(*ct->cache));
+		if (p == NULL) {
+			iprint(MSG_ERROR, "Out of memory.\n");
+			return;
+		}
+		ct->cache = p;
+		ct->cache_size = unicode_len + 1;
 	}
 
 	UTF8_to_UNICODE(ct->cache, txt, unicode_len);
-	if (txt != ct->val)
-		free(txt);
 	TTF_SetFontStyle(ct->font->font, ct->style);
 
 	/* Get the dimensions of the text surface */
-	if ((TTF_SizeUNICODE(ct->font->font, ct->cache, &bnd->x2, NULL) < 0) || !bnd->x2) {
+	if ((TTF_SizeUNICODE(&theme->glyphs, ct->font->font, ct->cache, &bnd->x2, NULL) < 0) || !bnd->x2) {
 		iprint(MSG_ERROR, "Text has zero width.\n");
 		return;
 	}
@@ -940,5 +1108,5 @@ void text_prerender(stheme_t *theme, text *ct, bool force)
 
 	/* TODO: compare w/ the old bounding rectangle here, reallocate
 	 * the background buffer if necessary */
-	memcpy(&o->bnd, &bnd, sizeof(rect));
+	obj_bnd_set(theme, o, &bnd);
 }
@@ -19,6 +19,17 @@
 
 /* Cached glyph information */
 typedef struct cached_glyph {
+	/* Key: the glyph of code point 'ch' in the face 'face', set to
+	 * 'ptsize' points and rendered with the styles 'style'. */
+	FT_Face face;
+	int ptsize;
+	int style;
+	u32 ch;
+
+	struct cached_glyph *hnext;		/* next glyph in the hash chain */
+	struct cached_glyph *prev;		/* LRU list, most recently used first */
+	struct cached_glyph *next;
+
 	int stored;
 	FT_UInt index;
 	FT_Bitmap bitmap;
@@ -29,9 +40,26 @@ typedef struct cached_glyph {
 	int maxy;
 	int yoffset;
 	int advance;
-	unsigned short cached;
 } c_glyph;
 
+#define GLYPH_HASH_SIZE	1024
+
+/*
+ * Glyphs rendered with all fonts of a theme.  The glyphs are kept in
+ * a hash table and on a list ordered by the time of last use.  When the
+ * glyphs take more than 'max_mem' bytes, the least recently used ones
+ * are dropped.
+ */
+typedef struct glyph_cache {
+	c_glyph **hash;
+	c_glyph *head, *tail;
+	size_t mem;
+	size_t max_mem;
+	int num;
+	unsigned long hits;
+	unsigned long misses;
+} glyph_cache;
+
 struct _TTF_Font {
 	/* Freetype2 maintains all sorts of useful info itself */
 	FT_Face face;
@@ -53,10 +81,8 @@ struct _TTF_Font {
 	int underline_offset;
 	int underline_height;
 
-	/* Cache for style-transformed glyphs */
-	c_glyph *current;
-	c_glyph cache[256];
-	c_glyph scratch;
+	/* Size of the font in points */
+	int ptsize;
 };
 
 typedef struct _TTF_Font TTF_Font;
@@ -71,7 +97,7 @@ void text_render(struct fbspl_theme *theme, struct text *ct, rect *re, u8 *targe
 void text_prerender(struct fbspl_theme *theme, struct text *ct, bool force);
 void text_bnd(struct fbspl_theme *theme, struct text *ct, rect *bnd);
 
-int load_fonts(struct fbspl_theme *theme);
 int free_fonts(struct fbspl_theme *theme);
+size_t fonts_mem_usage(struct fbspl_theme *theme);
 
 #endif
@@ -25,6 +25,7 @@
 
 #include "common.h"
 #include "render.h"
+#include "qoi.h"
 
 static struct option options[] = {
 	{ "cmd",	required_argument, NULL, 0x102 },
@@ -37,12 +38,17 @@ static struct option options[] = {
 	{ "mesg",	required_argument, NULL, 0x109 },
 #endif
 #endif
+	{ "res",	required_argument, NULL, 0x110 },
+	{ "bpp",	required_argument, NULL, 0x111 },
+	{ "output",	required_argument, NULL, 0x112 },
+	{ "scale",	required_argument, NULL, 0x113 },
+	{ "input",	required_argument, NULL, 0x114 },
 	{ "help",	no_argument, NULL, 'h'},
 	{ "verbose", no_argument, NULL, 'v'},
 	{ "quiet",  no_argument, NULL, 'q'},
 };
 
-enum { none, getres, paint, setmode, getmode, repaint } arg_task;
+enum { none, getres, paint, setmode, getmode, repaint, mkbundle, meminfo, qoi } arg_task;
 
 struct cmd {
 	char *name;
@@ -57,6 +63,9 @@ static struct cmd cmds[] = {
 	{ "setmode",	setmode },
 	{ "getmode",	getmode },
 	{ "getres",		getres },
+	{ "mkbundle",	mkbundle },
+	{ "meminfo",	meminfo },
+	{ "qoi",		qoi },
 };
 
 static void usage()
@@ -71,7 +80,10 @@ static void usage()
 #endif
 "  setmode  set global splash mode\n"
 "  getmode  get global splash mode\n"
-"  getres   get the resolution which the silent splash will use\n\n"
+"  getres   get the resolution which the silent splash will use\n"
+"  mkbundle create a precompiled bundle of the theme for a video mode\n"
+"  meminfo  show how much memory the theme uses in a video mode\n"
+"  qoi      convert an image to the QOI format\n\n"
 "Options:\n"
 "  -c, --cmd=CMD       execute command CMD\n"
 "  -v, --verbose       display verbose error messages\n"
@@ -79,6 +91,12 @@ static void usage()
 "  -h, --help          show this help message\n"
 "  -t, --theme=THEME   use theme THEME\n"
 "  -m, --mode=(v|s)    set silent (s) or verbose (v) mode\n"
+"      --res=WxH       use resolution WxH (mkbundle, meminfo)\n"
+"      --bpp=NUM       use color depth NUM (mkbundle, meminfo)\n"
+"      --input=FILE    read the image from FILE (qoi)\n"
+"      --output=FILE   write the bundle or image to FILE (mkbundle, qoi)\n"
+"      --scale=FILTER  scale the theme to the resolution with the 'bilinear'\n"
+"                      or 'lanczos' filter if it has no config file for it\n"
 #ifdef CONFIG_DEPRECATED
 "  -p, --progress=NUM  set progress to NUM/65535 * 100%%\n"
 #ifdef CONFIG_TTF
@@ -89,11 +107,200 @@ static void usage()
 );
 }
 
+/*
+ * Set up fbd for a truecolor mode with the standard layout of
+ * the given color depth.
+ */
+static int fb_layout_set(int bpp)
+{
+	struct fb_bitfield r = { 0 }, g = { 0 }, b = { 0 };
+
+	switch (bpp) {
+	case 15:
+		r.offset = 10; g.offset = 5; b.offset = 0;
+		r.length = g.length = b.length = 5;
+		break;
+	case 16:
+		r.offset = 11; g.offset = 5; b.offset = 0;
+		r.length = b.length = 5;
+		g.length = 6;
+		break;
+	case 24:
+	case 32:
+		r.offset = 16; g.offset = 8; b.offset = 0;
+		r.length = g.length = b.length = 8;
+		break;
+	default:
+		iprint(MSG_ERROR, "Unsupported color depth: %d.\n", bpp);
+		return -1;
+	}
+
+	fbd.var.bits_per_pixel = bpp;
+	fbd.var.red = r;
+	fbd.var.green = g;
+	fbd.var.blue = b;
+	fbd.fix.visual = FB_VISUAL_TRUECOLOR;
+	return 0;
+}
+
+/*
+ * Set up fbd for a video mode.  Values of 0 mean that the respective
+ * setting of the current video mode is used.
+ */
+static int fb_mode_set(int xres, int yres, int bpp)
+{
+	if (xres && yres) {
+		fbd.var.xres = xres;
+		fbd.var.yres = yres;
+	}
+
+	if (bpp && fb_layout_set(bpp))
+		return -1;
+
+	if (!fbd.var.xres || !fbd.var.yres || !fbd.var.bits_per_pixel) {
+		iprint(MSG_ERROR, "Unknown video mode, use --res and --bpp.\n");
+		return -1;
+	}
+
+	fb_layout_init();
+	return 0;
+}
+
+/*
+ * Create a bundle of the current theme for a video mode.
+ */
+static int make_bundle(int xres, int yres, int bpp, char *output)
+{
+	stheme_t *theme;
+	char buf[512];
+	int err;
+
+	if (!config.theme) {
+		iprint(MSG_ERROR, "No theme specified.\n");
+		return -1;
+	}
+
+	if (fb_mode_set(xres, yres, bpp))
+		return -1;
+
+	/* Load the images from their source files, and in the silent mode,
+	 * so that the icons are loaded too. */
+	config.reqmode = FBSPL_MODE_SILENT | FBSPL_MODE_VERBOSE;
+	config.prefetch = FBSPL_PREFETCH_ALL;
+	theme = theme_load(false);
+	if (!theme) {
+		iprint(MSG_ERROR, "Failed to load theme '%s'.\n", config.theme);
+		return -1;
+	}
+
+	if (!output) {
+		bundle_path(buf, sizeof(buf), theme->xres, theme->yres);
+		output = buf;
+	}
+
+	err = bundle_write(theme, output);
+	if (!err)
+		iprint(MSG_INFO, "Wrote %s.\n", output);
+
+	fbsplashr_theme_free(theme);
+	return err;
+}
+
+/*
+ * Print the amount of memory used by the current theme in a video mode.
+ */
+static int mem_report(int xres, int yres, int bpp)
+{
+	stheme_t *theme;
+	theme_mem m;
+
+	if (fb_mode_set(xres, yres, bpp))
+		return -1;
+
+	theme = fbsplashr_theme_load();
+	if (!theme) {
+		iprint(MSG_ERROR, "Failed to load theme '%s'.\n", config.theme);
+		return -1;
+	}
+
+	theme_mem_usage(theme, &m);
+
+	printf("Theme '%s', %dx%d-%d:\n", config.theme, fbd.var.xres, fbd.var.yres,
+		   fbd.var.bits_per_pixel);
+	printf("  background images  %8zu kB\n", m.bg >> 10);
+	printf("  icons              %8zu kB (%d icons, %d stored)\n", m.icons >> 10,
+		   m.icons_num, m.icons_stored);
+	printf("  animations         %8zu kB\n", m.anims >> 10);
+	printf("  fonts              %8zu kB (glyph cache: %lu hits, %lu misses)\n",
+		   m.fonts >> 10, m.glyph_hits, m.glyph_misses);
+	printf("  rendering          %8zu kB\n", m.render >> 10);
+	printf("  total              %8zu kB (%zu kB mapped from the bundle or the image cache)\n",
+		   (m.bg + m.icons + m.anims + m.fonts + m.render) >> 10, m.mapped >> 10);
+
+	fbsplashr_theme_free(theme);
+	return 0;
+}
+
+/*
+ * Convert a PNG or JPEG image to the QOI format.  The alpha channel
+ * is only stored if the image is not completely opaque.
+ */
+static int make_qoi(char *input, char *output)
+{
+	unsigned int w, h, i;
+	bool alpha = false;
+	u8 *img, *out;
+	size_t len;
+	FILE *fp;
+	int err = -1;
+
+	if (!input || !output) {
+		iprint(MSG_ERROR, "Both the input and the output file have to be specified.\n");
+		return -1;
+	}
+
+	if (image_load_rgba(input, &img, &w, &h)) {
+		iprint(MSG_ERROR, "Failed to load image %s.\n", input);
+		return -1;
+	}
+
+	for (i = 0; i < w * h && !alpha; i++)
+		alpha = (img[i * 4 + 3] != 0xff);
+
+	out = qoi_encode(img, w, h, alpha, &len);
+	free(img);
+
+	if (!out) {
+		iprint(MSG_ERROR, "Failed to allocate memory for the encoded image.\n");
+		return -1;
+	}
+
+	fp = fopen(output, "w");
+	if (!fp) {
+		iprint(MSG_ERROR, "Failed to open %s for writing.\n", output);
+	} else {
+		if (fwrite(out, 1, len, fp) == len && !fclose(fp))
+			err = 0;
+		else
+			iprint(MSG_ERROR, "Failed to write %s.\n", output);
+	}
+
+	if (!err)
+		iprint(MSG_INFO, "Wrote %s (%ux%u, %s, %zu bytes).\n", output, w, h,
+			   alpha ? "RGBA" : "RGB", len);
+
+	free(out);
+	return err;
+}
+
 int util_main(int argc, char **argv)
 {
 	unsigned int c, i;
 	int arg_vc = -1;
+	int arg_xres = 0, arg_yres = 0, arg_bpp = 0;
+	char *arg_output = NULL, *arg_input = NULL;
 	stheme_t *theme = NULL;
+	int err = 0;
 
 	fbsplash_lib_init(fbspl_bootup);
 	fbsplashr_init(false);
@@ -152,6 +359,34 @@ int util_main(int argc, char **argv)
 				config.type = fbspl_bootup;
 			break;
 
+		case 0x110:
+			if (sscanf(optarg, "%dx%d", &arg_xres, &arg_yres) != 2) {
+				iprint(MSG_ERROR, "Invalid resolution: %s.\n", optarg);
+				return 1;
+			}
+			break;
+
+		case 0x111:
+			arg_bpp = atoi(optarg);
+			break;
+
+		case 0x112:
+			arg_output = optarg;
+			break;
+
+		case 0x113:
+			if (!strcmp(optarg, "bilinear"))
+				config.scale = FBSPL_SCALE_BILINEAR;
+			else if (!strcmp(optarg, "lanczos"))
+				config.scale = FBSPL_SCALE_LANCZOS;
+			else
+				config.scale = FBSPL_SCALE_NONE;
+			break;
+
+		case 0x114:
+			arg_input = optarg;
+			break;
+
 		/* Verbosity level adjustment. */
 		case 'q':
 			config.verbosity = FBSPL_VERB_QUIET;
@@ -209,6 +444,18 @@ int util_main(int argc, char **argv)
 		printf("%s\n", fbsplash_is_silent() ? "silent" : "verbose");
 		break;
 
+	case mkbundle:
+		err = make_bundle(arg_xres, arg_yres, arg_bpp, arg_output);
+		break;
+
+	case meminfo:
+		err = mem_report(arg_xres, arg_yres, arg_bpp);
+		break;
+
+	case qoi:
+		err = make_qoi(arg_input, arg_output);
+		break;
+
 #ifdef CONFIG_DEPRECATED
 	/* Deprecated. The daemon mode should be used instead. */
 	case paint:
@@ -227,7 +474,7 @@ int util_main(int argc, char **argv)
 	fbsplashr_theme_free(theme);
 	fbsplashr_cleanup();
 	fbsplash_lib_cleanup();
-	return 0;
+	return err ? 1 : 0;
 }
 
 #ifndef UNIFIED_BUILD